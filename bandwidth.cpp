@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <vector>
+
+#include "host-raw-gadget.h"
+#include "bandwidth.h"
+#include "misc.h"
+
+// High speed: 7500 bytes per microframe, of which at most 80% may be
+// periodic (USB 2.0 5.7.3). SuperSpeed: about 62500 bytes per 125 us bus
+// interval after 8b/10b coding, at most 90% periodic (USB 3.2 8.12.5).
+#define BANDWIDTH_UFRAME_BUDGET		6000
+#define BANDWIDTH_SS_UFRAME_BUDGET	56250
+// Reservations repeat with this period; longer intervals are rounded down
+// to it, which over-reserves slightly.
+#define BANDWIDTH_SCHEDULE_LEN	256
+// Per-transaction protocol overhead in byte times (USB 2.0 5.11.3).
+#define BANDWIDTH_ISOC_OVERHEAD	38
+#define BANDWIDTH_INT_OVERHEAD	55
+
+struct bandwidth_slot {
+	unsigned int	period;		// microframes, a power of two
+	unsigned int	phase;
+	unsigned int	bytes;		// per serviced microframe
+};
+
+typedef std::vector<unsigned int> bandwidth_schedule;
+
+static std::map<int, std::vector<struct bandwidth_slot>> bandwidth_reservations;
+
+static unsigned int uframe_budget()
+{
+	return gadget_speed == USB_SPEED_SUPER ?
+		BANDWIDTH_SS_UFRAME_BUDGET : BANDWIDTH_UFRAME_BUDGET;
+}
+
+// Bus time of the endpoint in each microframe it is serviced, or 0 if it is
+// not periodic. Worst-case bit stuffing adds one bit in six at high speed;
+// at SuperSpeed a service interval carries a whole burst.
+static unsigned int endpoint_bytes(const struct raw_gadget_endpoint *ep)
+{
+	const struct usb_endpoint_descriptor *endpoint = &ep->endpoint;
+	int type = usb_endpoint_type(endpoint);
+	if (type != USB_ENDPOINT_XFER_ISOC && type != USB_ENDPOINT_XFER_INT)
+		return 0;
+
+	unsigned int maxp = endpoint->wMaxPacketSize & 0x7ff;
+	if (ep->ss_comp.bLength) {
+		unsigned int packets = ep->ss_comp.bMaxBurst + 1;
+		if (type == USB_ENDPOINT_XFER_ISOC)
+			packets *= USB_SS_MULT(ep->ss_comp.bmAttributes);
+		return packets * maxp;
+	}
+
+	unsigned int transactions = ((endpoint->wMaxPacketSize >> 11) & 0x3) + 1;
+	unsigned int overhead = type == USB_ENDPOINT_XFER_ISOC ?
+		BANDWIDTH_ISOC_OVERHEAD : BANDWIDTH_INT_OVERHEAD;
+	return transactions * (maxp * 7 / 6 + overhead);
+}
+
+static unsigned int endpoint_period(const struct usb_endpoint_descriptor *endpoint)
+{
+	unsigned int interval = endpoint->bInterval;
+	if (interval < 1)
+		interval = 1;
+	if (interval > 16)
+		interval = 16;
+	return std::min(1u << (interval - 1), (unsigned int)BANDWIDTH_SCHEDULE_LEN);
+}
+
+static bandwidth_schedule build_schedule(int except_interface)
+{
+	bandwidth_schedule schedule(BANDWIDTH_SCHEDULE_LEN, 0);
+	for (auto &it : bandwidth_reservations) {
+		if (it.first == except_interface)
+			continue;
+		for (auto &slot : it.second)
+			for (unsigned int i = slot.phase; i < BANDWIDTH_SCHEDULE_LEN; i += slot.period)
+				schedule[i] += slot.bytes;
+	}
+	return schedule;
+}
+
+// Places alt's periodic endpoints into schedule, each at the phase that
+// keeps the busiest microframe lowest (lowest phase on ties, so the result
+// is deterministic). Returns false if any microframe exceeds the budget;
+// all endpoints are placed either way.
+static bool schedule_altsetting(bandwidth_schedule &schedule,
+				const struct raw_gadget_altsetting *alt,
+				std::vector<struct bandwidth_slot> *slots)
+{
+	bool fits = true;
+	for (int i = 0; i < alt->interface.bNumEndpoints; i++) {
+		const struct usb_endpoint_descriptor *endpoint = &alt->endpoints[i].endpoint;
+		struct bandwidth_slot slot;
+		slot.bytes = endpoint_bytes(&alt->endpoints[i]);
+		if (!slot.bytes)
+			continue;
+		slot.period = endpoint_period(endpoint);
+
+		unsigned int best_peak = UINT_MAX;
+		slot.phase = 0;
+		for (unsigned int phase = 0; phase < slot.period; phase++) {
+			unsigned int peak = 0;
+			for (unsigned int j = phase; j < BANDWIDTH_SCHEDULE_LEN; j += slot.period)
+				peak = std::max(peak, schedule[j] + slot.bytes);
+			if (peak < best_peak) {
+				best_peak = peak;
+				slot.phase = phase;
+			}
+		}
+		if (best_peak > uframe_budget())
+			fits = false;
+
+		for (unsigned int j = slot.phase; j < BANDWIDTH_SCHEDULE_LEN; j += slot.period)
+			schedule[j] += slot.bytes;
+		if (slots)
+			slots->push_back(slot);
+	}
+	return fits;
+}
+
+bool bandwidth_fits(int interface, const struct raw_gadget_altsetting *alt)
+{
+	bandwidth_schedule schedule = build_schedule(interface);
+	return schedule_altsetting(schedule, alt, NULL);
+}
+
+void bandwidth_reserve(int interface, const struct raw_gadget_altsetting *alt)
+{
+	bandwidth_schedule schedule = build_schedule(interface);
+	std::vector<struct bandwidth_slot> slots;
+	// An altsetting that does not fit (alt 0 of a new configuration) is
+	// still reserved so that the other interfaces see the load.
+	if (!schedule_altsetting(schedule, alt, &slots))
+		printf("[Warning] Interface %d alt %d exceeds the periodic bandwidth budget\n",
+			alt->interface.bInterfaceNumber, alt->interface.bAlternateSetting);
+	bandwidth_reservations.erase(interface);
+	if (slots.empty())
+		return;
+
+	unsigned int peak = 0;
+	for (unsigned int bytes : schedule)
+		peak = std::max(peak, bytes);
+	printf("Periodic bandwidth: interface %d alt %d reserves %u bytes/uframe, "
+		"busiest microframe %u/%u\n",
+		alt->interface.bInterfaceNumber, alt->interface.bAlternateSetting,
+		bandwidth_altsetting_load(alt), peak, uframe_budget());
+	bandwidth_reservations[interface] = slots;
+}
+
+void bandwidth_release(int interface)
+{
+	bandwidth_reservations.erase(interface);
+}
+
+unsigned int bandwidth_altsetting_load(const struct raw_gadget_altsetting *alt)
+{
+	unsigned int load = 0;
+	for (int i = 0; i < alt->interface.bNumEndpoints; i++) {
+		const struct raw_gadget_endpoint *ep = &alt->endpoints[i];
+		load += endpoint_bytes(ep) / endpoint_period(&ep->endpoint);
+	}
+	return load;
+}
@@ -0,0 +1,21 @@
+#ifndef USB_PROXY_BANDWIDTH_H
+#define USB_PROXY_BANDWIDTH_H
+
+// Periodic bandwidth scheduler: the isochronous and interrupt endpoints of
+// the active altsettings each reserve a phase in a microframe (SuperSpeed:
+// bus interval) schedule, like a host controller does. SET_INTERFACE only selects an
+// altsetting whose endpoints still fit next to the other interfaces'
+// reservations, so two streams on one bus cannot overcommit it.
+
+struct raw_gadget_altsetting;
+
+// Whether alt fits into the schedule in place of the interface's current
+// reservation. interface is the index into the configuration's interfaces.
+bool bandwidth_fits(int interface, const struct raw_gadget_altsetting *alt);
+// Replaces the interface's reservation with alt's periodic endpoints.
+void bandwidth_reserve(int interface, const struct raw_gadget_altsetting *alt);
+void bandwidth_release(int interface);
+// Bytes per microframe alt needs on average, for ranking altsettings.
+unsigned int bandwidth_altsetting_load(const struct raw_gadget_altsetting *alt);
+
+#endif // USB_PROXY_BANDWIDTH_H
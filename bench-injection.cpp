@@ -0,0 +1,480 @@
+#include <map>
+#include <vector>
+
+#include <fcntl.h>
+
+#include "host-raw-gadget.h"
+#include "injection.h"
+
+// Microbenchmarks for the injection rule engine. Every case runs against
+// synthetic packets of the sizes below, and the rule-scanning cases against
+// 1, 10 and 100 rules. Results (ns/packet and heap allocations/packet) are
+// written as JSON; with --baseline they are compared against an earlier run
+// and the exit status is 1 if anything regressed.
+//
+// Cases:
+//   operations       apply_operations() with 4 operations
+//   pipeline         apply_injection_pipeline(), pattern + 4 operations
+//   data_pattern     data injection(), N pattern rules, only the last matches
+//   data_operations  data injection(), N-1 rules for other endpoints, then
+//                    one with 4 operations
+//   control          control injection(), N modify rules, only the last
+//                    matches the request
+//   lua              apply_lua_transform() with a one-line script (HAVE_LUA)
+
+int verbose_level = 0;
+bool please_stop_ep0 = false;
+std::atomic<bool> please_stop_eps(false);
+bool injection_enabled = true;
+std::string injection_file;
+Json::Value injection_config;
+
+/*----------------------------------------------------------------------*/
+
+// Every heap allocation in the process goes through malloc(), including
+// operator new and Lua's default allocator, so counting here covers all of
+// them.
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t nmemb, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static bool count_allocations;
+static uint64_t allocations;
+
+extern "C" void *malloc(size_t size)
+{
+	if (count_allocations)
+		allocations++;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size)
+{
+	if (count_allocations)
+		allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	if (count_allocations)
+		allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+/*----------------------------------------------------------------------*/
+
+#define BENCH_EP_ADDRESS	0x81
+
+static const uint32_t bench_sizes[] = { 8, 512, 1024, 3072, 4096 };
+static const unsigned int bench_rules[] = { 1, 10, 100 };
+
+struct bench_result {
+	std::string	name;
+	unsigned int	rules;
+	uint32_t	size;
+	double		ns_per_packet;
+	double		allocs_per_packet;
+};
+
+static struct usb_raw_transfer_io bench_io;
+static struct usb_raw_control_event bench_event;
+static uint8_t bench_packet[MAX_TRANSFER_SIZE];
+static uint32_t bench_size;
+static Json::Value bench_rule;
+static std::string bench_script;
+
+static double min_time_s = 0.1;
+
+static Json::Value bench_ops()
+{
+	Json::Value ops(Json::arrayValue);
+	Json::Value op;
+	op["type"] = "negate";
+	op["offset"] = 2;
+	ops.append(op);
+	op = Json::Value();
+	op["type"] = "scale";
+	op["offset"] = 3;
+	op["size"] = 2;
+	op["factor"] = 0.5;
+	ops.append(op);
+	op = Json::Value();
+	op["type"] = "xor";
+	op["offset"] = 5;
+	op["mask"] = 0xff;
+	ops.append(op);
+	op = Json::Value();
+	op["type"] = "swap";
+	op["offset"] = 6;
+	op["offset_b"] = 7;
+	ops.append(op);
+	return ops;
+}
+
+static void reset_packet()
+{
+	bench_io.inner.length = bench_size;
+	memcpy(bench_io.data, bench_packet, bench_size);
+}
+
+/*----------------------------------------------------------------------*/
+
+static void setup_operations(unsigned int rules __attribute__((unused)))
+{
+	bench_rule = bench_ops();
+}
+
+static void step_operations()
+{
+	reset_packet();
+	apply_operations(reinterpret_cast<uint8_t *>(bench_io.data),
+			 bench_io.inner.length, bench_rule);
+}
+
+static void setup_pipeline(unsigned int rules __attribute__((unused)))
+{
+	bench_rule = Json::Value();
+	bench_rule["enable"] = true;
+	bench_rule["content_pattern"].append("\\xde\\xad");
+	bench_rule["replacement"] = "\\xfe\\xed";
+	bench_rule["operations"] = bench_ops();
+}
+
+static void step_pipeline()
+{
+	reset_packet();
+	apply_injection_pipeline(bench_io, bench_rule, NULL);
+}
+
+// Rule fields are written the way the injection file spells hex values
+// (81 for 0x81), since the engine decodes them with hexToDecimal().
+static void setup_data_pattern(unsigned int rules)
+{
+	injection_config = Json::Value();
+	for (unsigned int i = 0; i < rules; i++) {
+		Json::Value rule;
+		rule["enable"] = true;
+		rule["ep_address"] = 81;
+		rule["content_pattern"].append(i + 1 == rules ? "\\xde\\xad" : "\\xaa\\xbb");
+		rule["replacement"] = "\\xfe\\xed";
+		injection_config["bulk"].append(rule);
+	}
+}
+
+static void step_data()
+{
+	reset_packet();
+	injection(bench_io, BENCH_EP_ADDRESS, "bulk");
+}
+
+static void setup_data_operations(unsigned int rules)
+{
+	injection_config = Json::Value();
+	for (unsigned int i = 0; i < rules; i++) {
+		Json::Value rule;
+		rule["enable"] = true;
+		rule["ep_address"] = i + 1 == rules ? 81 : 82;
+		rule["operations"] = bench_ops();
+		injection_config["bulk"].append(rule);
+	}
+}
+
+// GET_DESCRIPTOR(HID report) on interface 0; the other rules differ in wIndex.
+static void setup_control(unsigned int rules)
+{
+	injection_config = Json::Value();
+	for (unsigned int i = 0; i < rules; i++) {
+		Json::Value rule;
+		rule["enable"] = true;
+		rule["bRequestType"] = 81;
+		rule["bRequest"] = 6;
+		rule["wValue"] = 2200;
+		rule["wIndex"] = i + 1 == rules ? 0 : i + 1;
+		rule["wLength"] = 1000;
+		rule["operations"] = bench_ops();
+		injection_config["control"]["modify"].append(rule);
+	}
+}
+
+static void step_control()
+{
+	int injection_flags = USB_INJECTION_FLAG_NONE;
+	bench_event.ctrl.bRequestType = USB_DIR_IN | USB_RECIP_INTERFACE;
+	bench_event.ctrl.bRequest = USB_REQ_GET_DESCRIPTOR;
+	bench_event.ctrl.wValue = 0x2200;
+	bench_event.ctrl.wIndex = 0;
+	bench_event.ctrl.wLength = 0x1000;
+	reset_packet();
+	injection(bench_event, bench_io, injection_flags);
+}
+
+#ifdef HAVE_LUA
+static void setup_lua(unsigned int rules __attribute__((unused)))
+{
+	if (!bench_script.empty())
+		return;
+
+	char path[] = "/tmp/bench-injection-XXXXXX.lua";
+	int fd = mkstemps(path, 4);
+	if (fd < 0) {
+		perror("mkstemps");
+		exit(EXIT_FAILURE);
+	}
+	const char *script =
+		"function transform(data, len)\n"
+		"    data[1] = 255 - data[1]\n"
+		"    return data, len\n"
+		"end\n";
+	if (write(fd, script, strlen(script)) != (ssize_t)strlen(script)) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	bench_script = path;
+}
+
+static void step_lua()
+{
+	int len;
+	uint64_t start_ns;
+
+	reset_packet();
+	len = bench_io.inner.length;
+	apply_lua_transform(bench_script, reinterpret_cast<uint8_t *>(bench_io.data),
+			    len, start_ns);
+}
+#endif
+
+struct bench_case {
+	const char	*name;
+	bool		scans_rules;	// run with every entry of bench_rules
+	void		(*setup)(unsigned int rules);
+	void		(*step)();
+};
+
+static const struct bench_case bench_cases[] = {
+	{ "operations",		false,	setup_operations,	step_operations },
+	{ "pipeline",		false,	setup_pipeline,		step_pipeline },
+	{ "data_pattern",	true,	setup_data_pattern,	step_data },
+	{ "data_operations",	true,	setup_data_operations,	step_data },
+	{ "control",		true,	setup_control,		step_control },
+#ifdef HAVE_LUA
+	{ "lua",		false,	setup_lua,		step_lua },
+#endif
+};
+
+/*----------------------------------------------------------------------*/
+
+// Times one case. The rule engine logs matches to stdout, which is sent to
+// /dev/null while the clock runs so the terminal does not dominate.
+static struct bench_result run_case(const struct bench_case *bench,
+				    unsigned int rules, uint32_t size)
+{
+	struct bench_result result;
+	result.name = bench->name;
+	result.rules = rules;
+	result.size = size;
+	result.ns_per_packet = 0;
+	result.allocs_per_packet = 0;
+
+	bench_size = size;
+	bench->setup(rules);
+
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, STDOUT_FILENO);
+	close(devnull);
+
+	for (int i = 0; i < 100; i++)
+		bench->step();
+
+	// Best of three runs of at least min_time_s each.
+	for (int run = 0; run < 3; run++) {
+		uint64_t iterations = 0, batch = 64;
+		uint64_t start_ns = stats_now_ns(), elapsed_ns;
+
+		allocations = 0;
+		count_allocations = true;
+		do {
+			for (uint64_t i = 0; i < batch; i++)
+				bench->step();
+			iterations += batch;
+			batch *= 2;
+			elapsed_ns = stats_now_ns() - start_ns;
+		} while (elapsed_ns < min_time_s * 1e9);
+		count_allocations = false;
+
+		double ns = (double)elapsed_ns / iterations;
+		if (run == 0 || ns < result.ns_per_packet)
+			result.ns_per_packet = ns;
+		result.allocs_per_packet = (double)allocations / iterations;
+	}
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	return result;
+}
+
+static std::string result_key(const std::string &name, unsigned int rules, uint32_t size)
+{
+	return name + "/" + std::to_string(rules) + "/" + std::to_string(size);
+}
+
+// Prints the comparison and returns the number of regressions: ns/packet
+// up by more than threshold_pct, or any increase in allocations/packet.
+static int compare_baseline(const std::vector<struct bench_result> &results,
+			    const std::string &baseline_file, double threshold_pct)
+{
+	Json::Value baseline;
+	Json::Reader jsonReader;
+	std::ifstream ifs(baseline_file.c_str());
+	if (!ifs || !jsonReader.parse(ifs, baseline)) {
+		fprintf(stderr, "Error parsing baseline file: %s\n", baseline_file.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	std::map<std::string, Json::Value> base;
+	for (const Json::Value &entry : baseline["results"])
+		base[result_key(entry["name"].asString(), entry["rules"].asUInt(),
+				entry["size"].asUInt())] = entry;
+
+	int regressions = 0;
+	printf("\nCompared with %s (threshold %.0f%%):\n", baseline_file.c_str(), threshold_pct);
+	for (const struct bench_result &result : results) {
+		auto it = base.find(result_key(result.name, result.rules, result.size));
+		if (it == base.end())
+			continue;
+		double base_ns = it->second["ns_per_packet"].asDouble();
+		double base_allocs = it->second["allocs_per_packet"].asDouble();
+		double delta = base_ns > 0 ? (result.ns_per_packet / base_ns - 1) * 100 : 0;
+		bool slower = delta > threshold_pct;
+		bool more_allocs = result.allocs_per_packet > base_allocs + 0.01;
+
+		printf("  %-16s %3u rules %4u B  %10.1f -> %10.1f ns (%+6.1f%%)  %6.2f -> %6.2f allocs%s\n",
+			result.name.c_str(), result.rules, result.size, base_ns,
+			result.ns_per_packet, delta, base_allocs, result.allocs_per_packet,
+			slower || more_allocs ? "  REGRESSION" : "");
+		if (slower || more_allocs)
+			regressions++;
+	}
+	return regressions;
+}
+
+static void usage()
+{
+	printf("Usage:\n");
+	printf("\t-h/--help: print this help message\n");
+	printf("\t--output FILE: write results to FILE (default bench-injection.json)\n");
+	printf("\t--baseline FILE: compare against results saved by an earlier run\n");
+	printf("\t--threshold PCT: ns/packet increase counted as a regression (default 10)\n");
+	printf("\t--time MS: minimum time per measurement (default 100)\n");
+	printf("\t--filter NAME: run only the named case\n");
+	printf("\t--rule_stats: enable per-rule injection counters, as usb-proxy does\n\n");
+}
+
+int main(int argc, char **argv)
+{
+	std::string output_file = "bench-injection.json";
+	std::string baseline_file;
+	std::string filter;
+	double threshold_pct = 10;
+
+	int opt, lopt, loidx;
+	const char *optstring = "h";
+	const struct option long_options[] = {
+		{"help", no_argument, &lopt, 1},
+		{"output", required_argument, &lopt, 2},
+		{"baseline", required_argument, &lopt, 3},
+		{"threshold", required_argument, &lopt, 4},
+		{"time", required_argument, &lopt, 5},
+		{"filter", required_argument, &lopt, 6},
+		{"rule_stats", no_argument, &lopt, 7},
+		{0, 0, 0, 0}
+	};
+	while ((opt = getopt_long(argc, argv, optstring, long_options, &loidx)) != -1) {
+		if (opt == 0)
+			opt = lopt;
+		switch (opt) {
+		case 2:
+			output_file = optarg;
+			break;
+		case 3:
+			baseline_file = optarg;
+			break;
+		case 4:
+			threshold_pct = std::stod(optarg);
+			break;
+		case 5:
+			min_time_s = std::stod(optarg) / 1000;
+			break;
+		case 6:
+			filter = optarg;
+			break;
+		case 7:
+			injection_rule_stats_init("bulk", 100);
+			injection_rule_stats_init("control/modify", 100);
+			break;
+		default:
+			usage();
+			return opt == 'h' || opt == 1 ? 0 : 1;
+		}
+	}
+
+	for (uint32_t i = 0; i < sizeof(bench_packet); i++)
+		bench_packet[i] = 0x55;
+	bench_packet[0] = 0xde;
+	bench_packet[1] = 0xad;
+
+	std::vector<struct bench_result> results;
+	for (const struct bench_case &bench : bench_cases) {
+		if (!filter.empty() && filter != bench.name)
+			continue;
+		for (unsigned int rules : bench_rules) {
+			if (!bench.scans_rules && rules != 1)
+				continue;
+			for (uint32_t size : bench_sizes) {
+				struct bench_result result = run_case(&bench, rules, size);
+				printf("%-16s %3u rules %4u B  %10.1f ns/packet  %6.2f allocs/packet\n",
+					result.name.c_str(), rules, size,
+					result.ns_per_packet, result.allocs_per_packet);
+				results.push_back(result);
+			}
+		}
+	}
+
+	Json::Value report;
+#ifdef HAVE_LUA
+	report["lua"] = true;
+#else
+	report["lua"] = false;
+#endif
+	report["results"] = Json::Value(Json::arrayValue);
+	for (const struct bench_result &result : results) {
+		Json::Value entry;
+		entry["name"] = result.name;
+		entry["rules"] = result.rules;
+		entry["size"] = result.size;
+		entry["ns_per_packet"] = result.ns_per_packet;
+		entry["allocs_per_packet"] = result.allocs_per_packet;
+		report["results"].append(entry);
+	}
+	std::ofstream ofs(output_file.c_str());
+	Json::StreamWriterBuilder builder;
+	ofs << Json::writeString(builder, report) << std::endl;
+	if (!ofs) {
+		fprintf(stderr, "Error writing %s\n", output_file.c_str());
+		return 1;
+	}
+	printf("Results written to %s\n", output_file.c_str());
+
+	if (!bench_script.empty())
+		unlink(bench_script.c_str());
+
+	if (!baseline_file.empty() &&
+	    compare_baseline(results, baseline_file, threshold_pct) > 0)
+		return 1;
+	return 0;
+}
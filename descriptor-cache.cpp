@@ -0,0 +1,205 @@
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "device-libusb.h"
+#include "descriptor-cache.h"
+#include "snapshot.h"
+
+// Entries are --snapshot files, so an entry can also be served with --clone.
+
+typedef std::tuple<uint8_t, uint8_t, uint16_t, uint16_t> cache_key;
+
+static std::string cache_dir;
+static std::map<cache_key, std::vector<uint8_t>> cache_responses;
+
+static std::mutex cache_mutex;
+static std::condition_variable cache_cond;
+static bool cache_device_pending = false;
+static pthread_t cache_connect_thread;
+static int cache_vendor_id, cache_product_id;
+
+static std::string cache_path(libusb_device *device,
+			      const struct libusb_device_descriptor *desc)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%04x-%04x-%04x", desc->idVendor,
+		desc->idProduct, desc->bcdDevice);
+
+	std::string path = cache_dir + "/" + name;
+	std::string serial = device_serial(device);
+	if (!serial.empty()) {
+		path += "-";
+		for (char c : serial)
+			path += isalnum((unsigned char)c) ? c : '_';
+	}
+	return path + ".json";
+}
+
+void descriptor_cache_enable(const std::string &dir)
+{
+	cache_dir = dir;
+	// Responses that reach the device are recorded for the next start.
+	snapshot_collect();
+}
+
+bool descriptor_cache_enabled()
+{
+	return !cache_dir.empty();
+}
+
+// Compares the entry with the live descriptors, then takes over its control
+// responses. Returns the device speed, or -1 if the entry is missing or stale.
+static int cache_validate(libusb_device *device)
+{
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(device, &desc) != LIBUSB_SUCCESS)
+		return -1;
+	std::string path = cache_path(device, &desc);
+
+	Json::Value entry;
+	Json::Reader jsonReader;
+	std::ifstream ifs(path.c_str());
+	if (!ifs || !jsonReader.parse(ifs, entry)) {
+		printf("Descriptor cache: no entry %s\n", path.c_str());
+		return -1;
+	}
+
+	if (get_descriptor(device) != LIBUSB_SUCCESS)
+		return -1;
+	int speed = libusb_get_device_speed(device);
+	Json::Value live = snapshot_json(speed);
+	if (entry["speed"] != live["speed"] || entry["device"] != live["device"] ||
+	    entry["configurations"] != live["configurations"]) {
+		printf("Descriptor cache: %s is stale, ignoring it\n", path.c_str());
+		return -1;
+	}
+
+	const Json::Value &control = entry["control"];
+	for (unsigned int i = 0; i < control.size(); i++) {
+		struct usb_ctrlrequest ctrl;
+		memset(&ctrl, 0, sizeof(ctrl));
+		ctrl.bRequestType = json_uint(control[i]["bRequestType"], 0);
+		ctrl.bRequest = json_uint(control[i]["bRequest"], 0);
+		ctrl.wValue = json_uint(control[i]["wValue"], 0);
+		ctrl.wIndex = json_uint(control[i]["wIndex"], 0);
+		std::vector<uint8_t> data = parse_hex_bytes(control[i].get("data", "").asString());
+
+		cache_key key(ctrl.bRequestType, ctrl.bRequest, (uint16_t)ctrl.wValue,
+			      (uint16_t)ctrl.wIndex);
+		cache_responses[key] = data;
+		// Keep responses this run does not fetch again in the next entry.
+		snapshot_record_control(&ctrl, data.data(), data.size());
+	}
+
+	printf("Descriptor cache: using %s (%zu control responses)\n",
+		path.c_str(), cache_responses.size());
+	return speed;
+}
+
+int descriptor_cache_load(int vendor_id, int product_id)
+{
+	// A private context: connect_device() sets up its own later.
+	libusb_context *ctx = NULL;
+	if (libusb_init(&ctx) < 0)
+		return -1;
+
+	libusb_device **list;
+	ssize_t cnt = libusb_get_device_list(ctx, &list);
+	int speed = -1;
+	for (ssize_t i = 0; i < cnt; i++) {
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(list[i], &desc) != LIBUSB_SUCCESS)
+			continue;
+		if (device_matches(list[i], &desc, vendor_id, product_id)) {
+			speed = cache_validate(list[i]);
+			break;
+		}
+	}
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
+	libusb_exit(ctx);
+
+	if (speed < 0)
+		cache_responses.clear();
+	return speed;
+}
+
+static void *cache_connect(void *arg __attribute__((unused)))
+{
+	pthread_setname_np(pthread_self(), "device-connect");
+
+	while (!please_stop_ep0 && device_backend->connect(cache_vendor_id, cache_product_id))
+		sleep(1);
+	// Later reconnects run before ep0 starts and may refetch them.
+	keep_device_descriptors = false;
+	if (!please_stop_ep0)
+		printf("Device opened successfully\n");
+
+	std::lock_guard<std::mutex> guard(cache_mutex);
+	cache_device_pending = false;
+	cache_cond.notify_all();
+	return NULL;
+}
+
+void descriptor_cache_connect_async(int vendor_id, int product_id)
+{
+	cache_vendor_id = vendor_id;
+	cache_product_id = product_id;
+	cache_device_pending = true;
+	// ep0 is already serving from the tree cache_validate() checked.
+	keep_device_descriptors = true;
+	pthread_create(&cache_connect_thread, 0, cache_connect, nullptr);
+}
+
+void descriptor_cache_connect_join()
+{
+	if (cache_connect_thread && pthread_join(cache_connect_thread, NULL))
+		fprintf(stderr, "Error join device-connect thread\n");
+	cache_connect_thread = 0;
+}
+
+bool descriptor_cache_device_pending()
+{
+	std::lock_guard<std::mutex> guard(cache_mutex);
+	return cache_device_pending;
+}
+
+bool descriptor_cache_wait_device()
+{
+	std::unique_lock<std::mutex> lock(cache_mutex);
+	while (cache_device_pending && !please_stop_ep0)
+		cache_cond.wait_for(lock, std::chrono::milliseconds(100));
+	return !please_stop_ep0;
+}
+
+int descriptor_cache_control(const struct usb_ctrlrequest *ctrl, uint8_t *data)
+{
+	if ((ctrl->bRequestType & (USB_DIR_IN | USB_TYPE_MASK)) != (USB_DIR_IN | USB_TYPE_STANDARD) ||
+	    ctrl->bRequest != USB_REQ_GET_DESCRIPTOR)
+		return -1;
+
+	auto it = cache_responses.find(cache_key(ctrl->bRequestType, ctrl->bRequest,
+						 ctrl->wValue, ctrl->wIndex));
+	if (it == cache_responses.end())
+		return -1;
+	int length = std::min<int>(it->second.size(), ctrl->wLength);
+	memcpy(data, it->second.data(), length);
+	return length;
+}
+
+void descriptor_cache_store()
+{
+	if (!descriptor_cache_enabled() || !dev_handle || !device_config_desc)
+		return;
+
+	libusb_device *device = libusb_get_device(dev_handle);
+	std::string path = cache_path(device, &device_device_desc);
+	if (!snapshot_write_file(path, libusb_get_device_speed(device))) {
+		fprintf(stderr, "Error writing descriptor cache: %s\n", path.c_str());
+		return;
+	}
+	printf("Descriptor cache: saved %s\n", path.c_str());
+}
@@ -0,0 +1,38 @@
+#ifndef USB_PROXY_DESCRIPTOR_CACHE_H
+#define USB_PROXY_DESCRIPTOR_CACHE_H
+
+#include <string>
+#include <stdint.h>
+#include <linux/usb/ch9.h>
+
+// Descriptor cache (--descriptor_cache DIR): one snapshot per device, keyed
+// by VID, PID, bcdDevice and serial number. On start the entry is validated
+// against the descriptors the kernel already holds for the device, which
+// needs no I/O to the device itself. On a hit the gadget comes up at once,
+// enumeration GET_DESCRIPTOR requests are answered from the cache, and the
+// device is opened (and reset) in the background. Everything else waits for
+// the device. The entry is rewritten at exit.
+
+void descriptor_cache_enable(const std::string &dir);
+bool descriptor_cache_enabled();
+
+// Looks up and validates the entry for the device. On a hit, fills
+// device_device_desc and device_config_desc and returns the device's
+// libusb_speed; returns -1 on a miss.
+int descriptor_cache_load(int vendor_id, int product_id);
+// Opens the device on a separate thread after a hit.
+void descriptor_cache_connect_async(int vendor_id, int product_id);
+void descriptor_cache_connect_join();
+// True while the device is still being opened behind a cache hit.
+bool descriptor_cache_device_pending();
+// Waits for the background open; returns false if the proxy is stopping.
+bool descriptor_cache_wait_device();
+
+// Copies the cached response to a standard GET_DESCRIPTOR request into data
+// (at most wLength bytes). Returns its length, or -1 if it is not cached.
+int descriptor_cache_control(const struct usb_ctrlrequest *ctrl, uint8_t *data);
+
+// Saves the connected device's descriptors and recorded responses.
+void descriptor_cache_store();
+
+#endif // USB_PROXY_DESCRIPTOR_CACHE_H
@@ -0,0 +1,47 @@
+#ifndef USB_PROXY_DEVICE_BACKEND_H
+#define USB_PROXY_DEVICE_BACKEND_H
+
+#include <stdint.h>
+#include <linux/usb/ch9.h>
+
+struct iso_batch_result;
+struct ep_stats;
+struct transfer_stamps;
+
+// Device-side backend: everything the proxy core needs from the physical
+// device. connect() must fill device_device_desc and device_config_desc.
+// Return values follow libusb (LIBUSB_SUCCESS, LIBUSB_ERROR_*), whatever the
+// backend, so the endpoint loops need not care which one is in use.
+struct device_backend {
+	const char	*name;
+
+	int	(*connect)(int vendor_id, int product_id);
+	void	(*disconnect)();
+	// Returns a libusb_speed value.
+	int	(*get_speed)();
+	void	(*reset)();
+	void	(*set_configuration)(int configuration);
+	void	(*claim_interface)(int interface);
+	void	(*release_interface)(int interface);
+	void	(*set_interface_alt_setting)(int interface, int altsetting);
+	int	(*control_request)(const usb_ctrlrequest *setup_packet, int *nbytes,
+				unsigned char **dataptr, int timeout);
+	int	(*send_data)(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
+				int length, int timeout);
+	int	(*send_iso_data)(uint8_t endpoint, uint8_t *dataptr, int length,
+				int timeout, struct ep_stats *stats,
+				const struct transfer_stamps *stamps);
+	int	(*receive_data)(uint8_t endpoint, uint8_t attributes,
+				uint16_t maxPacketSize, uint8_t **dataptr,
+				int *length, int timeout);
+	int	(*receive_iso_data_batched)(uint8_t endpoint, uint16_t maxPacketSize,
+				struct iso_batch_result *result, int batch_size,
+				int timeout);
+};
+
+extern struct device_backend *device_backend;
+
+extern struct device_backend libusb_device_backend;
+extern struct device_backend emulated_device_backend;
+
+#endif // USB_PROXY_DEVICE_BACKEND_H
@@ -0,0 +1,657 @@
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "device-libusb.h"
+#include "probes.h"
+#include "trace.h"
+
+// In-process emulated device, described by a JSON file (--emulate_device).
+// It stands in for libusb so the whole proxy core can run, and be benchmarked,
+// without USB hardware. The file provides the descriptors plus, per endpoint,
+// a source (IN) or sink (OUT) with a packet rate and payload size:
+//
+// {
+//   "speed": "high",
+//   "device": { "idVendor": "0x1d6b", "idProduct": "0x0104", "bcdUSB": "0x0200",
+//               "bMaxPacketSize0": 64, "iManufacturer": 1, "iProduct": 2 },
+//   "strings": [ "usb-proxy", "Emulated device" ],
+//   "configurations": [ {
+//     "bConfigurationValue": 1, "bmAttributes": "0x80", "MaxPower": 50,
+//     "interfaces": [ { "altsettings": [ {
+//       "bInterfaceClass": 255,
+//       "endpoints": [
+//         { "bEndpointAddress": "0x81", "bmAttributes": 2, "wMaxPacketSize": 512,
+//           "source": "counter", "rate": 1000, "payload": 512 },
+//         { "bEndpointAddress": "0x01", "bmAttributes": 2, "wMaxPacketSize": 512,
+//           "sink": "discard" }
+//       ] } ] } ] } ],
+//   "control": [ { "bRequestType": "0xc0", "bRequest": 1, "wValue": 0,
+//                  "wIndex": 0, "data": "01 02 03 04" } ]
+// }
+//
+// Numbers may be JSON integers or "0x"-prefixed strings. Sources: "counter"
+// (little-endian sequence number followed by a rolling byte pattern), "zero",
+// "loopback" (replays what the host wrote to "loopback_from"). Sinks:
+// "discard" and "loopback". "rate" is in packets per second; 0 means as fast
+// as possible for bulk, and one packet per service interval (from bInterval)
+// for interrupt and isochronous endpoints. "payload" defaults to the
+// endpoint's wMaxPacketSize.
+//
+// Configurations, altsettings and endpoints take an "extra" hex string with
+// the class-specific descriptors that follow them. "control" entries answer
+// matching requests (wLength is not compared; the response is truncated to
+// it) ahead of the built-in descriptors, which is how --snapshot files
+// reproduce a device's exact responses.
+//
+// With --replay_trace, endpoints that appear in the trace ignore these
+// settings: IN endpoints become "trace" sources, and OUT endpoints "verify"
+// sinks (with --replay_verify) or "discard" sinks. Neither is paced here;
+// the trace carries its own timing.
+
+#define EMULATED_LOOPBACK_DEPTH	64
+
+struct emulated_loopback {
+	std::mutex			mutex;
+	std::condition_variable		cond;
+	std::deque<std::vector<uint8_t>>	packets;
+};
+
+struct emulated_endpoint {
+	uint8_t			address;
+	uint8_t			attributes;
+	uint8_t			bInterval;
+	std::string		behavior;	// source for IN, sink for OUT
+	uint8_t			loopback_from;
+	int			payload;
+	double			rate;
+	uint64_t		next_ns;	// pacing; touched by one thread only
+	uint32_t		sequence;
+	struct trace_stream	*trace;		// --replay_trace
+	std::atomic<uint64_t>	packets;
+	std::atomic<uint64_t>	bytes;
+};
+
+static Json::Value emulated_config;
+static int emulated_speed = LIBUSB_SPEED_HIGH;
+static std::vector<std::vector<uint8_t>> emulated_config_blobs;
+static std::map<uint8_t, struct emulated_endpoint *> emulated_endpoints;
+static std::map<uint8_t, struct emulated_loopback *> emulated_loopbacks;
+
+static uint64_t emulated_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void emulated_sleep_until(uint64_t deadline_ns)
+{
+	struct timespec ts;
+	ts.tv_sec = deadline_ns / 1000000000ull;
+	ts.tv_nsec = deadline_ns % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+// Service interval of a periodic endpoint, following the descriptor's speed
+// encoding.
+static uint64_t service_interval_ns(const struct emulated_endpoint *ep)
+{
+	uint8_t interval = ep->bInterval ? ep->bInterval : 1;
+	bool isoc = (ep->attributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_ISOC;
+
+	if (emulated_speed >= LIBUSB_SPEED_HIGH || isoc) {
+		if (interval > 16)
+			interval = 16;
+		uint64_t unit = emulated_speed >= LIBUSB_SPEED_HIGH ? 125000 : 1000000;
+		return unit << (interval - 1);
+	}
+	return (uint64_t)interval * 1000000;
+}
+
+static uint64_t packet_interval_ns(const struct emulated_endpoint *ep)
+{
+	if (ep->rate > 0)
+		return (uint64_t)(1e9 / ep->rate);
+	if ((ep->attributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_BULK)
+		return 0;
+	return service_interval_ns(ep);
+}
+
+// Waits for the endpoint's next packet slot. Slots are scheduled from the
+// previous one rather than from "now", so the long-run rate does not drift;
+// after a stall of more than one slot the schedule restarts.
+static void emulated_pace(struct emulated_endpoint *ep)
+{
+	uint64_t interval = packet_interval_ns(ep);
+	if (!interval || ep->trace)
+		return;
+
+	uint64_t now = emulated_now_ns();
+	if (ep->next_ns + interval < now)
+		ep->next_ns = now;
+	if (ep->next_ns > now)
+		emulated_sleep_until(ep->next_ns);
+	ep->next_ns += interval;
+}
+
+static struct emulated_endpoint *emulated_endpoint_get(uint8_t address)
+{
+	auto it = emulated_endpoints.find(address);
+	return it != emulated_endpoints.end() ? it->second : NULL;
+}
+
+static struct emulated_loopback *emulated_loopback_get(uint8_t address)
+{
+	auto it = emulated_loopbacks.find(address);
+	return it != emulated_loopbacks.end() ? it->second : NULL;
+}
+
+// Produces one IN packet into data; returns its length, or -1 when a
+// loopback source has nothing to replay within timeout.
+static int emulated_fill(struct emulated_endpoint *ep, uint8_t *data,
+			 int max_length, int timeout)
+{
+	int length = ep->payload ? std::min(ep->payload, max_length) : max_length;
+
+	if (ep->behavior == "trace") {
+		length = trace_replay_next(ep->trace, data, max_length);
+		if (length < 0) {
+			// Exhausted: idle like a device with nothing to send.
+			if (errno == ENODATA)
+				usleep(std::min(timeout, 10) * 1000);
+			return -1;
+		}
+	}
+	else if (ep->behavior == "loopback") {
+		struct emulated_loopback *loopback = emulated_loopback_get(ep->loopback_from);
+		if (!loopback)
+			return -1;
+		std::unique_lock<std::mutex> lock(loopback->mutex);
+		if (!loopback->cond.wait_for(lock, std::chrono::milliseconds(timeout),
+				[loopback] { return !loopback->packets.empty(); }))
+			return -1;
+		std::vector<uint8_t> packet = loopback->packets.front();
+		loopback->packets.pop_front();
+		loopback->cond.notify_all();
+		length = std::min((int)packet.size(), max_length);
+		memcpy(data, packet.data(), length);
+	}
+	else if (ep->behavior == "zero") {
+		memset(data, 0, length);
+	}
+	else {
+		uint32_t sequence = ep->sequence++;
+		for (int i = 0; i < length; i++)
+			data[i] = i < 4 ? (uint8_t)(sequence >> (8 * i)) : (uint8_t)(sequence + i);
+	}
+
+	ep->packets++;
+	ep->bytes += length;
+	return length;
+}
+
+static void emulated_consume(struct emulated_endpoint *ep, const uint8_t *data,
+			     int length, int timeout)
+{
+	if (ep->behavior == "verify") {
+		trace_replay_verify(ep->trace, data, length);
+	}
+	else if (ep->behavior == "loopback") {
+		struct emulated_loopback *loopback = emulated_loopback_get(ep->address);
+		std::unique_lock<std::mutex> lock(loopback->mutex);
+		// Back-pressure the host rather than dropping data.
+		loopback->cond.wait_for(lock, std::chrono::milliseconds(timeout),
+			[loopback] { return loopback->packets.size() < EMULATED_LOOPBACK_DEPTH; });
+		if (loopback->packets.size() < EMULATED_LOOPBACK_DEPTH)
+			loopback->packets.emplace_back(data, data + length);
+		loopback->cond.notify_all();
+	}
+
+	ep->packets++;
+	ep->bytes += length;
+}
+
+/*----------------------------------------------------------------------*/
+
+static void append_descriptor(std::vector<uint8_t> &blob, const uint8_t *desc,
+			      int length, const std::vector<uint8_t> &extra)
+{
+	blob.insert(blob.end(), desc, desc + length);
+	blob.insert(blob.end(), extra.begin(), extra.end());
+}
+
+static const unsigned char *copy_extra(const std::vector<uint8_t> &extra)
+{
+	if (extra.empty())
+		return NULL;
+	unsigned char *copy = new unsigned char[extra.size()];
+	memcpy(copy, extra.data(), extra.size());
+	return copy;
+}
+
+static void load_endpoint(const Json::Value &json, struct libusb_endpoint_descriptor *desc,
+			  std::vector<uint8_t> &blob)
+{
+	std::vector<uint8_t> extra = parse_hex_bytes(json.get("extra", "").asString());
+
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = USB_DT_ENDPOINT_SIZE;
+	desc->bDescriptorType = USB_DT_ENDPOINT;
+	desc->bEndpointAddress = json_uint(json["bEndpointAddress"], 0);
+	desc->bmAttributes = json_uint(json["bmAttributes"], USB_ENDPOINT_XFER_BULK);
+	desc->wMaxPacketSize = json_uint(json["wMaxPacketSize"], 64);
+	desc->bInterval = json_uint(json["bInterval"], 0);
+	desc->extra = copy_extra(extra);
+	desc->extra_length = extra.size();
+
+	uint8_t raw[USB_DT_ENDPOINT_SIZE] = {
+		USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, desc->bEndpointAddress,
+		desc->bmAttributes, (uint8_t)desc->wMaxPacketSize,
+		(uint8_t)(desc->wMaxPacketSize >> 8), desc->bInterval,
+	};
+	append_descriptor(blob, raw, sizeof(raw), extra);
+
+	if (emulated_endpoints.count(desc->bEndpointAddress))
+		return;
+
+	struct emulated_endpoint *ep = new struct emulated_endpoint();
+	bool dir_in = desc->bEndpointAddress & USB_DIR_IN;
+	ep->address = desc->bEndpointAddress;
+	ep->attributes = desc->bmAttributes;
+	ep->bInterval = desc->bInterval;
+	ep->behavior = dir_in ? json.get("source", "counter").asString() :
+				json.get("sink", "discard").asString();
+	ep->loopback_from = json_uint(json["loopback_from"], 0);
+	ep->payload = json_uint(json["payload"], 0);
+	ep->rate = json.get("rate", 0).asDouble();
+	ep->trace = trace_replaying() ? trace_replay_stream(ep->address) : NULL;
+	if (ep->trace)
+		ep->behavior = dir_in ? "trace" : trace_replay_verifying() ? "verify" : "discard";
+	emulated_endpoints[ep->address] = ep;
+	if (!dir_in && ep->behavior == "loopback")
+		emulated_loopbacks[ep->address] = new struct emulated_loopback();
+}
+
+static void load_altsetting(const Json::Value &json, int interface_number, int alt_number,
+			    struct libusb_interface_descriptor *desc, std::vector<uint8_t> &blob)
+{
+	const Json::Value &endpoints = json["endpoints"];
+	std::vector<uint8_t> extra = parse_hex_bytes(json.get("extra", "").asString());
+
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = USB_DT_INTERFACE_SIZE;
+	desc->bDescriptorType = USB_DT_INTERFACE;
+	desc->bInterfaceNumber = json_uint(json["bInterfaceNumber"], interface_number);
+	desc->bAlternateSetting = json_uint(json["bAlternateSetting"], alt_number);
+	desc->bNumEndpoints = endpoints.size();
+	desc->bInterfaceClass = json_uint(json["bInterfaceClass"], USB_CLASS_VENDOR_SPEC);
+	desc->bInterfaceSubClass = json_uint(json["bInterfaceSubClass"], 0);
+	desc->bInterfaceProtocol = json_uint(json["bInterfaceProtocol"], 0);
+	desc->iInterface = json_uint(json["iInterface"], 0);
+	desc->extra = copy_extra(extra);
+	desc->extra_length = extra.size();
+
+	uint8_t raw[USB_DT_INTERFACE_SIZE] = {
+		USB_DT_INTERFACE_SIZE, USB_DT_INTERFACE, desc->bInterfaceNumber,
+		desc->bAlternateSetting, desc->bNumEndpoints, desc->bInterfaceClass,
+		desc->bInterfaceSubClass, desc->bInterfaceProtocol, desc->iInterface,
+	};
+	append_descriptor(blob, raw, sizeof(raw), extra);
+
+	struct libusb_endpoint_descriptor *eps = NULL;
+	if (endpoints.size()) {
+		eps = new struct libusb_endpoint_descriptor[endpoints.size()];
+		for (unsigned int i = 0; i < endpoints.size(); i++)
+			load_endpoint(endpoints[i], &eps[i], blob);
+	}
+	desc->endpoint = eps;
+}
+
+static struct libusb_config_descriptor *load_config(const Json::Value &json,
+						    std::vector<uint8_t> &blob)
+{
+	const Json::Value &interfaces = json["interfaces"];
+	std::vector<uint8_t> extra = parse_hex_bytes(json.get("extra", "").asString());
+	struct libusb_config_descriptor *config = new struct libusb_config_descriptor;
+
+	memset(config, 0, sizeof(*config));
+	config->bLength = USB_DT_CONFIG_SIZE;
+	config->bDescriptorType = USB_DT_CONFIG;
+	config->bNumInterfaces = interfaces.size();
+	config->bConfigurationValue = json_uint(json["bConfigurationValue"], 1);
+	config->iConfiguration = json_uint(json["iConfiguration"], 0);
+	config->bmAttributes = json_uint(json["bmAttributes"], USB_CONFIG_ATT_ONE);
+	config->MaxPower = json_uint(json["MaxPower"], 50);
+	config->extra = copy_extra(extra);
+	config->extra_length = extra.size();
+
+	blob.assign(USB_DT_CONFIG_SIZE, 0);
+	blob.insert(blob.end(), extra.begin(), extra.end());
+	struct libusb_interface *ifaces = new struct libusb_interface[interfaces.size()];
+	for (unsigned int i = 0; i < interfaces.size(); i++) {
+		const Json::Value &alts = interfaces[i]["altsettings"];
+		struct libusb_interface_descriptor *altsettings =
+			new struct libusb_interface_descriptor[alts.size()];
+		for (unsigned int j = 0; j < alts.size(); j++)
+			load_altsetting(alts[j], i, j, &altsettings[j], blob);
+		ifaces[i].altsetting = altsettings;
+		ifaces[i].num_altsetting = alts.size();
+	}
+	config->interface = ifaces;
+	config->wTotalLength = blob.size();
+
+	blob[0] = USB_DT_CONFIG_SIZE;
+	blob[1] = USB_DT_CONFIG;
+	blob[2] = config->wTotalLength & 0xff;
+	blob[3] = config->wTotalLength >> 8;
+	blob[4] = config->bNumInterfaces;
+	blob[5] = config->bConfigurationValue;
+	blob[6] = config->iConfiguration;
+	blob[7] = config->bmAttributes;
+	blob[8] = config->MaxPower;
+	return config;
+}
+
+static int emulated_connect(int vendor_id __attribute__((unused)),
+			    int product_id __attribute__((unused)))
+{
+	Json::Reader jsonReader;
+	std::ifstream ifs(emulated_device_file.c_str());
+	if (!ifs || !jsonReader.parse(ifs, emulated_config)) {
+		fprintf(stderr, "Error parsing emulated device file: %s\n",
+			emulated_device_file.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	std::string speed = emulated_config.get("speed", "high").asString();
+	if (speed == "low")
+		emulated_speed = LIBUSB_SPEED_LOW;
+	else if (speed == "full")
+		emulated_speed = LIBUSB_SPEED_FULL;
+	else if (speed == "super")
+		emulated_speed = LIBUSB_SPEED_SUPER;
+	else
+		emulated_speed = LIBUSB_SPEED_HIGH;
+
+	const Json::Value &dev = emulated_config["device"];
+	const Json::Value &configs = emulated_config["configurations"];
+	memset(&device_device_desc, 0, sizeof(device_device_desc));
+	device_device_desc.bLength = USB_DT_DEVICE_SIZE;
+	device_device_desc.bDescriptorType = USB_DT_DEVICE;
+	device_device_desc.bcdUSB = json_uint(dev["bcdUSB"], 0x0200);
+	device_device_desc.bDeviceClass = json_uint(dev["bDeviceClass"], 0);
+	device_device_desc.bDeviceSubClass = json_uint(dev["bDeviceSubClass"], 0);
+	device_device_desc.bDeviceProtocol = json_uint(dev["bDeviceProtocol"], 0);
+	device_device_desc.bMaxPacketSize0 = json_uint(dev["bMaxPacketSize0"], 64);
+	device_device_desc.idVendor = json_uint(dev["idVendor"], 0x1d6b);
+	device_device_desc.idProduct = json_uint(dev["idProduct"], 0x0104);
+	device_device_desc.bcdDevice = json_uint(dev["bcdDevice"], 0x0100);
+	device_device_desc.iManufacturer = json_uint(dev["iManufacturer"], 0);
+	device_device_desc.iProduct = json_uint(dev["iProduct"], 0);
+	device_device_desc.iSerialNumber = json_uint(dev["iSerialNumber"], 0);
+	device_device_desc.bNumConfigurations = configs.size();
+
+	device_config_desc = new struct libusb_config_descriptor *[configs.size()];
+	emulated_config_blobs.resize(configs.size());
+	for (unsigned int i = 0; i < configs.size(); i++)
+		device_config_desc[i] = load_config(configs[i], emulated_config_blobs[i]);
+
+	printf("Emulated device %04x:%04x from %s (%u configuration(s), %zu endpoint(s))\n",
+		device_device_desc.idVendor, device_device_desc.idProduct,
+		emulated_device_file.c_str(), configs.size(), emulated_endpoints.size());
+	return 0;
+}
+
+static void emulated_disconnect()
+{
+	printf("Emulated device endpoints:\n");
+	for (auto &entry : emulated_endpoints) {
+		struct emulated_endpoint *ep = entry.second;
+		printf("  EP%02x %-8s %lu packets, %lu bytes\n", ep->address,
+			ep->behavior.c_str(), (unsigned long)ep->packets,
+			(unsigned long)ep->bytes);
+	}
+}
+
+static int emulated_get_speed()
+{
+	return emulated_speed;
+}
+
+static void emulated_reset()
+{
+	for (auto &entry : emulated_endpoints)
+		entry.second->next_ns = 0;
+}
+
+static void emulated_set_configuration(int configuration)
+{
+	if (verbose_level)
+		printf("Emulated device: configuration %d\n", configuration);
+}
+
+static void emulated_claim_interface(int interface __attribute__((unused)))
+{
+}
+
+static void emulated_release_interface(int interface __attribute__((unused)))
+{
+}
+
+static void emulated_set_interface_alt_setting(int interface, int altsetting)
+{
+	if (verbose_level)
+		printf("Emulated device: interface %d altsetting %d\n", interface, altsetting);
+}
+
+static int emulated_string_descriptor(uint8_t index, uint8_t *data)
+{
+	if (index == 0) {
+		const uint8_t langids[4] = { 4, USB_DT_STRING, 0x09, 0x04 };
+		memcpy(data, langids, sizeof(langids));
+		return sizeof(langids);
+	}
+
+	const Json::Value &strings = emulated_config["strings"];
+	if (index > strings.size())
+		return -1;
+	std::string str = strings[index - 1].asString();
+	int length = std::min((int)str.size(), 126);
+	data[0] = 2 + 2 * length;
+	data[1] = USB_DT_STRING;
+	for (int i = 0; i < length; i++) {
+		data[2 + 2 * i] = str[i];
+		data[3 + 2 * i] = 0;
+	}
+	return data[0];
+}
+
+static int emulated_control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
+				    unsigned char **dataptr, int timeout __attribute__((unused)))
+{
+	bool dir_in = setup_packet->bRequestType & USB_DIR_IN;
+	// Responses are cut to wLength; string descriptors are built whole.
+	std::vector<uint8_t> data(std::max<size_t>(setup_packet->wLength, 256));
+	int length = -1;
+
+	PROXY_PROBE(libusb_submit, 0, setup_packet->wLength, setup_packet->bRequest);
+
+	const Json::Value &canned = emulated_config["control"];
+	for (unsigned int i = 0; i < canned.size() && length < 0; i++) {
+		const Json::Value &rule = canned[i];
+		if (json_uint(rule["bRequestType"], 0) != setup_packet->bRequestType ||
+		    json_uint(rule["bRequest"], 0) != setup_packet->bRequest ||
+		    json_uint(rule["wValue"], 0) != setup_packet->wValue ||
+		    json_uint(rule["wIndex"], 0) != setup_packet->wIndex)
+			continue;
+		std::vector<uint8_t> response = parse_hex_bytes(rule.get("data", "").asString());
+		length = std::min(response.size(), data.size());
+		memcpy(data.data(), response.data(), length);
+	}
+
+	if (length < 0 && setup_packet->bRequestType == USB_DIR_IN &&
+	    setup_packet->bRequest == USB_REQ_GET_DESCRIPTOR) {
+		uint8_t type = setup_packet->wValue >> 8;
+		uint8_t index = setup_packet->wValue & 0xff;
+		if (type == USB_DT_DEVICE) {
+			const struct libusb_device_descriptor *dev = &device_device_desc;
+			uint8_t raw[USB_DT_DEVICE_SIZE] = {
+				USB_DT_DEVICE_SIZE, USB_DT_DEVICE,
+				(uint8_t)dev->bcdUSB, (uint8_t)(dev->bcdUSB >> 8),
+				dev->bDeviceClass, dev->bDeviceSubClass, dev->bDeviceProtocol,
+				dev->bMaxPacketSize0,
+				(uint8_t)dev->idVendor, (uint8_t)(dev->idVendor >> 8),
+				(uint8_t)dev->idProduct, (uint8_t)(dev->idProduct >> 8),
+				(uint8_t)dev->bcdDevice, (uint8_t)(dev->bcdDevice >> 8),
+				dev->iManufacturer, dev->iProduct, dev->iSerialNumber,
+				dev->bNumConfigurations,
+			};
+			length = USB_DT_DEVICE_SIZE;
+			memcpy(data.data(), raw, length);
+		}
+		else if (type == USB_DT_CONFIG && index < emulated_config_blobs.size()) {
+			const std::vector<uint8_t> &blob = emulated_config_blobs[index];
+			length = std::min(blob.size(), data.size());
+			memcpy(data.data(), blob.data(), length);
+		}
+		else if (type == USB_DT_STRING) {
+			length = emulated_string_descriptor(index, data.data());
+		}
+	}
+	else if (length < 0 && setup_packet->bRequest == USB_REQ_GET_STATUS && dir_in) {
+		length = 2;
+		memset(data.data(), 0, length);
+	}
+	else if (length < 0 && !dir_in) {
+		// Accept class and vendor OUT requests the file does not mention.
+		length = 0;
+	}
+
+	PROXY_PROBE(libusb_complete, 0, length < 0 ? 0 : length, length < 0 ? LIBUSB_ERROR_PIPE : 0);
+	if (length < 0)
+		return -1;
+
+	if (dir_in) {
+		length = std::min(length, (int)setup_packet->wLength);
+		memcpy(*dataptr, data.data(), length);
+		*nbytes = length;
+	}
+	else {
+		*nbytes = setup_packet->wLength;
+	}
+	return 0;
+}
+
+static int emulated_send_data(uint8_t endpoint, uint8_t attributes __attribute__((unused)),
+			      uint8_t *dataptr, int length, int timeout)
+{
+	struct emulated_endpoint *ep = emulated_endpoint_get(endpoint);
+	if (!ep)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	PROXY_PROBE(libusb_submit, endpoint, length, 0);
+	emulated_pace(ep);
+	emulated_consume(ep, dataptr, length, timeout);
+	PROXY_PROBE(libusb_complete, endpoint, length, 0);
+	return LIBUSB_SUCCESS;
+}
+
+// Unlike the libusb backend the packet is consumed synchronously, at the
+// endpoint's service rate; the buffer is owned and freed here as the libusb
+// completion callback would.
+static int emulated_send_iso_data(uint8_t endpoint, uint8_t *dataptr, int length,
+				  int timeout, struct ep_stats *stats,
+				  const struct transfer_stamps *stamps)
+{
+	struct emulated_endpoint *ep = emulated_endpoint_get(endpoint);
+	if (!ep)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	PROXY_PROBE(libusb_submit, endpoint, length, 0);
+	emulated_pace(ep);
+	emulated_consume(ep, dataptr, length, timeout);
+	PROXY_PROBE(libusb_complete, endpoint, length, 0);
+	if (stamps)
+		ep_stats_record(stats, stamps, stats_now_ns(), length);
+	delete[] dataptr;
+	return LIBUSB_SUCCESS;
+}
+
+static int emulated_receive_data(uint8_t endpoint, uint8_t attributes __attribute__((unused)),
+				 uint16_t maxPacketSize, uint8_t **dataptr, int *length,
+				 int timeout)
+{
+	struct emulated_endpoint *ep = emulated_endpoint_get(endpoint);
+	if (!ep)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	*dataptr = new uint8_t[maxPacketSize];
+	PROXY_PROBE(libusb_submit, endpoint, maxPacketSize, 0);
+	emulated_pace(ep);
+	int filled = emulated_fill(ep, *dataptr, maxPacketSize, timeout);
+	PROXY_PROBE(libusb_complete, endpoint, filled < 0 ? 0 : filled,
+		    filled < 0 ? LIBUSB_ERROR_TIMEOUT : 0);
+	if (filled < 0)
+		return LIBUSB_ERROR_TIMEOUT;
+	*length = filled;
+	return LIBUSB_SUCCESS;
+}
+
+static int emulated_receive_iso_data_batched(uint8_t endpoint, uint16_t maxPacketSize,
+					     struct iso_batch_result *result,
+					     int batch_size, int timeout)
+{
+	struct emulated_endpoint *ep = emulated_endpoint_get(endpoint);
+	if (!ep)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	if (batch_size < 1)
+		batch_size = 1;
+	if (batch_size > ISO_BATCH_SIZE_MAX)
+		batch_size = ISO_BATCH_SIZE_MAX;
+
+	memset(result, 0, sizeof(*result));
+	result->buffer = new uint8_t[maxPacketSize * batch_size];
+	result->num_packets = batch_size;
+
+	PROXY_PROBE(libusb_submit, endpoint, maxPacketSize * batch_size, batch_size);
+	uint8_t *packet_ptr = result->buffer;
+	for (int i = 0; i < batch_size; i++) {
+		// A loopback source with nothing to replay yields an empty slot,
+		// as an idle isochronous device would.
+		emulated_pace(ep);
+		int filled = emulated_fill(ep, packet_ptr, maxPacketSize,
+					   ep->behavior == "loopback" ? 0 : timeout);
+		result->packets[i].data = packet_ptr;
+		result->packets[i].actual_length = filled < 0 ? 0 : filled;
+		result->packets[i].status = LIBUSB_TRANSFER_COMPLETED;
+		result->total_length += result->packets[i].actual_length;
+		if (filled > 0)
+			result->success = true;
+		packet_ptr += maxPacketSize;
+	}
+	result->completed_ns = stats_now_ns();
+	PROXY_PROBE(libusb_complete, endpoint, result->total_length, 0);
+	return LIBUSB_SUCCESS;
+}
+
+struct device_backend emulated_device_backend = {
+	.name =				"emulated",
+	.connect =			emulated_connect,
+	.disconnect =			emulated_disconnect,
+	.get_speed =			emulated_get_speed,
+	.reset =			emulated_reset,
+	.set_configuration =		emulated_set_configuration,
+	.claim_interface =		emulated_claim_interface,
+	.release_interface =		emulated_release_interface,
+	.set_interface_alt_setting =	emulated_set_interface_alt_setting,
+	.control_request =		emulated_control_request,
+	.send_data =			emulated_send_data,
+	.send_iso_data =		emulated_send_iso_data,
+	.receive_data =			emulated_receive_data,
+	.receive_iso_data_batched =	emulated_receive_iso_data_batched,
+};
@@ -1,6 +1,11 @@
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 
 #include "device-libusb.h"
+#include "probes.h"
+#include "proxy.h"
 
 libusb_device 			**devs;
 libusb_device_handle 		*dev_handle;
@@ -11,19 +16,42 @@ struct libusb_device_descriptor		device_device_desc;
 struct libusb_config_descriptor		**device_config_desc;
 
 pthread_t hotplug_monitor_thread;
+std::atomic<bool> keep_device_descriptors(false);
+
+static std::mutex arrival_mutex;
+static std::condition_variable arrival_cond;
+static std::deque<libusb_device *> arrived_devices;
+static std::atomic<bool> hotplug_monitor_stop(false);
+// Guards dev_handle against the hotplug callback while connect_device()
+// replaces it. Never held across a libusb call that handles events.
+static std::mutex dev_handle_mutex;
 
 int hotplug_callback(struct libusb_context *ctx __attribute__((unused)),
-			struct libusb_device *dev __attribute__((unused)),
-			libusb_hotplug_event envet __attribute__((unused)),
+			struct libusb_device *dev,
+			libusb_hotplug_event event,
 			void *user_data __attribute__((unused))) {
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		std::lock_guard<std::mutex> guard(arrival_mutex);
+		arrived_devices.push_back(libusb_ref_device(dev));
+		arrival_cond.notify_all();
+		return 0;
+	}
+
+	// Other devices matching the filters may come and go.
+	{
+		std::lock_guard<std::mutex> guard(dev_handle_mutex);
+		if (!dev_handle || libusb_get_device(dev_handle) != dev)
+			return 0;
+	}
 	printf("Hotplug event: device disconnected, stopping proxy...\n");
-	kill(0, SIGINT);
+	stop_ep0_loop_unplugged();
 	return 0;
 }
 
 void *hotplug_monitor(void *arg __attribute__((unused))) {
+	pthread_setname_np(pthread_self(), "libusb-events");
 	printf("Start hotplug_monitor/event thread, thread id(%d)\n", gettid());
-	while(true) {
+	while (!hotplug_monitor_stop) {
 		// This is the SOLE thread that calls libusb_handle_events.
 		// All other threads (ISO IN, ISO OUT) submit async transfers
 		// and spin-wait on their completion flags.  This avoids event
@@ -31,10 +59,21 @@ void *hotplug_monitor(void *arg __attribute__((unused))) {
 		struct timeval tv = {1, 0};
 		libusb_handle_events_timeout(context, &tv);
 	}
+	return NULL;
+}
+
+static void free_descriptor() {
+	if (!device_config_desc)
+		return;
+	for (int i = 0; i < device_device_desc.bNumConfigurations; i++)
+		libusb_free_config_descriptor(device_config_desc[i]);
+	delete[] device_config_desc;
+	device_config_desc = NULL;
 }
 
 int get_descriptor(libusb_device *device) {
 	int result;
+	free_descriptor();
 	result = libusb_get_device_descriptor(device, &device_device_desc);
 	if (result != LIBUSB_SUCCESS) {
 		if (verbose_level) {
@@ -44,7 +83,7 @@ int get_descriptor(libusb_device *device) {
 		return result;
 	}
 
-	device_config_desc = new struct libusb_config_descriptor *[device_device_desc.bNumConfigurations];
+	device_config_desc = new struct libusb_config_descriptor *[device_device_desc.bNumConfigurations]();
 	for (int i = 0; i < device_device_desc.bNumConfigurations; i++) {
 		result = libusb_get_config_descriptor(device, i, &device_config_desc[i]);
 		if (result != LIBUSB_SUCCESS) {
@@ -59,65 +98,118 @@ int get_descriptor(libusb_device *device) {
 	return LIBUSB_SUCCESS;
 }
 
-int connect_device(int vendor_id, int product_id) {
-	int result;
-	result = libusb_init(&context);
-	if (result < 0) {
-		fprintf(stderr, "Init error: %s\n", libusb_strerror((libusb_error)result));
-		return 1;
-	}
-	libusb_set_debug(context, 3);
+std::string device_serial(libusb_device *device) {
+	// Read from sysfs, as the kernel got it at enumeration, so that the
+	// device need not be opened.
+	uint8_t ports[8];
+	int n = libusb_get_port_numbers(device, ports, sizeof(ports));
+	if (n <= 0)
+		return "";
+
+	std::string path = "/sys/bus/usb/devices/" +
+		std::to_string(libusb_get_bus_number(device)) + "-";
+	for (int i = 0; i < n; i++)
+		path += (i ? "." : "") + std::to_string(ports[i]);
+	path += "/serial";
+
+	std::string serial;
+	std::ifstream ifs(path.c_str());
+	std::getline(ifs, serial);
+	return serial;
+}
 
-	libusb_device *found = NULL;
+bool device_matches(libusb_device *device, const struct libusb_device_descriptor *desc,
+			int vendor_id, int product_id) {
+	if (desc->bDeviceClass == LIBUSB_CLASS_HUB)
+		return false;
+	if (!serial_filter.empty() && device_serial(device) != serial_filter)
+		return false;
+	if (vendor_id == -1 && product_id == -1)
+		return true;
+	return (vendor_id == desc->idVendor || vendor_id == LIBUSB_HOTPLUG_MATCH_ANY) &&
+		(product_id == desc->idProduct || product_id == LIBUSB_HOTPLUG_MATCH_ANY);
+}
 
-	while (found == NULL) {
+// Takes the next arrived device that passes the filters, waiting for one.
+// Returns a referenced device, or NULL if the proxy is stopping.
+static libusb_device *wait_for_device(int vendor_id, int product_id) {
+	std::unique_lock<std::mutex> lock(arrival_mutex);
+	bool reported = false;
+	while (!please_stop_ep0) {
+		while (!arrived_devices.empty()) {
+			libusb_device *dvc = arrived_devices.front();
+			arrived_devices.pop_front();
+			struct libusb_device_descriptor desc;
+			if (libusb_get_device_descriptor(dvc, &desc) == LIBUSB_SUCCESS &&
+			    device_matches(dvc, &desc, vendor_id, product_id))
+				return dvc;
+			libusb_unref_device(dvc);
+		}
+		if (!reported) {
+			printf("Waiting for the target device to arrive\n");
+			reported = true;
+		}
+		arrival_cond.wait_for(lock, std::chrono::milliseconds(100));
+	}
+	return NULL;
+}
+
+// Fallback for platforms without hotplug support.
+static libusb_device *poll_for_device(int vendor_id, int product_id) {
+	while (!please_stop_ep0) {
 		int cnt = libusb_get_device_list(context, &devs);
 		if (cnt < 0) {
 			fprintf(stderr, "Get Device Error: %s\n",
 					libusb_strerror((libusb_error)cnt));
-			return 1;
+			return NULL;
 		}
 		if (verbose_level)
 			printf("%d Devices in list\n", cnt);
 
+		// Match on the device descriptor alone; the configuration
+		// descriptors are only fetched for the device that is picked.
+		libusb_device *found = NULL;
 		for (int i = 0; i < cnt; i++) {
-			libusb_device *dvc = devs[i];
-			result = get_descriptor(dvc);
-			if (result != LIBUSB_SUCCESS)
-				continue;
-
-			if (device_device_desc.bDeviceClass == LIBUSB_CLASS_HUB)
+			struct libusb_device_descriptor desc;
+			if (libusb_get_device_descriptor(devs[i], &desc) != LIBUSB_SUCCESS)
 				continue;
-
-			if (vendor_id == -1 && product_id == -1) {
-				found = dvc;
-				break;
-			}
-			else if ((vendor_id == device_device_desc.idVendor || vendor_id == LIBUSB_HOTPLUG_MATCH_ANY) &&
-				(product_id == device_device_desc.idProduct || product_id == LIBUSB_HOTPLUG_MATCH_ANY)) {
-				found = dvc;
+			if (device_matches(devs[i], &desc, vendor_id, product_id)) {
+				found = libusb_ref_device(devs[i]);
 				break;
 			}
 		}
+		libusb_free_device_list(devs, 1);
+		if (found)
+			return found;
 
-		if (!found) {
-			if (verbose_level && vendor_id != -1 && product_id != -1)
-				printf("Target device not found\n");
-			libusb_free_device_list(devs, 1);
-			sleep(1);
-		}
+		if (verbose_level && vendor_id != -1 && product_id != -1)
+			printf("Target device not found\n");
+		sleep(1);
+	}
+	return NULL;
+}
+
+static int open_device(libusb_device *found) {
+	int result;
+	if (!keep_device_descriptors) {
+		result = get_descriptor(found);
+		if (result != LIBUSB_SUCCESS)
+			return result;
 	}
 
-	result = libusb_open(found, &dev_handle);
-	libusb_free_device_list(devs, 1);
+	libusb_device_handle *handle;
+	result = libusb_open(found, &handle);
 	if (result != LIBUSB_SUCCESS) {
 		if (verbose_level) {
 			fprintf(stderr, "Error opening device handle: %s\n",
 					libusb_strerror((libusb_error)result));
 		}
-		dev_handle = NULL;
 		return result;
 	}
+	{
+		std::lock_guard<std::mutex> guard(dev_handle_mutex);
+		dev_handle = handle;
+	}
 
 	result = libusb_set_auto_detach_kernel_driver(dev_handle, 0);
 	if (result != LIBUSB_SUCCESS) {
@@ -159,22 +251,82 @@ int connect_device(int vendor_id, int product_id) {
 		return result;
 	}
 
-	if (callback_handle == -1) {
+	return 0;
+}
+
+int connect_device(int vendor_id, int product_id) {
+	int result;
+	if (!context) {
+		result = libusb_init(&context);
+		if (result < 0) {
+			fprintf(stderr, "Init error: %s\n", libusb_strerror((libusb_error)result));
+			context = NULL;
+			return 1;
+		}
+		libusb_set_debug(context, 3);
+	}
+
+	// Left over from a device that was unplugged or failed to open.
+	libusb_device_handle *stale;
+	{
+		std::lock_guard<std::mutex> guard(dev_handle_mutex);
+		stale = dev_handle;
+		dev_handle = NULL;
+	}
+	if (stale)
+		libusb_close(stale);
+
+	if (callback_handle == -1 && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		// Devices already present are reported as arrivals right away.
 		result = libusb_hotplug_register_callback(context,
-			(libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
-			(libusb_hotplug_flag) 0, vendor_id, product_id,
+			(libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+						LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+			LIBUSB_HOTPLUG_ENUMERATE, vendor_id, product_id,
 			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &callback_handle);
 
 		if (result != LIBUSB_SUCCESS) {
 			fprintf(stderr, "Error registering callback\n");
-			libusb_exit(context);
-			return result;
+			callback_handle = -1;
 		}
+	}
+	if (!hotplug_monitor_thread)
 		pthread_create(&hotplug_monitor_thread, 0,
 			hotplug_monitor, nullptr);
+
+	libusb_device *found = callback_handle != -1 ?
+		wait_for_device(vendor_id, product_id) :
+		poll_for_device(vendor_id, product_id);
+	if (!found)
+		return 1;
+
+	result = open_device(found);
+	if (result != 0 && result != LIBUSB_ERROR_NO_DEVICE &&
+	    callback_handle != -1) {
+		// Still present, so it will not arrive again: retry it.
+		std::lock_guard<std::mutex> guard(arrival_mutex);
+		arrived_devices.push_back(libusb_ref_device(found));
 	}
+	libusb_unref_device(found);
+	return result;
+}
 
-	return 0;
+void disconnect_device() {
+	if (context && callback_handle != -1) {
+		libusb_hotplug_deregister_callback(context, callback_handle);
+	}
+	hotplug_monitor_stop = true;
+	if (hotplug_monitor_thread &&
+		pthread_join(hotplug_monitor_thread, NULL)) {
+		fprintf(stderr, "Error join hotplug_monitor_thread\n");
+	}
+	if (dev_handle) {
+		libusb_close(dev_handle);
+		dev_handle = NULL;
+	}
+}
+
+int get_device_speed() {
+	return libusb_get_device_speed(libusb_get_device(dev_handle));
 }
 
 void reset_device() {
@@ -219,10 +371,12 @@ void set_interface_alt_setting(int interface, int altsetting) {
 
 int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
 			unsigned char **dataptr, int timeout) {
+	PROXY_PROBE(libusb_submit, 0, setup_packet->wLength, setup_packet->bRequest);
 	int result = libusb_control_transfer(dev_handle,
 					setup_packet->bRequestType, setup_packet->bRequest,
 					setup_packet->wValue, setup_packet->wIndex, *dataptr,
 					setup_packet->wLength, timeout);
+	PROXY_PROBE(libusb_complete, 0, result < 0 ? 0 : result, result < 0 ? result : 0);
 
 	if (result < 0) {
 		if (verbose_level) {
@@ -242,8 +396,6 @@ int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
 	return 0;
 }
 
-int send_iso_data(uint8_t endpoint, uint8_t *dataptr, int length, int timeout);
-
 int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 			int length, int timeout) {
 	int transferred;
@@ -258,7 +410,9 @@ int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 		break;
 	case USB_ENDPOINT_XFER_BULK:
 		do {
+			PROXY_PROBE(libusb_submit, endpoint, length, attempt);
 			result = libusb_bulk_transfer(dev_handle, endpoint, dataptr, length, &transferred, timeout);
+			PROXY_PROBE(libusb_complete, endpoint, transferred, result);
 			//TODO retry transfer if incomplete
 			if (transferred != length) {
 				fprintf(stderr, "Incomplete Bulk transfer on EP%02x for attempt %d. length(%d), transferred(%d)\n",
@@ -280,7 +434,9 @@ int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 					&& attempt < MAX_ATTEMPTS);
 		break;
 	case USB_ENDPOINT_XFER_INT:
+		PROXY_PROBE(libusb_submit, endpoint, length, 0);
 		result = libusb_interrupt_transfer(dev_handle, endpoint, dataptr, length, &transferred, timeout);
+		PROXY_PROBE(libusb_complete, endpoint, transferred, result);
 
 		if (transferred != length)
 			fprintf(stderr, "Incomplete Interrupt transfer on EP%02x\n", endpoint);
@@ -295,9 +451,21 @@ int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 	return result;
 }
 
+struct iso_in_completion {
+	volatile int	completed;
+	uint64_t	completed_ns;
+};
+
 void iso_transfer_callback(struct libusb_transfer *transfer) {
-	int *iso_completed = (int *)transfer->user_data;
-	*iso_completed = 1;
+	struct iso_in_completion *completion = (struct iso_in_completion *)transfer->user_data;
+	completion->completed_ns = stats_now_ns();
+
+	int actual_length = 0;
+	for (int i = 0; i < transfer->num_iso_packets; i++)
+		actual_length += transfer->iso_packet_desc[i].actual_length;
+	PROXY_PROBE(libusb_complete, transfer->endpoint, actual_length, -(int)transfer->status);
+
+	completion->completed = 1;
 }
 
 // Bounded async ISO OUT: submit and return immediately.
@@ -306,9 +474,26 @@ void iso_transfer_callback(struct libusb_transfer *transfer) {
 #define ISO_OUT_MAX_IN_FLIGHT 8
 static std::atomic<int> iso_out_in_flight(0);
 
+// Owned by an in-flight ISO OUT transfer; freed by iso_out_callback().
+struct iso_out_context {
+	unsigned char		*buffer;
+	struct ep_stats		*stats;
+	struct transfer_stamps	stamps;
+};
+
 static void iso_out_callback(struct libusb_transfer *transfer) {
+	struct iso_out_context *ctx = (struct iso_out_context *)transfer->user_data;
 	iso_out_in_flight--;
+	if (ctx->stats)
+		ctx->stats->iso_out_in_flight--;
+	PROXY_PROBE(libusb_complete, transfer->endpoint,
+		transfer->iso_packet_desc[0].actual_length, -(int)transfer->status);
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+		ep_stats_record(ctx->stats, &ctx->stamps, stats_now_ns(),
+			transfer->iso_packet_desc[0].actual_length);
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (ctx->stats)
+			ctx->stats->drops++;
 		static int iso_out_err_count = 0;
 		iso_out_err_count++;
 		if (iso_out_err_count <= 10 || iso_out_err_count % 100 == 0)
@@ -316,11 +501,13 @@ static void iso_out_callback(struct libusb_transfer *transfer) {
 				transfer->endpoint, transfer->status, iso_out_err_count);
 	}
 	// Free the buffer passed via user_data.
-	delete[] (unsigned char *)transfer->user_data;
+	delete[] ctx->buffer;
+	delete ctx;
 	libusb_free_transfer(transfer);
 }
 
-int send_iso_data(uint8_t endpoint, uint8_t *dataptr, int length, int timeout) {
+int send_iso_data(uint8_t endpoint, uint8_t *dataptr, int length, int timeout,
+			struct ep_stats *stats, const struct transfer_stamps *stamps) {
 	// If at capacity, wait briefly for a slot.
 	int waited_us = 0;
 	while (iso_out_in_flight >= ISO_OUT_MAX_IN_FLIGHT && waited_us < 2000) {
@@ -331,6 +518,8 @@ int send_iso_data(uint8_t endpoint, uint8_t *dataptr, int length, int timeout) {
 		// Drop this packet -- ISO is inherently lossy.
 		// Free the buffer since the callback won't run.
 		delete[] dataptr;
+		if (stats)
+			stats->drops++;
 		return LIBUSB_SUCCESS;
 	}
 
@@ -340,20 +529,32 @@ int send_iso_data(uint8_t endpoint, uint8_t *dataptr, int length, int timeout) {
 		return LIBUSB_ERROR_OTHER;
 	}
 
-	// The callback frees both the transfer and the buffer (via user_data).
+	struct iso_out_context *ctx = new struct iso_out_context;
+	ctx->buffer = dataptr;
+	ctx->stats = stats;
+	if (stamps)
+		ctx->stamps = *stamps;
+	else
+		memset(&ctx->stamps, 0, sizeof(ctx->stamps));
+
+	// The callback frees the transfer, the buffer and the context (via user_data).
 	libusb_fill_iso_transfer(transfer, dev_handle, endpoint, dataptr, length,
-				1, iso_out_callback, dataptr, timeout);
+				1, iso_out_callback, ctx, timeout);
 	libusb_set_iso_packet_lengths(transfer, length);
 
+	PROXY_PROBE(libusb_submit, endpoint, length, 0);
 	int rv = libusb_submit_transfer(transfer);
 	if (rv != LIBUSB_SUCCESS) {
 		fprintf(stderr, "ISO OUT submit failed on EP%02x: %s (len=%d)\n",
 			endpoint, libusb_strerror((libusb_error)rv), length);
+		delete ctx;
 		libusb_free_transfer(transfer);
 		return rv;
 	}
 
 	iso_out_in_flight++;
+	if (stats)
+		stats->iso_out_in_flight++;
 	return LIBUSB_SUCCESS;
 }
 
@@ -375,12 +576,15 @@ int receive_iso_data_batched(uint8_t endpoint, uint16_t maxPacketSize,
 		return LIBUSB_ERROR_OTHER;
 	}
 
-	volatile int iso_completed = 0;
+	struct iso_in_completion completion;
+	completion.completed = 0;
+	completion.completed_ns = 0;
 	libusb_fill_iso_transfer(transfer, dev_handle, endpoint, result->buffer,
 				maxPacketSize * batch_size, batch_size,
-				iso_transfer_callback, (void *)&iso_completed, timeout);
+				iso_transfer_callback, (void *)&completion, timeout);
 	libusb_set_iso_packet_lengths(transfer, maxPacketSize);
 
+	PROXY_PROBE(libusb_submit, endpoint, maxPacketSize * batch_size, batch_size);
 	int rv = libusb_submit_transfer(transfer);
 	if (rv != LIBUSB_SUCCESS) {
 		if (verbose_level)
@@ -394,8 +598,9 @@ int receive_iso_data_batched(uint8_t endpoint, uint16_t maxPacketSize,
 
 	// Spin-wait for completion; the dedicated event thread
 	// (hotplug_monitor) will call iso_transfer_callback.
-	while (!iso_completed)
+	while (!completion.completed)
 		usleep(50);
+	result->completed_ns = completion.completed_ns;
 
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED &&
 	    transfer->status != LIBUSB_TRANSFER_TIMED_OUT) {
@@ -448,7 +653,9 @@ int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
 	case USB_ENDPOINT_XFER_BULK:
 		*dataptr = new uint8_t[maxPacketSize * 8];
 		do {
+			PROXY_PROBE(libusb_submit, endpoint, maxPacketSize, attempt);
 			result = libusb_bulk_transfer(dev_handle, endpoint, *dataptr, maxPacketSize, length, timeout);
+			PROXY_PROBE(libusb_complete, endpoint, *length, result);
 			if (result == LIBUSB_SUCCESS && verbose_level > 2)
 				printf("Received bulk data(%d) bytes\n", *length);
 			if ((result == LIBUSB_ERROR_PIPE || result == LIBUSB_ERROR_TIMEOUT))
@@ -459,7 +666,9 @@ int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
 		break;
 	case USB_ENDPOINT_XFER_INT:
 		*dataptr = new uint8_t[maxPacketSize];
+		PROXY_PROBE(libusb_submit, endpoint, maxPacketSize, 0);
 		result = libusb_interrupt_transfer(dev_handle, endpoint, *dataptr, maxPacketSize, length, timeout);
+		PROXY_PROBE(libusb_complete, endpoint, *length, result);
 		if (result == LIBUSB_SUCCESS && verbose_level > 2)
 			printf("Received int data(%d) bytes\n", *length);
 		break;
@@ -472,3 +681,20 @@ int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
 
 	return result;
 }
+
+struct device_backend libusb_device_backend = {
+	.name =				"libusb",
+	.connect =			connect_device,
+	.disconnect =			disconnect_device,
+	.get_speed =			get_device_speed,
+	.reset =			reset_device,
+	.set_configuration =		set_configuration,
+	.claim_interface =		claim_interface,
+	.release_interface =		release_interface,
+	.set_interface_alt_setting =	set_interface_alt_setting,
+	.control_request =		control_request,
+	.send_data =			send_data,
+	.send_iso_data =		send_iso_data,
+	.receive_data =			receive_data,
+	.receive_iso_data_batched =	receive_iso_data_batched,
+};
@@ -1,6 +1,10 @@
+#include <atomic>
+
 #include <libusb-1.0/libusb.h>
 
 #include "misc.h"
+#include "stats.h"
+#include "device-backend.h"
 
 #define USB_REQUEST_TIMEOUT 1000
 
@@ -21,6 +25,7 @@ struct iso_batch_result {
 	struct iso_packet_result packets[ISO_BATCH_SIZE_MAX];
 	int total_length;
 	bool success;
+	uint64_t completed_ns; // stats_now_ns() when libusb reported completion
 };
 
 extern libusb_device			**devs;
@@ -33,7 +38,18 @@ extern struct libusb_config_descriptor		**device_config_desc;
 
 extern pthread_t hotplug_monitor_thread;
 
+// Set while ep0 reads the descriptors the descriptor cache validated:
+// connect_device() then opens the device without fetching them again.
+extern std::atomic<bool> keep_device_descriptors;
+
+int get_descriptor(libusb_device *device);
+std::string device_serial(libusb_device *device);
+// Hubs never match; --serial is checked too.
+bool device_matches(libusb_device *device, const struct libusb_device_descriptor *desc,
+			int vendor_id, int product_id);
 int connect_device(int vendorId, int productId);
+void disconnect_device();
+int get_device_speed();
 void reset_device();
 void set_configuration(int configuration);
 void claim_interface(int interface);
@@ -43,7 +59,8 @@ int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
 			unsigned char **dataptr, int timeout);
 int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 			int length, int timeout);
-int send_iso_data(uint8_t endpoint, uint8_t *dataptr, int length, int timeout);
+int send_iso_data(uint8_t endpoint, uint8_t *dataptr, int length, int timeout,
+			struct ep_stats *stats, const struct transfer_stamps *stamps);
 int receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
 			uint8_t **dataptr, int *length, int timeout);
 int receive_iso_data_batched(uint8_t endpoint, uint16_t maxPacketSize,
@@ -0,0 +1,214 @@
+#include <map>
+#include <pthread.h>
+
+#include "device-libusb.h"
+#include "diagnose.h"
+#include "misc.h"
+#include "stats.h"
+
+// An average queue depth above this share of EP_QUEUE_LIMIT means the sink
+// is not keeping up.
+#define DIAGNOSE_QUEUE_HIGH	(EP_QUEUE_LIMIT * 3 / 4)
+// A thread busy for this share of the interval is considered saturated.
+#define DIAGNOSE_CPU_SATURATED	0.9
+
+struct diagnose_sample {
+	uint64_t	wall_ns;
+	uint64_t	source_packets;
+	uint64_t	source_bytes;
+	uint64_t	sink_packets;
+	uint64_t	sink_bytes;
+	uint64_t	drops;
+	uint64_t	queue_full_waits;
+	uint64_t	queue_depth_sum;
+	uint64_t	inject_ns;
+	uint64_t	lua_ns;
+	uint64_t	iso_packets;
+	int		reader_clock;
+	int		writer_clock;
+	uint64_t	reader_cpu_ns;
+	uint64_t	writer_cpu_ns;
+};
+
+static uint64_t thread_cpu_ns(int clock)
+{
+	struct timespec ts;
+	if (clock == -1 || clock_gettime((clockid_t)clock, &ts) != 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// CPU time used by a thread role since the previous sample. When the thread
+// was replaced (altsetting change) all of the new thread's time is counted.
+static uint64_t thread_cpu_delta(int clock, uint64_t cpu_ns,
+				 int prev_clock, uint64_t prev_cpu_ns)
+{
+	if (clock == -1)
+		return 0;
+	if (clock == prev_clock && cpu_ns >= prev_cpu_ns)
+		return cpu_ns - prev_cpu_ns;
+	return cpu_ns;
+}
+
+// Lua time spent by the injection rules attached to this endpoint.
+static uint64_t endpoint_lua_ns(const struct ep_stats *stats)
+{
+	uint64_t lua_ns = 0;
+
+	if (!injection_enabled)
+		return 0;
+	const Json::Value &rules = injection_config[stats->transfer_type];
+	for (unsigned int i = 0; i < rules.size(); i++) {
+		if (hexToDecimal(rules[i]["ep_address"].asInt()) !=
+		    stats->device_bEndpointAddress)
+			continue;
+		struct injection_rule_stats *rule_stats =
+			injection_rule_stats_get(stats->transfer_type, i);
+		if (rule_stats)
+			lua_ns += rule_stats->lua_ns;
+	}
+	return lua_ns;
+}
+
+static void take_sample(struct ep_stats *stats, struct diagnose_sample *sample)
+{
+	sample->wall_ns = stats_now_ns();
+	sample->source_packets = stats->source_packets;
+	sample->source_bytes = stats->source_bytes;
+	sample->sink_packets = stats->stages[LATENCY_STAGE_TOTAL].total_count;
+	sample->sink_bytes = stats->sink_bytes;
+	sample->drops = stats->drops + stats->iso_packet_errors;
+	sample->queue_full_waits = stats->queue_full_waits;
+	sample->queue_depth_sum = stats->queue_depth_sum;
+	sample->inject_ns = stats->inject_ns;
+	sample->lua_ns = endpoint_lua_ns(stats);
+	sample->iso_packets = stats->iso_packets;
+	sample->reader_clock = stats->reader_clock;
+	sample->writer_clock = stats->writer_clock;
+	sample->reader_cpu_ns = thread_cpu_ns(sample->reader_clock);
+	sample->writer_cpu_ns = thread_cpu_ns(sample->writer_clock);
+}
+
+// Isochronous service intervals per second for a host-side bInterval, which
+// counts 125us microframes at high speed and above and 1ms frames below.
+static double iso_service_rate(uint8_t bInterval)
+{
+	if (bInterval < 1 || bInterval > 16)
+		return 0;
+	double rate = gadget_speed >= USB_SPEED_HIGH ? 8000.0 : 1000.0;
+	return rate / (1 << (bInterval - 1));
+}
+
+static void diagnose_endpoint(struct ep_stats *stats,
+			      const struct diagnose_sample *prev,
+			      const struct diagnose_sample *cur)
+{
+	uint8_t addr = stats->device_bEndpointAddress;
+	bool dir_in = addr & USB_DIR_IN;
+	bool isoc = stats->transfer_type == "isoc";
+	double wall_ns = cur->wall_ns - prev->wall_ns;
+	double secs = wall_ns / 1e9;
+
+	uint64_t source_packets = cur->source_packets - prev->source_packets;
+	uint64_t sink_packets = cur->sink_packets - prev->sink_packets;
+	uint64_t drops = cur->drops - prev->drops;
+	uint64_t full_waits = cur->queue_full_waits - prev->queue_full_waits;
+	uint64_t inject_ns = cur->inject_ns - prev->inject_ns;
+	uint64_t lua_ns = cur->lua_ns - prev->lua_ns;
+	uint64_t reader_cpu_ns = thread_cpu_delta(cur->reader_clock, cur->reader_cpu_ns,
+						  prev->reader_clock, prev->reader_cpu_ns);
+	uint64_t writer_cpu_ns = thread_cpu_delta(cur->writer_clock, cur->writer_cpu_ns,
+						  prev->writer_clock, prev->writer_cpu_ns);
+
+	if (!source_packets && !sink_packets && !full_waits && !drops)
+		return;
+
+	double queue_depth = source_packets ?
+		(double)(cur->queue_depth_sum - prev->queue_depth_sum) / source_packets : 0;
+	double reader_cpu = reader_cpu_ns / wall_ns;
+	double writer_cpu = writer_cpu_ns / wall_ns;
+	char knob[160];
+	const char *verdict;
+
+	// The source feeds the queue, the sink drains it: for IN endpoints the
+	// source is the device and the sink the host, for OUT the reverse.
+	if (inject_ns >= wall_ns / 2 ||
+	    (reader_cpu >= DIAGNOSE_CPU_SATURATED && inject_ns >= reader_cpu_ns / 2)) {
+		verdict = "injection-bound";
+		if (lua_ns >= inject_ns / 2)
+			snprintf(knob, sizeof(knob),
+				 "disable Lua on EP 0x%02x or move its transform to \"operations\"", addr);
+		else
+			snprintf(knob, sizeof(knob),
+				 "simplify or disable the injection rules on EP 0x%02x", addr);
+	}
+	else if (reader_cpu >= DIAGNOSE_CPU_SATURATED || writer_cpu >= DIAGNOSE_CPU_SATURATED) {
+		verdict = "proxy-CPU-bound";
+		if (verbose_level)
+			snprintf(knob, sizeof(knob), "drop -v, per-packet logging is on the data path");
+		else if (isoc && dir_in && iso_batch_size < ISO_BATCH_SIZE_MAX)
+			snprintf(knob, sizeof(knob),
+				 "raise --iso_batch_size (currently %d) to amortise per-transfer cost",
+				 iso_batch_size);
+		else
+			snprintf(knob, sizeof(knob), "give the EP 0x%02x threads a dedicated CPU", addr);
+	}
+	else if (full_waits || queue_depth >= DIAGNOSE_QUEUE_HIGH) {
+		verdict = dir_in ? "host-bound" : "device-bound";
+		if (dir_in)
+			snprintf(knob, sizeof(knob),
+				 "the host is not draining EP 0x%02x; check the host-side reader and UDC", addr);
+		else
+			snprintf(knob, sizeof(knob),
+				 "the device accepts EP 0x%02x data slower than the host sends it", addr);
+	}
+	else {
+		verdict = dir_in ? "device-bound" : "host-bound";
+		double service_rate = iso_service_rate(stats->bInterval);
+		double polled = (cur->iso_packets - prev->iso_packets) / secs;
+		if (dir_in && isoc && service_rate > 0 && polled < 0.9 * service_rate &&
+		    iso_batch_size < ISO_BATCH_SIZE_MAX)
+			snprintf(knob, sizeof(knob),
+				 "raise --iso_batch_size (currently %d): only %.0f of %.0f service intervals/s polled",
+				 iso_batch_size, polled, service_rate);
+		else
+			snprintf(knob, sizeof(knob), "the %s sets the pace; nothing to tune in the proxy",
+				 dir_in ? "device" : "host");
+	}
+
+	printf("[diagnose] EP%02x(%s_%s): %s  src %.0f pkt/s %.1f kB/s  sink %.0f pkt/s %.1f kB/s"
+	       "  queue %.1f/%d  drops %lu  cpu rd %.0f%% wr %.0f%%  inject %.0f%% -> %s\n",
+	       addr, stats->transfer_type.c_str(), dir_in ? "in" : "out", verdict,
+	       source_packets / secs, (cur->source_bytes - prev->source_bytes) / secs / 1000,
+	       sink_packets / secs, (cur->sink_bytes - prev->sink_bytes) / secs / 1000,
+	       queue_depth, EP_QUEUE_LIMIT, (unsigned long)drops,
+	       reader_cpu * 100, writer_cpu * 100, inject_ns * 100 / wall_ns, knob);
+}
+
+static void *diagnose_monitor(void *arg)
+{
+	int interval_s = (int)(intptr_t)arg;
+	std::map<struct ep_stats *, struct diagnose_sample> samples;
+
+	pthread_setname_np(pthread_self(), "diagnose");
+
+	while (true) {
+		sleep(interval_s);
+		for (struct ep_stats *stats : ep_stats_list()) {
+			struct diagnose_sample cur;
+			take_sample(stats, &cur);
+			auto it = samples.find(stats);
+			if (it != samples.end())
+				diagnose_endpoint(stats, &it->second, &cur);
+			samples[stats] = cur;
+		}
+	}
+	return NULL;
+}
+
+void start_diagnose_monitor(int interval_s)
+{
+	pthread_t thread;
+	pthread_create(&thread, 0, diagnose_monitor, (void *)(intptr_t)interval_s);
+	pthread_detach(thread);
+}
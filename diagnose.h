@@ -0,0 +1,10 @@
+#ifndef USB_PROXY_DIAGNOSE_H
+#define USB_PROXY_DIAGNOSE_H
+
+// Bottleneck detector: every interval_s seconds, compares per endpoint the
+// rate at which packets enter the proxy with the rate at which they leave it,
+// together with queue occupancy, drops and endpoint thread CPU time, and logs
+// a one-line diagnosis with the knob most likely to help.
+void start_diagnose_monitor(int interval_s);
+
+#endif // USB_PROXY_DIAGNOSE_H
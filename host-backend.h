@@ -0,0 +1,40 @@
+#ifndef USB_PROXY_HOST_BACKEND_H
+#define USB_PROXY_HOST_BACKEND_H
+
+#include <stdint.h>
+#include <linux/usb/ch9.h>
+
+struct usb_raw_event;
+struct usb_raw_ep_io;
+struct usb_raw_eps_info;
+
+// Host-side backend: the gadget the USB host talks to. Calls mirror the Raw
+// Gadget ioctls and report errors the same way (-1 with errno set, e.g.
+// ESHUTDOWN on reset and EINTR when an endpoint thread is signalled), so
+// ep0_loop() and the endpoint loops need not care which one is in use.
+struct host_backend {
+	const char	*name;
+
+	int	(*open)();
+	void	(*close)(int fd);
+	void	(*init)(int fd, enum usb_device_speed speed,
+				const char *driver, const char *device);
+	void	(*run)(int fd);
+	void	(*event_fetch)(int fd, struct usb_raw_event *event);
+	int	(*ep0_read)(int fd, struct usb_raw_ep_io *io);
+	int	(*ep0_write)(int fd, struct usb_raw_ep_io *io);
+	void	(*ep0_stall)(int fd);
+	int	(*ep_enable)(int fd, struct usb_endpoint_descriptor *desc);
+	int	(*ep_disable)(int fd, uint32_t num);
+	int	(*ep_read)(int fd, struct usb_raw_ep_io *io);
+	int	(*ep_write)(int fd, struct usb_raw_ep_io *io);
+	void	(*configure)(int fd);
+	int	(*eps_info)(int fd, struct usb_raw_eps_info *info);
+};
+
+extern struct host_backend *host_backend;
+
+extern struct host_backend raw_gadget_host_backend;
+extern struct host_backend emulated_host_backend;
+
+#endif // USB_PROXY_HOST_BACKEND_H
@@ -0,0 +1,686 @@
+#include <deque>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include "host-raw-gadget.h"
+#include "probes.h"
+#include "proxy.h"
+#include "trace.h"
+
+// In-process emulated USB host (--emulate_host), standing in for Raw Gadget.
+// It plays an enumeration sequence on ep0, issues SET_CONFIGURATION and the
+// scripted SET_INTERFACE and control requests, and produces (OUT) and
+// consumes (IN) endpoint traffic at configurable rates while recording what
+// it sees. The script is a JSON file:
+//
+// {
+//   "configuration": 1,
+//   "steps": [
+//     { "run_ms": 2000 },
+//     { "set_interface": { "interface": 1, "altsetting": 1 } },
+//     { "control": { "bRequestType": "0x21", "bRequest": 1, "wValue": "0x0100",
+//                    "wIndex": 1, "data": "00 01" } },
+//     { "run_ms": 2000 },
+//     { "replay": { "timeout_ms": 60000 } }
+//   ],
+//   "endpoints": {
+//     "0x02": { "rate": 0, "payload": 512 },
+//     "0x83": { "verify": "loopback" }
+//   },
+//   "report": "host-report.json"
+// }
+//
+// Endpoints are keyed by their gadget-side address. OUT endpoints send a
+// little-endian sequence number and send timestamp followed by a rolling byte
+// pattern; IN endpoints can "verify" a "counter" (sequence numbers from the
+// emulated device's counter source) or a "loopback" stream (the host's own
+// OUT packets coming back, which also yields end-to-end latency). "rate" is in
+// packets per second; 0 means as fast as possible for bulk, and one packet
+// per service interval for interrupt and isochronous endpoints. "configuration"
+// defaults to the first configuration the device reports.
+//
+// With --replay_trace, endpoints that appear in the trace send the recorded
+// OUT packets (with their recorded timing unless --replay_fast) and, with
+// --replay_verify, check IN packets against it. A "replay" step waits until
+// the trace has been played and the sinks have drained; it is the default
+// when the script has no steps.
+
+#define EMULATED_HOST_STAMP_LEN	12	// sequence (4) + send time (8)
+
+struct emulated_host_request {
+	std::string		name;
+	struct usb_ctrlrequest	ctrl;
+	std::vector<uint8_t>	data;		// OUT data stage
+	uint64_t		issued_ns;
+	uint64_t		completed_ns;
+	uint64_t		first_data_ns;	// SET_CONFIGURATION / SET_INTERFACE
+	int			length;		// IN bytes received, OUT bytes sent
+	bool			stalled;
+};
+
+struct emulated_host_stream {
+	uint8_t			address;
+	double			rate;
+	int			payload;
+	std::string		verify;
+	struct trace_stream	*trace;		// --replay_trace
+	std::atomic<uint64_t>	packets;
+	std::atomic<uint64_t>	bytes;
+	std::atomic<uint64_t>	gaps;		// sequence discontinuities seen
+	std::atomic<uint64_t>	first_ns;
+	std::atomic<uint64_t>	last_ns;
+	uint32_t		sequence;	// next to send / expected
+	bool			sequence_valid;
+	struct latency_histogram	latency;
+};
+
+struct emulated_host_endpoint {
+	std::atomic<bool>	enabled;	// read by the endpoint threads unlocked
+	struct usb_endpoint_descriptor	desc;
+	struct emulated_host_stream	*stream;
+	uint64_t		next_ns;
+	bool			seen_data;
+	int			request;	// index of the request that enabled it
+};
+
+enum emulated_host_action_type {
+	EMULATED_HOST_CONNECT,
+	EMULATED_HOST_CONTROL,
+	EMULATED_HOST_RUN,
+	EMULATED_HOST_REPLAY,
+	EMULATED_HOST_END,
+};
+
+struct emulated_host_action {
+	enum emulated_host_action_type	type;
+	struct emulated_host_request	request;
+	int				run_ms;
+};
+
+static Json::Value host_script;
+static std::deque<struct emulated_host_action> host_actions;
+static std::mutex host_mutex;	// requests and endpoint slots
+static std::vector<struct emulated_host_request> host_requests;
+static struct emulated_host_endpoint host_eps[USB_RAW_EPS_NUM_MAX];
+static std::map<uint8_t, struct emulated_host_stream *> host_streams;
+static int host_pending = -1;		// request waiting for the data stage
+static int host_last_switch = -1;	// last SET_CONFIGURATION / SET_INTERFACE
+static std::vector<uint8_t> host_config_desc;
+static enum usb_device_speed host_speed = USB_SPEED_HIGH;
+
+static uint64_t host_now_ns()
+{
+	return stats_now_ns();
+}
+
+static struct emulated_host_action control_action(const std::string &name,
+		uint8_t bRequestType, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, uint16_t wLength)
+{
+	struct emulated_host_action action;
+	action.type = EMULATED_HOST_CONTROL;
+	action.run_ms = 0;
+	action.request.name = name;
+	action.request.ctrl.bRequestType = bRequestType;
+	action.request.ctrl.bRequest = bRequest;
+	action.request.ctrl.wValue = wValue;
+	action.request.ctrl.wIndex = wIndex;
+	action.request.ctrl.wLength = wLength;
+	action.request.issued_ns = 0;
+	action.request.completed_ns = 0;
+	action.request.first_data_ns = 0;
+	action.request.length = 0;
+	action.request.stalled = false;
+	return action;
+}
+
+static struct emulated_host_stream *host_stream_get(uint8_t address)
+{
+	auto it = host_streams.find(address);
+	if (it != host_streams.end())
+		return it->second;
+
+	char key[8];
+	snprintf(key, sizeof(key), "0x%02x", address);
+	const Json::Value &json = host_script["endpoints"][key];
+
+	struct emulated_host_stream *stream = new struct emulated_host_stream();
+	stream->address = address;
+	stream->rate = json.get("rate", 0).asDouble();
+	stream->payload = json_uint(json["payload"], 0);
+	stream->verify = json.get("verify", "none").asString();
+	// Traces are recorded under the device's endpoint addresses.
+	stream->trace = trace_replaying() ?
+		trace_replay_stream(remap_endpoint_for_device(address)) : NULL;
+	host_streams[address] = stream;
+	return stream;
+}
+
+/*----------------------------------------------------------------------*/
+
+static int emulated_host_open()
+{
+	int fd = open("/dev/null", O_RDWR);
+	if (fd < 0) {
+		perror("open() /dev/null");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+static void emulated_host_init(int fd __attribute__((unused)),
+			       enum usb_device_speed speed,
+			       const char *driver __attribute__((unused)),
+			       const char *device __attribute__((unused)))
+{
+	host_speed = speed;
+	Json::Reader jsonReader;
+	std::ifstream ifs(emulated_host_file.c_str());
+	if (!ifs || !jsonReader.parse(ifs, host_script)) {
+		fprintf(stderr, "Error parsing emulated host file: %s\n",
+			emulated_host_file.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	// Enumeration as a Linux host does it, then the configuration and the
+	// scripted steps.
+	struct emulated_host_action connect = {};
+	connect.type = EMULATED_HOST_CONNECT;
+	host_actions.push_back(connect);
+	host_actions.push_back(control_action("GET_DESCRIPTOR(device, 64)", USB_DIR_IN,
+		USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0, 64));
+	host_actions.push_back(control_action("GET_DESCRIPTOR(device)", USB_DIR_IN,
+		USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0, USB_DT_DEVICE_SIZE));
+	host_actions.push_back(control_action("GET_DESCRIPTOR(config header)", USB_DIR_IN,
+		USB_REQ_GET_DESCRIPTOR, USB_DT_CONFIG << 8, 0, USB_DT_CONFIG_SIZE));
+	host_actions.push_back(control_action("GET_DESCRIPTOR(string 0)", USB_DIR_IN,
+		USB_REQ_GET_DESCRIPTOR, USB_DT_STRING << 8, 0, 255));
+	host_actions.push_back(control_action("SET_CONFIGURATION", USB_DIR_OUT,
+		USB_REQ_SET_CONFIGURATION, json_uint(host_script["configuration"], 0), 0, 0));
+
+	const Json::Value &steps = host_script["steps"];
+	for (unsigned int i = 0; i < steps.size(); i++) {
+		const Json::Value &step = steps[i];
+		if (step.isMember("run_ms")) {
+			struct emulated_host_action run = {};
+			run.type = EMULATED_HOST_RUN;
+			run.run_ms = step["run_ms"].asInt();
+			host_actions.push_back(run);
+		}
+		else if (step.isMember("replay")) {
+			struct emulated_host_action replay = {};
+			replay.type = EMULATED_HOST_REPLAY;
+			replay.run_ms = step["replay"].get("timeout_ms", 0).asInt();
+			host_actions.push_back(replay);
+		}
+		else if (step.isMember("set_interface")) {
+			int interface = json_uint(step["set_interface"]["interface"], 0);
+			int altsetting = json_uint(step["set_interface"]["altsetting"], 0);
+			char name[48];
+			snprintf(name, sizeof(name), "SET_INTERFACE(%d, %d)", interface, altsetting);
+			host_actions.push_back(control_action(name, USB_DIR_OUT | USB_RECIP_INTERFACE,
+				USB_REQ_SET_INTERFACE, altsetting, interface, 0));
+		}
+		else if (step.isMember("control")) {
+			const Json::Value &ctrl = step["control"];
+			std::vector<uint8_t> data = parse_hex_bytes(ctrl.get("data", "").asString());
+			uint8_t bRequestType = json_uint(ctrl["bRequestType"], 0);
+			uint16_t wLength = (bRequestType & USB_DIR_IN) ?
+				json_uint(ctrl["wLength"], 0) : data.size();
+			struct emulated_host_action action = control_action(
+				ctrl.get("name", "control").asString(), bRequestType,
+				json_uint(ctrl["bRequest"], 0), json_uint(ctrl["wValue"], 0),
+				json_uint(ctrl["wIndex"], 0), wLength);
+			action.request.data = data;
+			host_actions.push_back(action);
+		}
+	}
+
+	if (!steps.size() && trace_replaying()) {
+		struct emulated_host_action replay = {};
+		replay.type = EMULATED_HOST_REPLAY;
+		host_actions.push_back(replay);
+	}
+
+	struct emulated_host_action end = {};
+	end.type = EMULATED_HOST_END;
+	host_actions.push_back(end);
+
+	printf("Emulated host: %zu actions from %s\n", host_actions.size(),
+		emulated_host_file.c_str());
+}
+
+static void emulated_host_run(int fd __attribute__((unused)))
+{
+}
+
+static void emulated_host_configure(int fd __attribute__((unused)))
+{
+}
+
+// Sleeps for ms, returning false early if the proxy is asked to stop.
+static bool host_sleep_ms(int ms)
+{
+	uint64_t deadline = host_now_ns() + (uint64_t)ms * 1000000;
+	while (!please_stop_ep0) {
+		uint64_t now = host_now_ns();
+		if (now >= deadline)
+			return true;
+		usleep(std::min<uint64_t>((deadline - now) / 1000, 10000));
+	}
+	return false;
+}
+
+static void emulated_host_event_fetch(int fd __attribute__((unused)),
+				      struct usb_raw_event *event)
+{
+	struct usb_raw_control_event *control = (struct usb_raw_control_event *)event;
+
+	std::unique_lock<std::mutex> lock(host_mutex);
+	if (host_pending != -1) {
+		// The proxy neither answered nor stalled (injection "ignore").
+		host_requests[host_pending].completed_ns = host_now_ns();
+		host_pending = -1;
+	}
+
+	while (!host_actions.empty()) {
+		struct emulated_host_action action = host_actions.front();
+		host_actions.pop_front();
+
+		switch (action.type) {
+		case EMULATED_HOST_CONNECT:
+			event->type = USB_RAW_EVENT_CONNECT;
+			event->length = 0;
+			return;
+		case EMULATED_HOST_RUN:
+			lock.unlock();
+			if (!host_sleep_ms(action.run_ms)) {
+				event->length = 4294967295;
+				return;
+			}
+			lock.lock();
+			continue;
+		case EMULATED_HOST_REPLAY:
+			lock.unlock();
+			trace_replay_wait(action.run_ms, &please_stop_ep0);
+			if (please_stop_ep0) {
+				event->length = 4294967295;
+				return;
+			}
+			lock.lock();
+			continue;
+		case EMULATED_HOST_END:
+			// Let ep0_loop() exit through its normal path, which stops
+			// the endpoint threads.
+			please_stop_ep0 = true;
+			event->type = USB_RAW_EVENT_INVALID;
+			event->length = 0;
+			return;
+		case EMULATED_HOST_CONTROL:
+			break;
+		}
+
+		struct emulated_host_request &request = action.request;
+		if (request.ctrl.bRequest == USB_REQ_SET_CONFIGURATION &&
+		    request.ctrl.bRequestType == USB_DIR_OUT && !request.ctrl.wValue &&
+		    host_config_desc.size() >= USB_DT_CONFIG_SIZE)
+			request.ctrl.wValue = host_config_desc[5];
+
+		request.issued_ns = host_now_ns();
+		host_requests.push_back(request);
+		host_pending = host_requests.size() - 1;
+		if (request.ctrl.bRequest == USB_REQ_SET_CONFIGURATION ||
+		    request.ctrl.bRequest == USB_REQ_SET_INTERFACE)
+			host_last_switch = host_pending;
+
+		event->type = USB_RAW_EVENT_CONTROL;
+		event->length = sizeof(control->ctrl);
+		control->ctrl = request.ctrl;
+		return;
+	}
+
+	please_stop_ep0 = true;
+	event->type = USB_RAW_EVENT_INVALID;
+	event->length = 0;
+}
+
+// Data stage of a control IN request: the host receives the response.
+static int emulated_host_ep0_write(int fd __attribute__((unused)), struct usb_raw_ep_io *io)
+{
+	std::lock_guard<std::mutex> guard(host_mutex);
+	if (host_pending == -1) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	struct emulated_host_request &request = host_requests[host_pending];
+	request.completed_ns = host_now_ns();
+	request.length = std::min<uint32_t>(io->length, request.ctrl.wLength);
+	host_pending = -1;
+
+	// Fetch the whole configuration once its length is known.
+	if (request.ctrl.bRequest == USB_REQ_GET_DESCRIPTOR &&
+	    request.ctrl.wValue == (USB_DT_CONFIG << 8)) {
+		host_config_desc.assign(io->data, io->data + request.length);
+		if (request.ctrl.wLength == USB_DT_CONFIG_SIZE && request.length >= 4) {
+			uint16_t total = io->data[2] | (io->data[3] << 8);
+			host_actions.push_front(control_action("GET_DESCRIPTOR(config)", USB_DIR_IN,
+				USB_REQ_GET_DESCRIPTOR, USB_DT_CONFIG << 8, 0, total));
+		}
+	}
+	return request.length;
+}
+
+// Status stage of a control OUT request, or its data stage: the host sends
+// the scripted data.
+static int emulated_host_ep0_read(int fd __attribute__((unused)), struct usb_raw_ep_io *io)
+{
+	std::lock_guard<std::mutex> guard(host_mutex);
+	if (host_pending == -1) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	struct emulated_host_request &request = host_requests[host_pending];
+	int length = std::min<uint32_t>(io->length, request.ctrl.wLength);
+	memset(io->data, 0, length);
+	memcpy(io->data, request.data.data(), std::min<size_t>(length, request.data.size()));
+	request.completed_ns = host_now_ns();
+	request.length = length;
+	host_pending = -1;
+	return length;
+}
+
+static void emulated_host_ep0_stall(int fd __attribute__((unused)))
+{
+	std::lock_guard<std::mutex> guard(host_mutex);
+	if (host_pending == -1)
+		return;
+	host_requests[host_pending].completed_ns = host_now_ns();
+	host_requests[host_pending].stalled = true;
+	host_pending = -1;
+}
+
+static int emulated_host_ep_enable(int fd __attribute__((unused)),
+				   struct usb_endpoint_descriptor *desc)
+{
+	std::lock_guard<std::mutex> guard(host_mutex);
+	for (int i = 0; i < USB_RAW_EPS_NUM_MAX; i++) {
+		struct emulated_host_endpoint *ep = &host_eps[i];
+		if (ep->enabled)
+			continue;
+		ep->enabled = true;
+		ep->desc = *desc;
+		ep->stream = host_stream_get(desc->bEndpointAddress);
+		ep->next_ns = 0;
+		ep->seen_data = false;
+		ep->request = host_last_switch;
+		return i;
+	}
+	errno = EBUSY;
+	return -1;
+}
+
+static int emulated_host_ep_disable(int fd __attribute__((unused)), uint32_t num)
+{
+	std::lock_guard<std::mutex> guard(host_mutex);
+	if (num >= USB_RAW_EPS_NUM_MAX || !host_eps[num].enabled) {
+		errno = EINVAL;
+		return -1;
+	}
+	host_eps[num].enabled = false;
+	return 0;
+}
+
+static uint64_t host_packet_interval_ns(const struct emulated_host_endpoint *ep)
+{
+	if (ep->stream->trace)
+		return 0;	// paced by the trace
+	if (ep->stream->rate > 0)
+		return (uint64_t)(1e9 / ep->stream->rate);
+	if (usb_endpoint_xfer_bulk(&ep->desc))
+		return 0;
+	// bInterval counts microframes at high speed and above, frames below;
+	// full-speed interrupt endpoints give it linearly.
+	uint8_t interval = ep->desc.bInterval ? ep->desc.bInterval : 1;
+	if (host_speed < USB_SPEED_HIGH) {
+		if (usb_endpoint_xfer_int(&ep->desc))
+			return interval * 1000000ull;
+		return 1000000ull << (std::min<uint8_t>(interval, 16) - 1);
+	}
+	if (interval > 16)
+		interval = 16;
+	return 125000ull << (interval - 1);
+}
+
+// Waits for the endpoint's next packet slot. Returns -1 with errno set the
+// way Raw Gadget would when the endpoint goes away or the thread is signalled.
+static int host_pace(struct emulated_host_endpoint *ep)
+{
+	uint64_t interval = host_packet_interval_ns(ep);
+	if (!ep->enabled || please_stop_eps) {
+		errno = ESHUTDOWN;
+		return -1;
+	}
+	if (!interval)
+		return 0;
+
+	uint64_t now = host_now_ns();
+	if (ep->next_ns + interval < now)
+		ep->next_ns = now;
+	if (ep->next_ns > now) {
+		struct timespec ts;
+		ts.tv_sec = (ep->next_ns - now) / 1000000000ull;
+		ts.tv_nsec = (ep->next_ns - now) % 1000000000ull;
+		if (nanosleep(&ts, NULL) != 0) {
+			errno = EINTR;
+			return -1;
+		}
+	}
+	ep->next_ns += interval;
+	return 0;
+}
+
+static void host_account(struct emulated_host_endpoint *ep, int length, uint64_t now)
+{
+	struct emulated_host_stream *stream = ep->stream;
+
+	stream->packets++;
+	stream->bytes += length;
+	uint64_t zero = 0;
+	stream->first_ns.compare_exchange_strong(zero, now);
+	stream->last_ns = now;
+
+	if (!ep->seen_data) {
+		ep->seen_data = true;
+		std::lock_guard<std::mutex> guard(host_mutex);
+		if (ep->request != -1 && !host_requests[ep->request].first_data_ns)
+			host_requests[ep->request].first_data_ns = now;
+	}
+}
+
+// OUT endpoint: the host sends a packet.
+static int emulated_host_ep_read(int fd __attribute__((unused)), struct usb_raw_ep_io *io)
+{
+	if (io->ep >= USB_RAW_EPS_NUM_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct emulated_host_endpoint *ep = &host_eps[io->ep];
+	if (host_pace(ep) < 0)
+		return -1;
+
+	struct emulated_host_stream *stream = ep->stream;
+	if (stream->trace) {
+		int length = trace_replay_next(stream->trace, io->data, io->length);
+		if (length < 0) {
+			// Exhausted: ENODATA makes the proxy poll again, like an
+			// idle host.
+			if (errno == ENODATA)
+				usleep(10000);
+			return -1;
+		}
+		host_account(ep, length, host_now_ns());
+		return length;
+	}
+
+	int length = std::min<int>(stream->payload ? stream->payload : usb_endpoint_maxp(&ep->desc),
+				   io->length);
+	uint64_t now = host_now_ns();
+	uint32_t sequence = stream->sequence++;
+	for (int i = 0; i < length; i++) {
+		if (i < 4)
+			io->data[i] = sequence >> (8 * i);
+		else if (i < EMULATED_HOST_STAMP_LEN)
+			io->data[i] = now >> (8 * (i - 4));
+		else
+			io->data[i] = sequence + i;
+	}
+	host_account(ep, length, now);
+	return length;
+}
+
+// IN endpoint: the host receives a packet.
+static int emulated_host_ep_write(int fd __attribute__((unused)), struct usb_raw_ep_io *io)
+{
+	if (io->ep >= USB_RAW_EPS_NUM_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct emulated_host_endpoint *ep = &host_eps[io->ep];
+	if (host_pace(ep) < 0)
+		return -1;
+
+	struct emulated_host_stream *stream = ep->stream;
+	uint64_t now = host_now_ns();
+	int length = io->length;
+
+	if (stream->trace && trace_replay_verifying())
+		trace_replay_verify(stream->trace, io->data, length);
+	if (stream->verify != "none" && length >= 4) {
+		uint32_t sequence = io->data[0] | (io->data[1] << 8) |
+				    (io->data[2] << 16) | ((uint32_t)io->data[3] << 24);
+		if (stream->sequence_valid && sequence != stream->sequence)
+			stream->gaps++;
+		stream->sequence = sequence + 1;
+		stream->sequence_valid = true;
+	}
+	if (stream->verify == "loopback" && length >= EMULATED_HOST_STAMP_LEN) {
+		uint64_t sent_ns = 0;
+		for (int i = 0; i < 8; i++)
+			sent_ns |= (uint64_t)io->data[4 + i] << (8 * i);
+		if (sent_ns && sent_ns <= now)
+			latency_histogram_record(&stream->latency, now - sent_ns);
+	}
+	host_account(ep, length, now);
+	return length;
+}
+
+// A generic UDC: every endpoint number supports every type and direction.
+static int emulated_host_eps_info(int fd __attribute__((unused)), struct usb_raw_eps_info *info)
+{
+	int num = 15;
+	for (int i = 0; i < num; i++) {
+		struct usb_raw_ep_info *ep = &info->eps[i];
+		snprintf((char *)ep->name, sizeof(ep->name), "ep%d", i + 1);
+		ep->addr = i + 1;
+		ep->caps.type_iso = 1;
+		ep->caps.type_bulk = 1;
+		ep->caps.type_int = 1;
+		ep->caps.dir_in = 1;
+		ep->caps.dir_out = 1;
+		ep->limits.maxpacket_limit = host_speed >= USB_SPEED_HIGH ? 1024 : 1023;
+		ep->limits.max_streams = 0;
+	}
+	return num;
+}
+
+/*----------------------------------------------------------------------*/
+
+static void emulated_host_close(int fd)
+{
+	Json::Value report;
+
+	close(fd);
+
+	printf("Emulated host control requests (ms):\n");
+	for (const struct emulated_host_request &request : host_requests) {
+		double done_ms = request.completed_ns ?
+			(request.completed_ns - request.issued_ns) / 1e6 : -1;
+		printf("  %-32s %8.3f%s", request.name.c_str(), done_ms,
+			request.stalled ? "  stalled" : "");
+		Json::Value entry;
+		entry["name"] = request.name;
+		entry["ms"] = done_ms;
+		entry["stalled"] = request.stalled;
+		if (request.first_data_ns) {
+			double first_ms = (request.first_data_ns - request.issued_ns) / 1e6;
+			printf("  first data %8.3f", first_ms);
+			entry["first_data_ms"] = first_ms;
+		}
+		printf("\n");
+		report["requests"].append(entry);
+	}
+
+	printf("Emulated host endpoints:\n");
+	for (auto &it : host_streams) {
+		struct emulated_host_stream *stream = it.second;
+		double secs = (stream->last_ns - stream->first_ns) / 1e9;
+		double mbps = secs > 0 ? stream->bytes / secs / 1e6 : 0;
+		printf("  EP%02x(%s): %lu packets, %lu bytes, %.2f MB/s, %lu gaps",
+			stream->address, (stream->address & USB_DIR_IN) ? "in" : "out",
+			(unsigned long)stream->packets, (unsigned long)stream->bytes,
+			mbps, (unsigned long)stream->gaps);
+
+		char key[8];
+		snprintf(key, sizeof(key), "0x%02x", stream->address);
+		Json::Value entry;
+		entry["packets"] = (Json::UInt64)stream->packets;
+		entry["bytes"] = (Json::UInt64)stream->bytes;
+		entry["mb_per_s"] = mbps;
+		entry["gaps"] = (Json::UInt64)stream->gaps;
+		if (stream->latency.total_count) {
+			double p50 = latency_histogram_percentile(&stream->latency, 50) / 1000.0;
+			double p99 = latency_histogram_percentile(&stream->latency, 99) / 1000.0;
+			printf(", latency p50 %.1f us p99 %.1f us", p50, p99);
+			entry["latency_p50_us"] = p50;
+			entry["latency_p99_us"] = p99;
+			entry["latency_max_us"] = stream->latency.max_ns / 1000.0;
+		}
+		printf("\n");
+		report["endpoints"][key] = entry;
+	}
+
+	std::string path = host_script.get("report", "").asString();
+	if (path.empty())
+		return;
+	std::ofstream ofs(path.c_str());
+	Json::StreamWriterBuilder builder;
+	ofs << Json::writeString(builder, report) << std::endl;
+	if (!ofs)
+		fprintf(stderr, "Error writing emulated host report: %s\n", path.c_str());
+	else
+		printf("Emulated host report written to %s\n", path.c_str());
+}
+
+struct host_backend emulated_host_backend = {
+	.name =		"emulated",
+	.open =		emulated_host_open,
+	.close =	emulated_host_close,
+	.init =		emulated_host_init,
+	.run =		emulated_host_run,
+	.event_fetch =	emulated_host_event_fetch,
+	.ep0_read =	emulated_host_ep0_read,
+	.ep0_write =	emulated_host_ep0_write,
+	.ep0_stall =	emulated_host_ep0_stall,
+	.ep_enable =	emulated_host_ep_enable,
+	.ep_disable =	emulated_host_ep_disable,
+	.ep_read =	emulated_host_ep_read,
+	.ep_write =	emulated_host_ep_write,
+	.configure =	emulated_host_configure,
+	.eps_info =	emulated_host_eps_info,
+};
@@ -15,11 +15,20 @@
 #include <linux/types.h>
 
 #include "host-raw-gadget.h"
+#include "probes.h"
 
 struct raw_gadget_device host_device_desc;
 
 /*----------------------------------------------------------------------*/
 
+// Issue an endpoint I/O ioctl, bracketed by USDT probes (see probes.h).
+static int raw_ep_io_ioctl(int fd, unsigned long request, struct usb_raw_ep_io *io) {
+	PROXY_PROBE(gadget_ioctl_entry, io->ep, io->length, _IOC_NR(request));
+	int rv = ioctl(fd, request, io);
+	PROXY_PROBE(gadget_ioctl_exit, io->ep, rv, rv < 0 ? -errno : 0);
+	return rv;
+}
+
 int usb_raw_open() {
 	int fd = open("/dev/raw-gadget", O_RDWR);
 	if (fd < 0) {
@@ -29,6 +38,10 @@ int usb_raw_open() {
 	return fd;
 }
 
+void usb_raw_close(int fd) {
+	close(fd);
+}
+
 void usb_raw_init(int fd, enum usb_device_speed speed,
 			const char *driver, const char *device) {
 	struct usb_raw_init arg;
@@ -52,6 +65,7 @@ void usb_raw_run(int fd) {
 
 void usb_raw_event_fetch(int fd, struct usb_raw_event *event) {
 	int rv = ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, event);
+	PROXY_PROBE(ep0_event_fetch, 0, event->length, rv < 0 ? -errno : (int)event->type);
 	if (rv < 0) {
 		if (errno == EINTR) {
 			event->length = 4294967295;
@@ -63,7 +77,7 @@ void usb_raw_event_fetch(int fd, struct usb_raw_event *event) {
 }
 
 int usb_raw_ep0_read(int fd, struct usb_raw_ep_io *io) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP0_READ, io);
+	int rv = raw_ep_io_ioctl(fd, USB_RAW_IOCTL_EP0_READ, io);
 	if (rv < 0) {
 		if (errno == EBUSY ||
 		    errno == EINVAL ||
@@ -77,7 +91,7 @@ int usb_raw_ep0_read(int fd, struct usb_raw_ep_io *io) {
 }
 
 int usb_raw_ep0_write(int fd, struct usb_raw_ep_io *io) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, io);
+	int rv = raw_ep_io_ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, io);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP0_WRITE)");
 		exit(EXIT_FAILURE);
@@ -104,7 +118,7 @@ int usb_raw_ep_disable(int fd, uint32_t num) {
 }
 
 int usb_raw_ep_read(int fd, struct usb_raw_ep_io *io) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP_READ, io);
+	int rv = raw_ep_io_ioctl(fd, USB_RAW_IOCTL_EP_READ, io);
 	if (rv < 0) {
 		if (errno == EINPROGRESS) {
 			// Ignore failures caused by the test that halts endpoints.
@@ -134,7 +148,7 @@ int usb_raw_ep_read(int fd, struct usb_raw_ep_io *io) {
 }
 
 int usb_raw_ep_write(int fd, struct usb_raw_ep_io *io) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP_WRITE, io);
+	int rv = raw_ep_io_ioctl(fd, USB_RAW_IOCTL_EP_WRITE, io);
 	if (rv < 0) {
 		if (errno == EINPROGRESS) {
 			// Ignore failures caused by the test that halts endpoints.
@@ -207,6 +221,24 @@ void usb_raw_ep_set_halt(int fd, int ep) {
 	}
 }
 
+struct host_backend raw_gadget_host_backend = {
+	.name =		"raw-gadget",
+	.open =		usb_raw_open,
+	.close =	usb_raw_close,
+	.init =		usb_raw_init,
+	.run =		usb_raw_run,
+	.event_fetch =	usb_raw_event_fetch,
+	.ep0_read =	usb_raw_ep0_read,
+	.ep0_write =	usb_raw_ep0_write,
+	.ep0_stall =	usb_raw_ep0_stall,
+	.ep_enable =	usb_raw_ep_enable,
+	.ep_disable =	usb_raw_ep_disable,
+	.ep_read =	usb_raw_ep_read,
+	.ep_write =	usb_raw_ep_write,
+	.configure =	usb_raw_configure,
+	.eps_info =	usb_raw_eps_info,
+};
+
 /*----------------------------------------------------------------------*/
 
 void log_control_request(struct usb_ctrlrequest *ctrl) {
@@ -368,7 +400,7 @@ void print_eps_info(int fd) {
 	struct usb_raw_eps_info info;
 	memset(&info, 0, sizeof(info));
 
-	int num = usb_raw_eps_info(fd, &info);
+	int num = host_backend->eps_info(fd, &info);
 	for (int i = 0; i < num; i++) {
 		printf("ep #%d:\n", i);
 		printf("  name: %s\n", &info.eps[i].name[0]);
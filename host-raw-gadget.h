@@ -4,6 +4,8 @@
 #include <deque>
 
 #include "misc.h"
+#include "stats.h"
+#include "host-backend.h"
 
 /*----------------------------------------------------------------------*/
 
@@ -87,7 +89,7 @@ struct usb_raw_eps_info {
 
 /*----------------------------------------------------------------------*/
 
-#define MAX_TRANSFER_SIZE 4096
+#define MAX_TRANSFER_SIZE 16384
 
 struct usb_raw_control_event {
 	struct usb_raw_event		inner;
@@ -99,23 +101,52 @@ struct usb_raw_transfer_io {
 	char				data[MAX_TRANSFER_SIZE];
 };
 
+// Element of the per-endpoint queue between the reading and writing threads.
+// Copies move only the io.inner.length bytes in use, not the whole buffer.
+struct queued_transfer {
+	struct usb_raw_transfer_io	io;
+	struct transfer_stamps		stamps;
+
+	queued_transfer() {}
+	queued_transfer(const queued_transfer &other) { *this = other; }
+	queued_transfer &operator=(const queued_transfer &other) {
+		if (this != &other) {
+			io.inner = other.io.inner;
+			memcpy(io.data, other.io.data,
+			       std::min<size_t>(other.io.inner.length, MAX_TRANSFER_SIZE));
+			stamps = other.stamps;
+		}
+		return *this;
+	}
+};
+
 /*----------------------------------------------------------------------*/
 
 struct thread_info {
 	int				fd;
 	int				ep_num;
 	struct usb_endpoint_descriptor 	endpoint;
+	// bLength is 0 unless the gadget runs at SuperSpeed.
+	struct usb_ss_ep_comp_descriptor	ss_comp;
 	__u8				device_bEndpointAddress;
-	std::string			transfer_type;
-	std::string			dir;
-	std::deque<usb_raw_transfer_io> *data_queue;
+	__u16				device_wMaxPacketSize;
+	bool				uvc_stream;	// UVC VideoStreaming endpoint
+	// UAC playback stream this endpoint carries data or feedback for,
+	// owned by the data endpoint; NULL unless --uac_jitter_ms is set.
+	struct uac_stream		*uac_stream;
+	const char			*transfer_type;	// "bulk", "int" or "isoc"
+	const char			*dir;		// "in" or "out"
+	std::deque<queued_transfer>	*data_queue;
 	std::mutex			*data_mutex;
 	std::atomic<bool>		*please_stop;
+	struct ep_stats			*stats;
 };
 
 struct raw_gadget_endpoint {
 	struct usb_endpoint_descriptor	endpoint;
+	struct usb_ss_ep_comp_descriptor	ss_comp;	// see thread_info
 	__u8				device_bEndpointAddress;
+	__u16				device_wMaxPacketSize;	// before remapping
 	__u16				udc_maxpacket_limit;
 	pthread_t			thread_read;
 	pthread_t			thread_write;
@@ -138,10 +169,13 @@ struct raw_gadget_config {
 	struct raw_gadget_interface	*interfaces;
 };
 
+// configs and everything below them point into arena, one block allocated
+// by setup_host_usb_desc().
 struct raw_gadget_device {
 	struct usb_device_descriptor 	device;
 	struct raw_gadget_config	*configs;
 	int				current_config;
+	void				*arena;
 };
 
 extern struct raw_gadget_device host_device_desc;
@@ -157,6 +191,7 @@ enum usb_injection_flags {
 /*----------------------------------------------------------------------*/
 
 int usb_raw_open();
+void usb_raw_close(int fd);
 void usb_raw_init(int fd, enum usb_device_speed speed,
 			const char *driver, const char *device);
 void usb_raw_run(int fd);
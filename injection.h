@@ -0,0 +1,35 @@
+#ifndef USB_PROXY_INJECTION_H
+#define USB_PROXY_INJECTION_H
+
+#include <string>
+#include <stdint.h>
+#include <linux/types.h>
+#include <jsoncpp/json/json.h>
+
+struct usb_raw_control_event;
+struct usb_raw_transfer_io;
+struct injection_rule_stats;
+
+// Rule engine for the injection file (see "How to do MITM attack" in README).
+// The pipeline steps are exported so that bench-injection can time them on
+// their own.
+
+void apply_operations(uint8_t *data, int len, const Json::Value &ops);
+#ifdef HAVE_LUA
+// start_ns is set once the script's lock is held.
+bool apply_lua_transform(const std::string &script_file,
+			uint8_t *data, int &len, uint64_t &start_ns);
+#endif
+bool apply_injection_pipeline(struct usb_raw_transfer_io &io,
+			const Json::Value &rule,
+			struct injection_rule_stats *rule_stats);
+
+// Control transfers: may rewrite the request and set injection_flags to
+// USB_INJECTION_FLAG_IGNORE or USB_INJECTION_FLAG_STALL.
+void injection(struct usb_raw_control_event &event, struct usb_raw_transfer_io &io,
+			int &injection_flags);
+// Data transfers: applies the first matching rule for the endpoint.
+void injection(struct usb_raw_transfer_io &io, __u8 device_ep_address,
+			std::string transfer_type);
+
+#endif // USB_PROXY_INJECTION_H
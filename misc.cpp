@@ -28,3 +28,24 @@ int hexToDecimal(int input) {
 	}
 	return output;
 }
+
+unsigned int json_uint(const Json::Value &value, unsigned int def)
+{
+	if (value.isString())
+		return std::stoul(value.asString(), nullptr, 0);
+	if (value.isNumeric())
+		return value.asUInt();
+	return def;
+}
+
+std::vector<uint8_t> parse_hex_bytes(const std::string &hex)
+{
+	std::vector<uint8_t> bytes;
+	std::string digits;
+	for (char c : hex)
+		if (isxdigit((unsigned char)c))
+			digits += c;
+	for (size_t i = 0; i + 1 < digits.size(); i += 2)
+		bytes.push_back((uint8_t)std::stoul(digits.substr(i, 2), nullptr, 16));
+	return bytes;
+}
@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string>
+#include <vector>
 #include <getopt.h>
 #include <signal.h>
 #include <chrono>
@@ -17,6 +18,7 @@
 extern int verbose_level;
 extern bool please_stop_ep0;
 extern std::atomic<bool> please_stop_eps;
+extern std::atomic<bool> device_unplugged;
 
 extern bool injection_enabled;
 extern std::string injection_file;
@@ -26,6 +28,15 @@ extern bool customized_config_enabled;
 extern bool reset_device_before_proxy;
 extern bool bmaxpacketsize0_must_greater_than_64;
 extern int iso_batch_size;
+extern enum usb_device_speed gadget_speed;
+extern std::string emulated_device_file;
+extern std::string emulated_host_file;
+extern std::string serial_filter;
 
 std::string hexToAscii(std::string input);
 int hexToDecimal(int input);
+
+// A JSON integer or "0x"-prefixed string, or def if the value is missing.
+unsigned int json_uint(const Json::Value &value, unsigned int def);
+// Bytes of a hex string such as "01 02 ff"; non-hex characters are skipped.
+std::vector<uint8_t> parse_hex_bytes(const std::string &hex);
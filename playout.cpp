@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <climits>
+
+#include "playout.h"
+#include "stats.h"
+
+// Jitter and slack are measured over windows of this length.
+#define PLAYOUT_WINDOW_NS	500000000ull
+
+static void playout_window_reset(struct iso_playout *playout, uint64_t now_ns)
+{
+	playout->window_start_ns = now_ns;
+	playout->window_min_depth = INT_MAX;
+	playout->window_first_sequence = playout->sequence;
+	playout->window_first_ns = 0;
+	playout->transit_min = DBL_MAX;
+	playout->transit_max = -DBL_MAX;
+}
+
+void iso_playout_init(struct iso_playout *playout, int latency_uframes,
+		      int interval_uframes, int max_depth)
+{
+	interval_uframes = std::max(1, interval_uframes);
+	playout->interval_ns = (uint64_t)interval_uframes * 125000;
+	playout->max_depth = std::max(1, max_depth);
+	playout->min_target = std::max(1, std::min(playout->max_depth,
+		(latency_uframes + interval_uframes - 1) / interval_uframes));
+	playout->target = playout->min_target;
+	playout->jitter = 0;
+	playout->playing = false;
+	playout->pending_zlps = 0;
+	playout->sequence = 0;
+	playout->packet_ns = playout->interval_ns;
+	playout_window_reset(playout, stats_now_ns());
+}
+
+void iso_playout_taken(struct iso_playout *playout, uint64_t enqueued_ns)
+{
+	if (!playout->window_first_ns) {
+		playout->window_first_ns = enqueued_ns;
+		playout->window_first_sequence = playout->sequence;
+	}
+	playout->window_last_ns = enqueued_ns;
+	uint64_t slot = playout->sequence++ - playout->window_first_sequence;
+	double transit = (double)(int64_t)(enqueued_ns - playout->window_first_ns) -
+			 slot * playout->packet_ns;
+	playout->transit_min = std::min(playout->transit_min, transit);
+	playout->transit_max = std::max(playout->transit_max, transit);
+}
+
+// Adapts the target to the window's jitter and returns the correction to the
+// queue depth: positive to drop packets, negative to insert zero-length ones.
+static int playout_window_end(struct iso_playout *playout)
+{
+	uint64_t packets = playout->sequence - playout->window_first_sequence;
+	if (packets > 1 && playout->transit_max >= playout->transit_min) {
+		double spread = playout->transit_max - playout->transit_min;
+		playout->jitter = (int)ceil(spread / playout->interval_ns);
+		// An estimate far off nominal comes from a stall, not drift.
+		double packet_ns = (double)(int64_t)(playout->window_last_ns - playout->window_first_ns) /
+				   (packets - 1);
+		if (packet_ns > playout->interval_ns / 2 && packet_ns < playout->interval_ns * 2)
+			playout->packet_ns = packet_ns;
+		int needed = std::max(playout->min_target,
+				      std::min(playout->max_depth, playout->jitter + 1));
+		// Grow at once, shrink one packet per window.
+		if (needed > playout->target)
+			playout->target = needed;
+		else if (needed < playout->target)
+			playout->target--;
+	}
+	if (!playout->playing || playout->window_min_depth == INT_MAX)
+		return 0;
+
+	// After priming at the target, arrivals late by the jitter leave this
+	// much in the queue.
+	int slack = std::max(1, playout->target - playout->jitter);
+	int error = playout->window_min_depth - slack;
+	// Leave some of the window's jitter in the deadband so that the
+	// queue is not trimmed and refilled every window.
+	int deadband = std::max(1, playout->jitter / 2);
+	if (error > deadband)
+		return error - deadband;
+	if (error < 0)
+		return error;
+	return 0;
+}
+
+bool iso_playout_next(struct iso_playout *playout, int depth, uint64_t now_ns,
+		      int *drop, struct ep_stats *stats)
+{
+	*drop = 0;
+	playout->window_min_depth = std::min(playout->window_min_depth, depth);
+	if (now_ns - playout->window_start_ns >= PLAYOUT_WINDOW_NS) {
+		int correction = playout_window_end(playout);
+		if (correction > 0)
+			*drop = correction;
+		else
+			playout->pending_zlps -= correction;
+		playout_window_reset(playout, now_ns);
+		if (stats)
+			stats->playout_target = playout->target;
+	}
+	if (depth - *drop > playout->max_depth)
+		*drop = depth - playout->target;
+	depth -= *drop;
+	if (stats)
+		stats->playout_drops += *drop;
+
+	if (!playout->playing) {
+		if (depth < playout->target) {
+			if (stats)
+				stats->playout_zlps++;
+			return false;
+		}
+		playout->playing = true;
+		playout->pending_zlps = 0;
+	}
+	if (depth == 0) {
+		// Underrun: wait for the target again.
+		playout->playing = false;
+		if (stats) {
+			stats->playout_underruns++;
+			stats->playout_zlps++;
+		}
+		return false;
+	}
+	if (playout->pending_zlps > 0) {
+		playout->pending_zlps--;
+		if (stats)
+			stats->playout_zlps++;
+		return false;
+	}
+	return true;
+}
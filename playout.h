@@ -0,0 +1,52 @@
+#ifndef USB_PROXY_PLAYOUT_H
+#define USB_PROXY_PLAYOUT_H
+
+#include <stdint.h>
+
+struct ep_stats;
+
+// Isochronous IN playout buffer (--iso_in_latency N): instead of writing
+// packets to the host as fast as the endpoint queue fills, the writer holds
+// the queue at a depth that rides out the arrival jitter of the device-side
+// batches. Playback starts once the queue reaches the target depth: the
+// configured latency, raised to the jitter seen in the last window (between
+// the configured depth and a maximum). Each window the slack that remained in
+// the queue is compared with what the target leaves: excess latency is shed
+// by dropping the oldest packets, a shortfall (host clock faster than the
+// device's) by inserting zero-length packets. An empty queue sends a
+// zero-length packet and waits for the target again.
+
+struct iso_playout {
+	uint64_t	interval_ns;	// host-side service interval
+	int		min_target;	// depth from the configured latency
+	int		max_depth;
+	int		target;		// current target depth, in packets
+	int		jitter;		// arrival jitter of the last window, in packets
+	bool		playing;
+	int		pending_zlps;	// zero-length packets still to insert
+
+	uint64_t	window_start_ns;
+	int		window_min_depth;
+	// Arrival time less the packet's slot, with slots spaced by the
+	// device's measured packet interval so that clock drift does not
+	// count as jitter.
+	double		packet_ns;
+	uint64_t	window_first_sequence;
+	uint64_t	window_first_ns;
+	uint64_t	window_last_ns;
+	double		transit_min;
+	double		transit_max;
+	uint64_t	sequence;	// packets taken from the queue
+};
+
+void iso_playout_init(struct iso_playout *playout, int latency_uframes,
+		      int interval_uframes, int max_depth);
+// Accounts for a packet leaving the queue, played or dropped.
+void iso_playout_taken(struct iso_playout *playout, uint64_t enqueued_ns);
+// Plans the next service interval for a queue of depth packets. Returns
+// true to play the oldest queued packet, false to send a zero-length packet
+// instead; *drop is set to the number of oldest packets to discard first.
+bool iso_playout_next(struct iso_playout *playout, int depth, uint64_t now_ns,
+		      int *drop, struct ep_stats *stats);
+
+#endif // USB_PROXY_PLAYOUT_H
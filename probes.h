@@ -0,0 +1,41 @@
+#ifndef USB_PROXY_PROBES_H
+#define USB_PROXY_PROBES_H
+
+// Static user-space probes (USDT) for perf/bpftrace, e.g.:
+//   bpftrace -e 'usdt:./usb-proxy:usb_proxy:queue_push { @[arg0] = hist(arg2); }'
+//   perf probe -x ./usb-proxy sdt_usb_proxy:libusb_complete
+//
+// Every probe carries (endpoint, length, status). endpoint is the device-side
+// address for libusb and injection probes, the gadget-side address for queue
+// probes, the Raw Gadget endpoint number for gadget probes, and 0 for ep0.
+// Where status reports an outcome it is 0 on success and negative on failure.
+//
+//   libusb_submit       length requested; status is bRequest for control
+//                       transfers, the ISO batch size for batched ISO reads,
+//                       otherwise the retry attempt (0 for the first)
+//   libusb_complete     length transferred; status is a libusb_error, or
+//                       -libusb_transfer_status for asynchronous transfers
+//   gadget_ioctl_entry  length of the buffer; status is the ioctl number
+//   gadget_ioctl_exit   length is the ioctl's return value; status is -errno
+//   ep0_event_fetch     length of the event; status is the event type, or
+//                       -errno if the fetch failed
+//   injection_start     length before the rules; status is bRequest for
+//                       control requests, 0 for data
+//   injection_end       length after the rules; status is the injection
+//                       flags for control requests, 1 if data was modified
+//   queue_push          length of the queued transfer; status is the queue
+//   queue_pop           depth after the push or pop
+//
+// Probes compile to a single nop when the build has <sys/sdt.h> (HAVE_SDT)
+// and to nothing otherwise.
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define PROXY_PROBE(name, ep, len, status) \
+	DTRACE_PROBE3(usb_proxy, name, ep, len, status)
+#else
+#define PROXY_PROBE(name, ep, len, status) \
+	do { (void)(ep); (void)(len); (void)(status); } while (0)
+#endif
+
+#endif // USB_PROXY_PROBES_H
@@ -1,18 +1,21 @@
 #include <vector>
 #include <algorithm>
 #include <map>
+#include <tuple>
 
 #include "host-raw-gadget.h"
+#include "bandwidth.h"
 #include "device-libusb.h"
+#include "descriptor-cache.h"
+#include "injection.h"
 #include "misc.h"
-
-#ifdef HAVE_LUA
-extern "C" {
-#include <lua.h>
-#include <lauxlib.h>
-#include <lualib.h>
-}
-#endif
+#include "playout.h"
+#include "probes.h"
+#include "snapshot.h"
+#include "timeline.h"
+#include "trace.h"
+#include "uac.h"
+#include "uvc.h"
 
 // UVC Video Streaming interface selectors (USB Video Class spec)
 #define UVC_VS_PROBE_CONTROL		0x01
@@ -20,61 +23,88 @@ extern "C" {
 #define UVC_VS_INPUT_HEADER		0x01
 #define UVC_SC_VIDEOSTREAMING		0x02
 
-// Offset of dwMaxPayloadTransferSize in UVC probe/commit response
+// Offsets of dwFrameInterval, dwMaxVideoFrameSize and
+// dwMaxPayloadTransferSize in UVC probe/commit response
+#define UVC_PROBE_FRAME_INTERVAL_OFFSET	4
+#define UVC_PROBE_MAX_FRAME_SIZE_OFFSET	18
 #define UVC_PROBE_MAX_PAYLOAD_OFFSET	22
 
+// HID class report descriptor type (HID spec 7.1)
+#define HID_DT_REPORT			0x22
+
+// Buffer for bulk and interrupt OUT reads, SuperSpeed bursts included. A
+// gadget OUT request completes only on a short packet or a full buffer, so a
+// larger one would hold back transfers that end on a packet boundary without
+// a ZLP.
+#define OUT_TRANSFER_SIZE		4096
+
+// Queue depth at which a UVC stream starts dropping frames.
+#define UVC_FRAME_DROP_DEPTH		(EP_QUEUE_LIMIT / 2)
+// How far ahead of the device a UAC playback stream keeps packets
+// submitted, and the bounds on that in packets.
+#define UAC_OUT_LEAD_US			1000
+#define UAC_OUT_LEAD_MIN		2
+#define UAC_OUT_LEAD_MAX		4
+// Largest share by which packets to a device without feedback are sized
+// off the nominal rate to hold the jitter buffer at its target.
+#define UAC_RATE_CORRECTION		0.005
+// Deepest an ISO IN playout buffer may grow, short of making the reader
+// back off.
+#define PLAYOUT_MAX_DEPTH		(EP_QUEUE_LIMIT * 3 / 4)
+
 extern bool auto_remap_endpoints;
+extern bool iso_high_bandwidth;
+extern bool uvc_repacketize;
+extern int uac_jitter_ms;
+extern int iso_in_latency;
+
+// Per-configuration lookup tables, built once by build_remap_tables() after
+// the endpoints have been remapped, so that ep0 does not walk the descriptor
+// tree on every request.
+struct remap_table {
+	uint8_t			device_address[256];	// by gadget endpoint address
+	uint16_t		iso_maxpacket[256];	// UDC ISO bytes per microframe, by interface number
+	std::vector<uint8_t>	config;			// rewritten GET_DESCRIPTOR responses
+	std::vector<uint8_t>	other_speed_config;
+};
 
-static uint16_t find_udc_maxpacket_for_interface(uint8_t interface_number)
-{
-	struct raw_gadget_config *config =
-		&host_device_desc.configs[host_device_desc.current_config];
-	uint16_t max_limit = 0;
+static std::vector<struct remap_table> remap_tables;
 
-	for (int i = 0; i < config->config.bNumInterfaces; i++) {
-		struct raw_gadget_interface *iface = &config->interfaces[i];
-		for (int j = 0; j < iface->num_altsettings; j++) {
-			struct raw_gadget_altsetting *alt = &iface->altsettings[j];
-			if (alt->interface.bInterfaceNumber != interface_number)
-				continue;
-			for (int k = 0; k < alt->interface.bNumEndpoints; k++) {
-				struct raw_gadget_endpoint *ep = &alt->endpoints[k];
-				if (usb_endpoint_type(&ep->endpoint) != USB_ENDPOINT_XFER_ISOC)
-					continue;
-				if (ep->udc_maxpacket_limit &&
-				    ep->udc_maxpacket_limit > max_limit)
-					max_limit = ep->udc_maxpacket_limit;
-			}
-		}
-	}
+static struct remap_table *current_remap_table()
+{
+	if ((size_t)host_device_desc.current_config >= remap_tables.size())
+		return NULL;
+	return &remap_tables[host_device_desc.current_config];
+}
 
-	return max_limit;
+// Largest UDC isochronous payload per microframe among the interface's
+// endpoints.
+static uint16_t find_udc_maxpacket_for_interface(uint8_t interface_number)
+{
+	struct remap_table *table = current_remap_table();
+	return table ? table->iso_maxpacket[interface_number] : 0;
 }
 
 // Translate a gadget-side endpoint address back to the physical device's
 // endpoint address. Needed for endpoint-directed class requests (e.g.,
 // USB Audio SET_CUR for sampling frequency) when endpoint remapping is active.
-static uint16_t remap_endpoint_for_device(uint16_t gadget_ep_addr)
+uint16_t remap_endpoint_for_device(uint16_t gadget_ep_addr)
 {
 	if (!auto_remap_endpoints)
 		return gadget_ep_addr;
 
-	struct raw_gadget_config *config =
-		&host_device_desc.configs[host_device_desc.current_config];
+	struct remap_table *table = current_remap_table();
+	return table ? table->device_address[gadget_ep_addr & 0xff] : gadget_ep_addr;
+}
 
-	for (int i = 0; i < config->config.bNumInterfaces; i++) {
-		struct raw_gadget_interface *iface = &config->interfaces[i];
-		for (int j = 0; j < iface->num_altsettings; j++) {
-			struct raw_gadget_altsetting *alt = &iface->altsettings[j];
-			for (int k = 0; k < alt->interface.bNumEndpoints; k++) {
-				struct raw_gadget_endpoint *ep = &alt->endpoints[k];
-				if (ep->endpoint.bEndpointAddress == (uint8_t)gadget_ep_addr)
-					return ep->device_bEndpointAddress;
-			}
-		}
-	}
+// dwMaxPayloadTransferSize the device asked for, by interface number, while
+// its payloads are being repacketized; 0 otherwise.
+static uint32_t uvc_device_payload[256];
 
-	return gadget_ep_addr;
+static uint32_t get_le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	       ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
 }
 
 static void clamp_uvc_probe_commit(const usb_ctrlrequest *ctrl,
@@ -99,10 +129,23 @@ static void clamp_uvc_probe_commit(const usb_ctrlrequest *ctrl,
 
 	uint8_t *payload = (uint8_t *)io.data;
 	uint8_t *p = payload + UVC_PROBE_MAX_PAYLOAD_OFFSET;
-	uint32_t max_payload = (uint32_t)p[0] |
-		((uint32_t)p[1] << 8) |
-		((uint32_t)p[2] << 16) |
-		((uint32_t)p[3] << 24);
+	uint32_t max_payload = get_le32(p);
+
+	// With --uvc_repacketize the device keeps its format if the stream
+	// fits through the UDC once split. The host is still told the UDC's
+	// size so that it picks a gadget altsetting it can use.
+	bool repacketized = uvc_repacketize && max_payload > maxp &&
+		uvc_stream_fits(get_le32(payload + UVC_PROBE_MAX_FRAME_SIZE_OFFSET),
+				get_le32(payload + UVC_PROBE_FRAME_INTERVAL_OFFSET), maxp);
+	// Only the device's answer counts: the host's SET_CUR(COMMIT) carries
+	// the size already clamped here.
+	if (ctrl->bRequestType & USB_DIR_IN) {
+		if (repacketized && uvc_device_payload[interface_number] != max_payload)
+			printf("UVC: interface %u payloads of %u bytes will be repacketized to %u\n",
+				interface_number, max_payload, maxp);
+		uvc_device_payload[interface_number] = repacketized ? max_payload : 0;
+	}
+
 	if (max_payload > maxp) {
 		p[0] = maxp & 0xff;
 		p[1] = (maxp >> 8) & 0xff;
@@ -190,6 +233,17 @@ static void rewrite_descriptor_addresses(uint8_t descriptor_type, uint8_t descri
 				current_endpoint++;
 			}
 		}
+		else if (dtype == USB_DT_SS_ENDPOINT_COMP) {
+			// Follows the endpoint it belongs to; remapping may have
+			// clamped its burst.
+			if (current_alt && current_endpoint > 0 &&
+			    offset + USB_DT_SS_EP_COMP_SIZE <= length) {
+				struct raw_gadget_endpoint *ep = &current_alt->endpoints[current_endpoint - 1];
+				if (ep->ss_comp.bLength)
+					memcpy(&data[offset + 2], (uint8_t *)&ep->ss_comp + 2,
+					       USB_DT_SS_EP_COMP_SIZE - 2);
+			}
+		}
 		else if (dtype == USB_DT_CS_INTERFACE) {
 			if (current_alt && current_alt->interface.bInterfaceClass == USB_CLASS_VIDEO) {
 				uint8_t subtype = data[offset + 2];
@@ -216,43 +270,157 @@ static void rewrite_descriptor_addresses(uint8_t descriptor_type, uint8_t descri
 	}
 }
 
-static void maybe_override_descriptor(struct usb_ctrlrequest *ctrl,
-				      struct usb_raw_transfer_io &io)
+// Final bytes sent to the host for standard GET_DESCRIPTOR requests, after
+// endpoint rewriting and the bMaxPacketSize0 patch, keyed by bRequestType
+// (device or interface recipient), wValue, wIndex and wLength. Hosts ask for
+// the same descriptors over and over while enumerating; repeats are answered
+// without a device round trip. Only touched by the ep0 thread.
+typedef std::tuple<uint8_t, uint16_t, uint16_t, uint16_t> descriptor_response_key;
+static std::map<descriptor_response_key, std::vector<uint8_t>> descriptor_responses;
+static uint64_t descriptor_response_hits;
+
+static bool descriptor_response_cacheable(const struct usb_ctrlrequest *ctrl)
 {
-	if (!auto_remap_endpoints)
-		return;
-	if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
-		return;
-	if (ctrl->bRequest != USB_REQ_GET_DESCRIPTOR)
-		return;
+	// Injection rules may be stateful (Lua), so their output is not cached.
+	return !injection_enabled &&
+	       (ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD &&
+	       ctrl->bRequest == USB_REQ_GET_DESCRIPTOR;
+}
+
+// Copies the remapped configuration descriptor rendered by
+// build_remap_tables() into io. Served whether or not injection is enabled;
+// the rules then run on the copy.
+static bool remap_descriptor_lookup(const struct usb_ctrlrequest *ctrl,
+				    struct usb_raw_transfer_io &io)
+{
+	if (!auto_remap_endpoints ||
+	    (ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD ||
+	    ctrl->bRequest != USB_REQ_GET_DESCRIPTOR)
+		return false;
 
 	uint8_t descriptor_type = ctrl->wValue >> 8;
 	uint8_t descriptor_index = ctrl->wValue & 0xff;
-	rewrite_descriptor_addresses(descriptor_type, descriptor_index,
-				     (uint8_t *)io.data, io.inner.length);
+	if (descriptor_index >= remap_tables.size() ||
+	    (descriptor_type != USB_DT_CONFIG && descriptor_type != USB_DT_OTHER_SPEED_CONFIG))
+		return false;
+
+	struct remap_table *table = &remap_tables[descriptor_index];
+	const std::vector<uint8_t> &blob = descriptor_type == USB_DT_CONFIG ?
+		table->config : table->other_speed_config;
+	if (blob.empty())
+		return false;
+	size_t length = std::min<size_t>(std::min<size_t>(blob.size(), ctrl->wLength),
+					 sizeof(io.data));
+	memcpy(&io.data[0], blob.data(), length);
+	io.inner.length = length;
+	descriptor_response_hits++;
+	return true;
+}
+
+static bool descriptor_response_lookup(const struct usb_ctrlrequest *ctrl,
+				       struct usb_raw_transfer_io &io)
+{
+	if (!descriptor_response_cacheable(ctrl))
+		return false;
+
+	auto it = descriptor_responses.find(descriptor_response_key(ctrl->bRequestType,
+			ctrl->wValue, ctrl->wIndex, ctrl->wLength));
+	if (it == descriptor_responses.end())
+		return false;
+	memcpy(&io.data[0], it->second.data(), it->second.size());
+	io.inner.length = it->second.size();
+	descriptor_response_hits++;
+	return true;
+}
+
+static void descriptor_response_store(const struct usb_ctrlrequest *ctrl,
+				      const struct usb_raw_transfer_io &io)
+{
+	if (!descriptor_response_cacheable(ctrl))
+		return;
+	descriptor_responses[descriptor_response_key(ctrl->bRequestType,
+			ctrl->wValue, ctrl->wIndex, ctrl->wLength)]
+		.assign(io.data, io.data + io.inner.length);
+}
+
+static void descriptor_response_invalidate(const char *reason)
+{
+	if (descriptor_responses.empty())
+		return;
+	if (verbose_level)
+		printf("ep0: dropping %zu cached descriptor responses (%s), %lu hits so far\n",
+			descriptor_responses.size(), reason,
+			(unsigned long)descriptor_response_hits);
+	descriptor_responses.clear();
+}
+
+// The device altsetting uvcvideo would pick for payload: the smallest
+// isochronous IN endpoint that carries it, or else the largest one.
+static int find_uvc_device_altsetting(struct raw_gadget_interface *iface, uint32_t payload)
+{
+	int best_alt = -1, largest_alt = -1;
+	uint32_t best_bytes = UINT32_MAX, largest_bytes = 0;
+
+	for (int i = 0; i < iface->num_altsettings; i++) {
+		struct raw_gadget_altsetting *alt = &iface->altsettings[i];
+		for (int k = 0; k < alt->interface.bNumEndpoints; k++) {
+			struct raw_gadget_endpoint *ep = &alt->endpoints[k];
+			if (usb_endpoint_type(&ep->endpoint) != USB_ENDPOINT_XFER_ISOC ||
+			    !usb_endpoint_dir_in(&ep->endpoint))
+				continue;
+			uint32_t bytes = (ep->device_wMaxPacketSize & 0x7ff) *
+				(((ep->device_wMaxPacketSize >> 11) & 0x3) + 1);
+			if (bytes >= payload && bytes < best_bytes) {
+				best_bytes = bytes;
+				best_alt = i;
+			}
+			if (bytes > largest_bytes) {
+				largest_bytes = bytes;
+				largest_alt = i;
+			}
+		}
+	}
+	return best_alt >= 0 ? best_alt : largest_alt;
 }
 
-// Returns the index of the best altsetting that fits UDC limits, or -1 if none.
-// The desired_altsetting is returned directly if remapping is disabled or if it has no endpoints.
+// Returns the index of the best altsetting that fits UDC limits and the
+// periodic bandwidth left by the other interfaces, or -1 if none. Without
+// remapping the desired_altsetting is kept if it fits, and otherwise the
+// altsetting with the highest load below it that fits is used.
+// desired_altsetting is returned directly if it has no endpoints.
 static int find_best_compatible_altsetting(struct raw_gadget_interface *iface,
 					   int desired_interface,
 					   int desired_altsetting)
 {
-	if (!auto_remap_endpoints)
-		return desired_altsetting;
-
 	struct raw_gadget_altsetting *desired_alt = &iface->altsettings[desired_altsetting];
 	if (desired_alt->interface.bNumEndpoints == 0) {
 		// Alt 0 (no endpoints) is usually the idle state; never remap it.
 		return desired_altsetting;
 	}
+	if (!auto_remap_endpoints && bandwidth_fits(desired_interface, desired_alt))
+		return desired_altsetting;
+
+	// Repacketized video: the device gets the altsetting for its own
+	// payload size; the gadget endpoints are clamped to the UDC anyway.
+	uint32_t uvc_payload = uvc_device_payload[desired_alt->interface.bInterfaceNumber];
+	if (uvc_repacketize && uvc_payload) {
+		int alt = find_uvc_device_altsetting(iface, uvc_payload);
+		if (alt >= 0 && bandwidth_fits(desired_interface, &iface->altsettings[alt])) {
+			printf("UVC: interface %d uses device altsetting %d for %u-byte payloads\n",
+				desired_alt->interface.bInterfaceNumber,
+				iface->altsettings[alt].interface.bAlternateSetting, uvc_payload);
+			return alt;
+		}
+	}
 
 	const struct libusb_interface_descriptor *alts =
 		device_config_desc[host_device_desc.current_config]
 			->interface[desired_interface].altsetting;
+	unsigned int desired_load = bandwidth_altsetting_load(desired_alt);
 
 	int best_alt = -1;
 	int best_packet = -1;
+	unsigned int best_load = 0;
 
 	for (int i = 0; i < iface->num_altsettings; i++) {
 		struct raw_gadget_altsetting *alt = &iface->altsettings[i];
@@ -262,7 +430,7 @@ static int find_best_compatible_altsetting(struct raw_gadget_interface *iface,
 		bool fits = true;
 		int alt_packet = 0;
 
-		for (int k = 0; k < alt->interface.bNumEndpoints; k++) {
+		for (int k = 0; auto_remap_endpoints && k < alt->interface.bNumEndpoints; k++) {
 			struct raw_gadget_endpoint *ep = &alt->endpoints[k];
 			if (usb_endpoint_type(&ep->endpoint) != USB_ENDPOINT_XFER_ISOC)
 				continue;
@@ -276,12 +444,26 @@ static int find_best_compatible_altsetting(struct raw_gadget_interface *iface,
 				fits = false;
 				break;
 			}
+			if (iso_high_bandwidth)
+				dev_maxp *= ((alts[i].endpoint[k].wMaxPacketSize >> 11) & 0x3) + 1;
 			if (dev_maxp > alt_packet)
 				alt_packet = dev_maxp;
 		}
 
-		if (fits && alt_packet >= best_packet) {
-			best_packet = alt_packet;
+		if (!fits || !bandwidth_fits(desired_interface, alt))
+			continue;
+
+		if (auto_remap_endpoints) {
+			if (alt_packet >= best_packet) {
+				best_packet = alt_packet;
+				best_alt = i;
+			}
+			continue;
+		}
+
+		unsigned int load = bandwidth_altsetting_load(alt);
+		if (load <= desired_load && (best_alt < 0 || load >= best_load)) {
+			best_load = load;
 			best_alt = i;
 		}
 	}
@@ -289,394 +471,355 @@ static int find_best_compatible_altsetting(struct raw_gadget_interface *iface,
 	return best_alt;
 }
 
-// ── Approach 1: declarative per-byte operations ──────────────────────────────
-//
-// Applies the "operations" array from an injection rule to the packet in-place.
-// Operations are applied in order. Offsets are 0-based.
-//
-// Supported types (size=1 is int8 default, size=2 is int16 LE):
-//   negate  { offset [, size] }           – two's-complement negate signed value
-//   scale   { offset, factor [, size] }   – multiply by float, clamp to range
-//   add     { offset, value  [, size] }   – add signed constant, clamp to range
-//   clamp   { offset, min, max [, size] } – clamp signed value to [min, max]
-//   xor     { offset, mask }              – XOR byte with mask (integer)
-//   swap    { offset, offset_b }          – swap two bytes
-//   copy    { offset, dst_offset }        – copy byte to another position
-//   set     { offset, value }             – force byte to unsigned value 0-255
-//
-static void apply_operations(uint8_t *data, int len, const Json::Value &ops)
-{
-	for (unsigned int i = 0; i < ops.size(); i++) {
-		const Json::Value &op = ops[i];
-		std::string type = op.get("type", "").asString();
-		int offset = op.get("offset", -1).asInt();
-
-		if (type == "negate") {
-			if (offset < 0) continue;
-			int size = op.get("size", 1).asInt();
-			if (size == 2) {
-				if (offset + 1 >= len) continue;
-				int32_t v = (int32_t)(int16_t)((uint16_t)data[offset] |
-				                               ((uint16_t)data[offset + 1] << 8));
-				v = -v;
-				if (v < -32768) v = -32768;
-				if (v > 32767)  v = 32767;
-				uint16_t uv = (uint16_t)(int16_t)v;
-				data[offset]     = (uint8_t)(uv & 0xFF);
-				data[offset + 1] = (uint8_t)(uv >> 8);
-			} else {
-				if (offset >= len) continue;
-				data[offset] = (uint8_t)(-(int8_t)data[offset]);
-			}
-
-		} else if (type == "scale") {
-			if (offset < 0) continue;
-			double factor = op.get("factor", 1.0).asDouble();
-			int size = op.get("size", 1).asInt();
-			if (size == 2) {
-				if (offset + 1 >= len) continue;
-				int32_t v = (int32_t)(int16_t)((uint16_t)data[offset] |
-				                               ((uint16_t)data[offset + 1] << 8));
-				v = (int32_t)(v * factor);
-				if (v < -32768) v = -32768;
-				if (v > 32767)  v = 32767;
-				uint16_t uv = (uint16_t)(int16_t)v;
-				data[offset]     = (uint8_t)(uv & 0xFF);
-				data[offset + 1] = (uint8_t)(uv >> 8);
-			} else {
-				if (offset >= len) continue;
-				int result = (int)((int8_t)data[offset] * factor);
-				result = std::max(-128, std::min(127, result));
-				data[offset] = (uint8_t)(int8_t)result;
-			}
-
-		} else if (type == "add") {
-			if (offset < 0) continue;
-			int size = op.get("size", 1).asInt();
-			if (size == 2) {
-				if (offset + 1 >= len) continue;
-				int32_t v = (int32_t)(int16_t)((uint16_t)data[offset] |
-				                               ((uint16_t)data[offset + 1] << 8));
-				v += op.get("value", 0).asInt();
-				if (v < -32768) v = -32768;
-				if (v > 32767)  v = 32767;
-				uint16_t uv = (uint16_t)(int16_t)v;
-				data[offset]     = (uint8_t)(uv & 0xFF);
-				data[offset + 1] = (uint8_t)(uv >> 8);
-			} else {
-				if (offset >= len) continue;
-				int result = (int)(int8_t)data[offset] + op.get("value", 0).asInt();
-				result = std::max(-128, std::min(127, result));
-				data[offset] = (uint8_t)(int8_t)result;
-			}
-
-		} else if (type == "clamp") {
-			if (offset < 0) continue;
-			int size = op.get("size", 1).asInt();
-			if (size == 2) {
-				if (offset + 1 >= len) continue;
-				int32_t v = (int32_t)(int16_t)((uint16_t)data[offset] |
-				                               ((uint16_t)data[offset + 1] << 8));
-				int min_v = op.get("min", -32768).asInt();
-				int max_v = op.get("max",  32767).asInt();
-				v = std::max(min_v, std::min(max_v, (int)v));
-				uint16_t uv = (uint16_t)(int16_t)v;
-				data[offset]     = (uint8_t)(uv & 0xFF);
-				data[offset + 1] = (uint8_t)(uv >> 8);
-			} else {
-				if (offset >= len) continue;
-				int min_v = op.get("min", -128).asInt();
-				int max_v = op.get("max",  127).asInt();
-				int result = std::max(min_v, std::min(max_v, (int)(int8_t)data[offset]));
-				data[offset] = (uint8_t)(int8_t)result;
-			}
-
-		} else if (type == "xor") {
-			if (offset < 0 || offset >= len) continue;
-			data[offset] ^= (uint8_t)op.get("mask", 0).asInt();
-
-		} else if (type == "swap") {
-			int b = op.get("offset_b", -1).asInt();
-			if (offset < 0 || offset >= len) continue;
-			if (b < 0 || b >= len) continue;
-			uint8_t tmp = data[offset];
-			data[offset] = data[b];
-			data[b] = tmp;
-
-		} else if (type == "copy") {
-			int dst = op.get("dst_offset", -1).asInt();
-			if (offset < 0 || offset >= len) continue;
-			if (dst < 0 || dst >= len) continue;
-			data[dst] = data[offset];
-
-		} else if (type == "set") {
-			if (offset < 0 || offset >= len) continue;
-			data[offset] = (uint8_t)op.get("value", 0).asInt();
-
-		} else {
-			printf("apply_operations: unknown op type '%s'\n", type.c_str());
-		}
+void printData(const struct usb_raw_transfer_io &io, __u8 bEndpointAddress, std::string transfer_type, std::string dir) {
+	printf("Sending data to EP%x(%s_%s):", bEndpointAddress,
+		transfer_type.c_str(), dir.c_str());
+	for (unsigned int i = 0; i < io.inner.length; i++) {
+		printf(" %02hhx", (unsigned)io.data[i]);
 	}
+	printf("\n");
 }
 
-// ── Approach 2: Lua scripting ─────────────────────────────────────────────────
-//
-// Each unique script_file gets one lua_State loaded on first use, protected
-// by a per-state mutex (Lua states are not thread-safe).
-//
-// The script must export:
-//   function transform(data, len)  →  data, new_len
-//
-// where `data` is a 1-indexed Lua table of byte values (0-255),
-// `len` is the original packet length, and the function returns the
-// (possibly modified) table and the new length.
-//
-#ifdef HAVE_LUA
-struct LuaRuleState {
-	lua_State *L = nullptr;
-	std::mutex call_mutex;
-};
+void noop_signal_handler(int) { }
 
-static std::mutex                          lua_registry_mutex;
-static std::map<std::string, LuaRuleState *> lua_states;
+// Name endpoint threads after their role, e.g. "ep81-isoc-in-rd", so that they
+// can be told apart in perf/top. Names are truncated to 15 characters.
+static void set_ep_thread_name(const struct usb_endpoint_descriptor &ep,
+			       const std::string &transfer_type,
+			       const std::string &dir, const char *role)
+{
+	char name[16];
+	snprintf(name, sizeof(name), "ep%02x-%s-%s-%s", ep.bEndpointAddress,
+		 transfer_type.c_str(), dir.c_str(), role);
+	pthread_setname_np(pthread_self(), name);
+}
 
-static LuaRuleState *get_lua_state(const std::string &script_file)
+// Bytes the endpoint moves per service interval, which libusb and Raw
+// Gadget see as one packet (isochronous) or one transfer: up to 3
+// transactions per microframe for high-bandwidth isochronous endpoints, and
+// a whole burst at SuperSpeed.
+static int transfer_bytes(const struct usb_endpoint_descriptor *ep,
+			  const struct usb_ss_ep_comp_descriptor *ss_comp)
 {
-	std::lock_guard<std::mutex> guard(lua_registry_mutex);
-	auto it = lua_states.find(script_file);
-	if (it != lua_states.end())
-		return it->second;
-
-	auto *state = new LuaRuleState();
-	state->L = luaL_newstate();
-	luaL_openlibs(state->L);
-	if (luaL_dofile(state->L, script_file.c_str()) != LUA_OK) {
-		fprintf(stderr, "Lua: failed to load '%s': %s\n",
-			script_file.c_str(), lua_tostring(state->L, -1));
-		lua_close(state->L);
-		state->L = nullptr;
-	} else {
-		printf("Lua: loaded '%s'\n", script_file.c_str());
+	bool isoc = usb_endpoint_type(ep) == USB_ENDPOINT_XFER_ISOC;
+
+	int bytes = usb_endpoint_maxp(ep);
+	if (ss_comp->bLength) {
+		bytes *= ss_comp->bMaxBurst + 1;
+		if (isoc)
+			bytes *= USB_SS_MULT(ss_comp->bmAttributes);
+	}
+	else if (isoc) {
+		bytes *= usb_endpoint_maxp_mult(ep);
 	}
-	lua_states[script_file] = state;
-	return state;
+	return std::min(bytes, MAX_TRANSFER_SIZE);
 }
 
-static bool apply_lua_transform(const std::string &script_file,
-				uint8_t *data, int &len)
+static int ep_transfer_bytes(const struct thread_info &thread_info)
 {
-	LuaRuleState *state = get_lua_state(script_file);
-	if (!state || !state->L)
-		return false;
+	return transfer_bytes(&thread_info.endpoint, &thread_info.ss_comp);
+}
 
-	std::lock_guard<std::mutex> guard(state->call_mutex);
-	lua_State *L = state->L;
+// The same for the device's endpoint, which is larger than the gadget's
+// when remapping clamped it.
+static int device_transfer_bytes(const struct thread_info &thread_info)
+{
+	struct usb_endpoint_descriptor ep = thread_info.endpoint;
+	ep.wMaxPacketSize = thread_info.device_wMaxPacketSize;
+	return transfer_bytes(&ep, &thread_info.ss_comp);
+}
 
-	lua_getglobal(L, "transform");
-	if (!lua_isfunction(L, -1)) {
-		fprintf(stderr, "Lua: '%s' has no 'transform' function\n",
-			script_file.c_str());
-		lua_pop(L, 1);
+// Mirror the ISO IN read path: call the dedicated ISO function directly
+// rather than going through the send_data() dispatcher. On success the async
+// callback owns and frees the buffer. Returns false once the device is gone.
+static bool send_iso_out(const struct thread_info &thread_info, uint8_t *data,
+			 int length, const struct transfer_stamps *stamps)
+{
+	int rv = device_backend->send_iso_data(thread_info.device_bEndpointAddress,
+				       data, length, USB_REQUEST_TIMEOUT,
+				       thread_info.stats, stamps);
+	if (rv == LIBUSB_ERROR_NO_DEVICE) {
+		delete[] data;
+		printf("EP%x(%s_%s): device likely reset, stopping thread\n",
+			thread_info.endpoint.bEndpointAddress, thread_info.transfer_type,
+			thread_info.dir);
 		return false;
 	}
-
-	// Build 1-indexed Lua table from packet bytes
-	lua_newtable(L);
-	for (int i = 0; i < len; i++) {
-		lua_pushinteger(L, i + 1);
-		lua_pushinteger(L, data[i]);
-		lua_rawset(L, -3);
+	if (rv != LIBUSB_SUCCESS) {
+		delete[] data;
+		if (thread_info.stats)
+			thread_info.stats->drops++;
 	}
-	lua_pushinteger(L, len);
+	return true;
+}
 
-	// Call transform(data, len) → data, new_len
-	if (lua_pcall(L, 2, 2, 0) != LUA_OK) {
-		fprintf(stderr, "Lua: transform error in '%s': %s\n",
-			script_file.c_str(), lua_tostring(L, -1));
-		lua_pop(L, 1);
+// Writes io to the host. Returns false once the thread should stop; *written
+// is the number of bytes written, or -1 if an isochronous timing error lost
+// the packet.
+static bool write_to_host(const struct thread_info &thread_info,
+			  struct usb_raw_transfer_io &io, int *written)
+{
+	const struct usb_endpoint_descriptor &ep = thread_info.endpoint;
+	int rv = host_backend->ep_write(thread_info.fd, (struct usb_raw_ep_io *)&io);
+	*written = rv;
+	if (rv < 0 && errno == ESHUTDOWN) {
+		printf("EP%x(%s_%s): device likely reset, stopping thread\n",
+			ep.bEndpointAddress, thread_info.transfer_type, thread_info.dir);
 		return false;
 	}
-
-	// Second return value: new length
-	if (!lua_isnumber(L, -1)) {
-		fprintf(stderr, "Lua: '%s' transform must return (table, integer)\n",
-			script_file.c_str());
-		lua_pop(L, 2);
+	if (rv < 0 && errno == EINTR) {
+		printf("EP%x(%s_%s): interface likely changing, stopping thread\n",
+			ep.bEndpointAddress, thread_info.transfer_type, thread_info.dir);
 		return false;
 	}
-	int new_len = (int)lua_tointeger(L, -1);
-	lua_pop(L, 1);
-
-	// First return value: modified byte table
-	if (!lua_istable(L, -1)) {
-		fprintf(stderr, "Lua: '%s' transform must return (table, integer)\n",
-			script_file.c_str());
-		lua_pop(L, 1);
-		return false;
+	if (rv < 0 && (errno == EXDEV || errno == ENODATA || errno == EOVERFLOW)) {
+		printf("EP%x(%s_%s): isochronous timing error on write (errno=%d), ignoring transfer\n",
+			ep.bEndpointAddress, thread_info.transfer_type, thread_info.dir, errno);
+		if (thread_info.stats)
+			thread_info.stats->drops++;
+		*written = -1;
+		return true;
 	}
-	new_len = std::min(new_len, MAX_TRANSFER_SIZE);
-	for (int i = 0; i < new_len; i++) {
-		lua_pushinteger(L, i + 1);
-		lua_rawget(L, -2);
-		data[i] = (uint8_t)(lua_tointeger(L, -1) & 0xFF);
-		lua_pop(L, 1);
+	if (rv < 0) {
+		perror("usb_raw_ep_write()");
+		exit(EXIT_FAILURE);
 	}
-	lua_pop(L, 1); // pop table
-
-	len = new_len;
 	return true;
 }
-#endif // HAVE_LUA
 
-// Apply the 3-step injection pipeline (pattern+replace, operations, Lua)
-// to the transfer buffer.  Returns true if anything was modified.
-static bool apply_injection_pipeline(struct usb_raw_transfer_io &io,
-				     const Json::Value &rule)
+// Whether an endpoint goes through a playout buffer (--iso_in_latency). UVC
+// streams drop whole frames instead (uvc_stream_payload()), and UAC feedback
+// packets set the host's sample rate, so neither may be padded or dropped
+// one packet at a time.
+static bool ep_playout(const struct thread_info &thread_info)
 {
-	bool modified = false;
-
-	// Step 1: pattern match + replacement
-	if (rule.isMember("content_pattern") && rule.isMember("replacement")) {
-		Json::Value patterns = rule["content_pattern"];
-		std::string replacement_hex = rule["replacement"].asString();
-		if (patterns.size() > 0 && !replacement_hex.empty()) {
-			std::string data(io.data, io.inner.length);
-			std::string replacement = hexToAscii(replacement_hex);
-			for (unsigned int j = 0; j < patterns.size(); j++) {
-				std::string pattern_hex = patterns[j].asString();
-				std::string pattern = hexToAscii(pattern_hex);
-
-				std::string::size_type pos = data.find(pattern);
-				while (pos != std::string::npos) {
-					if (data.length() - pattern.length() + replacement.length() > 1023)
-						break;
-					data = data.replace(pos, pattern.length(), replacement);
-					printf("Modified from %s to %s at Index %ld\n",
-						pattern_hex.c_str(), replacement_hex.c_str(), pos);
-					modified = true;
-					pos = data.find(pattern);
-				}
-			}
-			if (modified) {
-				io.inner.length = data.length();
-				for (size_t j = 0; j < data.length(); j++)
-					io.data[j] = data[j];
-			}
-		}
-	}
-
-	// Step 2: declarative operations
-	if (rule.isMember("operations") && rule["operations"].size() > 0) {
-		apply_operations(reinterpret_cast<uint8_t *>(io.data),
-				 (int)io.inner.length,
-				 rule["operations"]);
-		modified = true;
-	}
+	const struct usb_endpoint_descriptor &ep = thread_info.endpoint;
+	if (iso_in_latency <= 0 || !(ep.bEndpointAddress & USB_DIR_IN) ||
+	    (ep.bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) != USB_ENDPOINT_XFER_ISOC)
+		return false;
+	if (thread_info.uvc_stream)
+		return false;
+	return !thread_info.uac_stream ||
+	       thread_info.uac_stream->feedback_bEndpointAddress != thread_info.device_bEndpointAddress;
+}
 
-	// Step 3: Lua transform
-#ifdef HAVE_LUA
-	if (rule.isMember("script_file")) {
-		int len = (int)io.inner.length;
-		if (apply_lua_transform(rule["script_file"].asString(),
-					reinterpret_cast<uint8_t *>(io.data),
-					len)) {
-			io.inner.length = (__u32)len;
-			modified = true;
-		}
+// The playout buffer counts on one packet per service interval, so intervals
+// the device sent nothing for are queued as zero-length packets. Returns the
+// queue depth.
+static size_t playout_enqueue_empty(const struct thread_info &thread_info, int count)
+{
+	struct queued_transfer transfer;
+	transfer.io.inner.ep = thread_info.ep_num;
+	transfer.io.inner.flags = 0;
+	transfer.io.inner.length = 0;
+	transfer.stamps = {};
+
+	std::lock_guard<std::mutex> guard(*thread_info.data_mutex);
+	std::deque<queued_transfer> *data_queue = thread_info.data_queue;
+	for (int i = 0; i < count; i++) {
+		transfer.stamps.enqueued_ns = stats_now_ns();
+		data_queue->push_back(transfer);
+		PROXY_PROBE(queue_push, thread_info.endpoint.bEndpointAddress, 0, data_queue->size());
+		ep_stats_enqueued(thread_info.stats, 0, data_queue->size());
 	}
-#endif
-
-	return modified;
+	return data_queue->size();
 }
 
-// ─────────────────────────────────────────────────────────────────────────────
+// Writer for an ISO IN endpoint with a playout buffer (--iso_in_latency):
+// one packet per service interval, queued or zero-length as the playout
+// buffer decides. Zero-length packets are only sent once data has arrived.
+static void playout_write_loop(const struct thread_info &thread_info)
+{
+	struct ep_stats *stats = thread_info.stats;
+	std::deque<queued_transfer> *data_queue = thread_info.data_queue;
+	std::mutex *data_mutex = thread_info.data_mutex;
+	struct iso_playout playout;
+	iso_playout_init(&playout, iso_in_latency,
+		1 << (std::max(1, std::min<int>(thread_info.endpoint.bInterval, 16)) - 1),
+		PLAYOUT_MAX_DEPTH);
+	bool started = false;
 
-void injection(struct usb_raw_control_event &event, struct usb_raw_transfer_io &io, int &injection_flags) {
-	const std::vector<std::string> injection_type{"modify", "ignore", "stall"};
+	while (!*thread_info.please_stop && !please_stop_eps) {
+		struct queued_transfer transfer;
+		struct usb_raw_transfer_io &io = transfer.io;
 
-	for (unsigned int i = 0; i < injection_type.size(); i++) {
-		for (unsigned int j = 0; j < injection_config["control"][injection_type[i]].size(); j++) {
-			Json::Value rule = injection_config["control"][injection_type[i]][j];
-			if (!rule["enable"].asBool())
-				continue;
+		data_mutex->lock();
+		int depth = data_queue->size();
+		if (!started && !depth) {
+			data_mutex->unlock();
+			usleep(100);
+			continue;
+		}
+		started = true;
 
-			if (event.ctrl.bRequestType != hexToDecimal(rule["bRequestType"].asInt()) ||
-			    event.ctrl.bRequest     != hexToDecimal(rule["bRequest"].asInt()) ||
-			    event.ctrl.wValue       != hexToDecimal(rule["wValue"].asInt()) ||
-			    event.ctrl.wIndex       != hexToDecimal(rule["wIndex"].asInt()) ||
-			    event.ctrl.wLength      != hexToDecimal(rule["wLength"].asInt()))
-				continue;
+		int drop;
+		bool play = iso_playout_next(&playout, depth, stats_now_ns(), &drop, stats);
+		for (; drop > 0; drop--) {
+			iso_playout_taken(&playout, data_queue->front().stamps.enqueued_ns);
+			data_queue->pop_front();
+		}
+		if (play) {
+			transfer = data_queue->front();
+			data_queue->pop_front();
+			iso_playout_taken(&playout, transfer.stamps.enqueued_ns);
+			PROXY_PROBE(queue_pop, thread_info.endpoint.bEndpointAddress,
+				    io.inner.length, data_queue->size());
+		}
+		data_mutex->unlock();
 
-			printf("Matched injection rule: %s, index: %d\n", injection_type[i].c_str(), j);
-			if (injection_type[i] == "modify") {
-				apply_injection_pipeline(io, rule);
-				if (!(event.ctrl.bRequestType & USB_DIR_IN))
-					event.ctrl.wLength = io.inner.length;
-			}
-			else if (injection_type[i] == "ignore") {
-				printf("Ignore this control transfer\n");
-				injection_flags = USB_INJECTION_FLAG_IGNORE;
-			}
-			else if (injection_type[i] == "stall") {
-				injection_flags = USB_INJECTION_FLAG_STALL;
-			}
+		if (!play) {
+			io.inner.ep = thread_info.ep_num;
+			io.inner.flags = 0;
+			io.inner.length = 0;
 		}
+		transfer.stamps.dequeued_ns = stats_now_ns();
+		if (verbose_level >= 2)
+			printData(io, thread_info.endpoint.bEndpointAddress,
+				  thread_info.transfer_type, thread_info.dir);
+
+		int rv;
+		if (!write_to_host(thread_info, io, &rv))
+			return;
+		if (play && rv >= 0)
+			ep_stats_record(stats, &transfer.stamps, stats_now_ns(), rv);
 	}
 }
 
-void injection(struct usb_raw_transfer_io &io, __u8 device_ep_address, std::string transfer_type) {
-	for (unsigned int i = 0; i < injection_config[transfer_type].size(); i++) {
-		Json::Value rule = injection_config[transfer_type][i];
-		if (!rule["enable"].asBool() ||
-		    hexToDecimal(rule["ep_address"].asInt()) != device_ep_address)
-			continue;
+// Writer for a UAC playback endpoint (--uac_jitter_ms): host packets are
+// collected into a buffer of sample frames, and packets sized to what the
+// device consumes are kept submitted a little ahead of it. Until the sample
+// rate is known the host's packets are forwarded as they are.
+static void uac_write_loop(const struct thread_info &thread_info)
+{
+	struct uac_stream *stream = thread_info.uac_stream;
+	struct ep_stats *stats = thread_info.stats;
+	std::deque<queued_transfer> *data_queue = thread_info.data_queue;
+	std::mutex *data_mutex = thread_info.data_mutex;
+	int frame_bytes = stream->frame_bytes;
+	int max_frames = device_transfer_bytes(thread_info) / frame_bytes;
+	unsigned int interval_us = 125u << (std::max(1, std::min<int>(thread_info.endpoint.bInterval, 16)) - 1);
+	int lead = std::max(UAC_OUT_LEAD_MIN,
+			    std::min<int>(UAC_OUT_LEAD_MAX, UAC_OUT_LEAD_US / interval_us));
+	bool full_speed = device_backend->get_speed() <= LIBUSB_SPEED_FULL;
+
+	// Buffered bytes, and for each host packet still in them its length
+	// and stamps, so that latency covers the time spent buffered.
+	std::deque<uint8_t> frames;
+	std::deque<std::pair<size_t, struct transfer_stamps>> sources;
+	uint32_t remainder = 0;		// 16.16 fraction of a frame
+	bool started = false, playing = false;
+
+	while (!*thread_info.please_stop && !please_stop_eps) {
+		std::deque<queued_transfer> arrived;
+		data_mutex->lock();
+		arrived.swap(*data_queue);
+		data_mutex->unlock();
 
-		// Snapshot for before/after logging (copy only incurred when verbose)
-		uint32_t orig_len = io.inner.length;
-		uint8_t orig_data[MAX_TRANSFER_SIZE];
-		if (verbose_level >= 1)
-			memcpy(orig_data, io.data, orig_len);
-
-		if (apply_injection_pipeline(io, rule)) {
-			if (verbose_level >= 1) {
-				printf("Injection[%s EP%02x] before:", transfer_type.c_str(), device_ep_address);
-				for (uint32_t j = 0; j < orig_len; j++)
-					printf(" %02x", orig_data[j]);
-				printf("\n");
-				printf("Injection[%s EP%02x] after: ", transfer_type.c_str(), device_ep_address);
-				for (uint32_t j = 0; j < io.inner.length; j++)
-					printf(" %02x", (uint8_t)io.data[j]);
-				printf("\n");
+		unsigned int rate = uac_stream_rate(stream);
+		uint64_t now = stats_now_ns();
+		for (struct queued_transfer &transfer : arrived) {
+			int length = transfer.io.inner.length;
+			transfer.stamps.dequeued_ns = now;
+			if (!rate) {
+				uint8_t *data = new uint8_t[length];
+				memcpy(data, transfer.io.data, length);
+				if (!send_iso_out(thread_info, data, length, &transfer.stamps))
+					return;
+				continue;
 			}
-			break;
+			frames.insert(frames.end(), transfer.io.data, transfer.io.data + length);
+			sources.push_back({ (size_t)length, transfer.stamps });
+			started = true;
 		}
+		if (!rate) {
+			usleep(100);
+			continue;
+		}
+		if (stats)
+			stats->uac_rate = rate;
+
+		int target = std::max<int>(1, (uint64_t)rate * uac_jitter_ms / 1000);
+		int fill = frames.size() / frame_bytes;
+		if (fill > 2 * target + max_frames) {
+			// Overrun: fall back to the target by dropping the oldest.
+			size_t drop = (size_t)(fill - target) * frame_bytes;
+			frames.erase(frames.begin(), frames.begin() + drop);
+			while (drop && !sources.empty()) {
+				size_t used = std::min(drop, sources.front().first);
+				drop -= used;
+				if ((sources.front().first -= used) == 0)
+					sources.pop_front();
+			}
+			fill = target;
+			if (stats)
+				stats->uac_overruns++;
+		}
+		stream->target = target;
+		stream->fill = fill;
+		if (!playing && fill >= target)
+			playing = true;
+
+		int submit = started && stats ? lead - stats->iso_out_in_flight : 0;
+		for (int i = 0; i < submit; i++) {
+			uint64_t packet_frames = uac_stream_packet_frames(stream, interval_us, full_speed);
+			if (!stream->feedback_bEndpointAddress) {
+				// No feedback: follow the host's rate instead.
+				double error = std::max(-1.0, std::min(1.0, (double)(fill - target) / target));
+				packet_frames = packet_frames * (1 + error * UAC_RATE_CORRECTION);
+			}
+			remainder += packet_frames;
+			int count = std::min<int>(remainder >> 16, max_frames);
+			remainder &= 0xffff;
+
+			int length = count * frame_bytes;
+			uint8_t *data = new uint8_t[std::max(length, 1)];
+			struct transfer_stamps stamps = {};
+			int taken = 0;
+			if (playing) {
+				taken = std::min(count, fill) * frame_bytes;
+				std::copy(frames.begin(), frames.begin() + taken, data);
+				frames.erase(frames.begin(), frames.begin() + taken);
+				if (!sources.empty())
+					stamps = sources.front().second;
+				for (size_t used = taken; used && !sources.empty(); ) {
+					size_t part = std::min(used, sources.front().first);
+					used -= part;
+					if ((sources.front().first -= part) == 0)
+						sources.pop_front();
+				}
+				fill -= taken / frame_bytes;
+				if (taken < length) {
+					// Underrun: pad with silence and refill to the
+					// target before playing again.
+					playing = false;
+					if (stats)
+						stats->uac_underruns++;
+				}
+			}
+			memset(data + taken, 0, length - taken);
+			stream->fill = fill;
+			if (!send_iso_out(thread_info, data, length, stamps.source_ns ? &stamps : NULL))
+				return;
+		}
+		usleep(100);
 	}
 }
 
-void printData(struct usb_raw_transfer_io io, __u8 bEndpointAddress, std::string transfer_type, std::string dir) {
-	printf("Sending data to EP%x(%s_%s):", bEndpointAddress,
-		transfer_type.c_str(), dir.c_str());
-	for (unsigned int i = 0; i < io.inner.length; i++) {
-		printf(" %02hhx", (unsigned)io.data[i]);
-	}
-	printf("\n");
-}
-
-void noop_signal_handler(int) { }
-
 void *ep_loop_write(void *arg) {
 	struct thread_info thread_info = *((struct thread_info*) arg);
-	int fd = thread_info.fd;
 	int ep_num = thread_info.ep_num;
 	struct usb_endpoint_descriptor ep = thread_info.endpoint;
 	std::string transfer_type = thread_info.transfer_type;
 	std::string dir = thread_info.dir;
-	std::deque<usb_raw_transfer_io> *data_queue = thread_info.data_queue;
+	std::deque<queued_transfer> *data_queue = thread_info.data_queue;
 	std::mutex *data_mutex = thread_info.data_mutex;
 	std::atomic<bool> *please_stop = thread_info.please_stop;
+	struct ep_stats *stats = thread_info.stats;
 
 	printf("Start writing thread for EP%02x, thread id(%d)\n",
 		ep.bEndpointAddress, gettid());
+	set_ep_thread_name(ep, transfer_type, dir, "wr");
+	ep_stats_set_thread(stats, false, true);
 
 	// Set a no-op handler for SIGUSR1. Sending this signal to the thread
 	// will thus interrupt a blocking ioctl call without other side-effects.
@@ -686,40 +829,38 @@ void *ep_loop_write(void *arg) {
 	while (!*please_stop && !please_stop_eps) {
 		assert(ep_num != -1);
 
+		if (thread_info.uac_stream && !(ep.bEndpointAddress & USB_DIR_IN)) {
+			uac_write_loop(thread_info);
+			break;
+		}
+		if (ep_playout(thread_info)) {
+			playout_write_loop(thread_info);
+			break;
+		}
+
 		data_mutex->lock();
 		if (data_queue->empty()) {
 			data_mutex->unlock();
 			usleep(100);
 			continue;
 		}
-		struct usb_raw_transfer_io io = data_queue->front();
+		struct queued_transfer transfer = data_queue->front();
 		data_queue->pop_front();
+		PROXY_PROBE(queue_pop, ep.bEndpointAddress, transfer.io.inner.length, data_queue->size());
 		data_mutex->unlock();
+		struct usb_raw_transfer_io &io = transfer.io;
+		transfer.stamps.dequeued_ns = stats_now_ns();
 
 		if (verbose_level >= 2)
 			printData(io, ep.bEndpointAddress, transfer_type, dir);
 
 		if (ep.bEndpointAddress & USB_DIR_IN) {
-			int rv = usb_raw_ep_write(fd, (struct usb_raw_ep_io *)&io);
-			if (rv < 0 && errno == ESHUTDOWN) {
-				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
-					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
-				break;
-			}
-			if (rv < 0 && errno == EINTR) {
-				printf("EP%x(%s_%s): interface likely changing, stopping thread\n",
-					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
+			int rv;
+			if (!write_to_host(thread_info, io, &rv))
 				break;
-			}
-			if (rv < 0 && (errno == EXDEV || errno == ENODATA || errno == EOVERFLOW)) {
-				printf("EP%x(%s_%s): isochronous timing error on write (errno=%d), ignoring transfer\n",
-					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str(), errno);
+			if (rv < 0)
 				continue;
-			}
-			if (rv < 0) {
-				perror("usb_raw_ep_write()");
-				exit(EXIT_FAILURE);
-			}
+			ep_stats_record(stats, &transfer.stamps, stats_now_ns(), rv);
 			printf("EP%x(%s_%s): wrote %d bytes to host\n", ep.bEndpointAddress,
 				transfer_type.c_str(), dir.c_str(), rv);
 		}
@@ -729,21 +870,10 @@ void *ep_loop_write(void *arg) {
 			memcpy(data, io.data, length);
 
 			if ((ep.bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_ISOC) {
-				// Mirror the ISO IN read path: call the dedicated ISO function
-				// directly rather than going through the send_data() dispatcher.
-				// On success the async callback owns and frees the buffer.
-				int rv = send_iso_data(thread_info.device_bEndpointAddress,
-						       data, length, USB_REQUEST_TIMEOUT);
-				if (rv == LIBUSB_ERROR_NO_DEVICE) {
-					delete[] data;
-					printf("EP%x(%s_%s): device likely reset, stopping thread\n",
-						ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
+				if (!send_iso_out(thread_info, data, length, &transfer.stamps))
 					break;
-				}
-				if (rv != LIBUSB_SUCCESS)
-					delete[] data;
 			} else {
-				int rv = send_data(thread_info.device_bEndpointAddress, ep.bmAttributes,
+				int rv = device_backend->send_data(thread_info.device_bEndpointAddress, ep.bmAttributes,
 						   data, length, USB_REQUEST_TIMEOUT);
 				if (rv == LIBUSB_ERROR_NO_DEVICE) {
 					delete[] data;
@@ -751,11 +881,16 @@ void *ep_loop_write(void *arg) {
 						ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
 					break;
 				}
+				if (rv == LIBUSB_SUCCESS)
+					ep_stats_record(stats, &transfer.stamps, stats_now_ns(), length);
+				else if (stats)
+					stats->drops++;
 				delete[] data;
 			}
 		}
 	}
 
+	ep_stats_set_thread(stats, false, false);
 	printf("End writing thread for EP%02x, thread id(%d)\n",
 		ep.bEndpointAddress, gettid());
 	return NULL;
@@ -768,12 +903,27 @@ void *ep_loop_read(void *arg) {
 	struct usb_endpoint_descriptor ep = thread_info.endpoint;
 	std::string transfer_type = thread_info.transfer_type;
 	std::string dir = thread_info.dir;
-	std::deque<usb_raw_transfer_io> *data_queue = thread_info.data_queue;
+	std::deque<queued_transfer> *data_queue = thread_info.data_queue;
 	std::mutex *data_mutex = thread_info.data_mutex;
 	std::atomic<bool> *please_stop = thread_info.please_stop;
+	struct ep_stats *stats = thread_info.stats;
+	// Device video payloads too large for the gadget endpoint are split.
+	bool repacketize = uvc_repacketize && thread_info.uvc_stream;
+	int gadget_bytes = ep_transfer_bytes(thread_info);
+	int iso_in_bytes = repacketize ? device_transfer_bytes(thread_info) : gadget_bytes;
+	int piece_bytes = repacketize ? gadget_bytes : MAX_TRANSFER_SIZE;
+	// Video streams are thinned out by whole frames instead of stalling
+	// the reader when the queue backs up.
+	bool uvc_frames = thread_info.uvc_stream &&
+		(ep.bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_ISOC;
+	struct uvc_stream uvc_stream;
+	uvc_stream_init(&uvc_stream);
+	bool playout = ep_playout(thread_info);
 
 	printf("Start reading thread for EP%02x, thread id(%d)\n",
 		ep.bEndpointAddress, gettid());
+	set_ep_thread_name(ep, transfer_type, dir, "rd");
+	ep_stats_set_thread(stats, true, true);
 
 	// Set a no-op handler for SIGUSR1. Sending this signal to the thread
 	// will thus interrupt a blocking ioctl call without other side-effects.
@@ -782,21 +932,25 @@ void *ep_loop_read(void *arg) {
 	// Check both per-endpoint flag (interface change) and global flag (device reset)
 	while (!*please_stop && !please_stop_eps) {
 		assert(ep_num != -1);
-		struct usb_raw_transfer_io io;
+		struct queued_transfer transfer;
+		struct usb_raw_transfer_io &io = transfer.io;
 
 		if (ep.bEndpointAddress & USB_DIR_IN) {
 			data_mutex->lock();
-			bool queue_full = data_queue->size() >= 32;
+			size_t queued = data_queue->size();
 			data_mutex->unlock();
-			if (queue_full) {
+			bool queue_full = queued >= EP_QUEUE_LIMIT;
+			if (queue_full && !uvc_frames) {
+				if (stats)
+					stats->queue_full_waits++;
 				usleep(200);
 				continue;
 			}
 
 			if ((ep.bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_ISOC) {
 				struct iso_batch_result batch;
-				int rv = receive_iso_data_batched(thread_info.device_bEndpointAddress,
-								usb_endpoint_maxp(&ep),
+				int rv = device_backend->receive_iso_data_batched(thread_info.device_bEndpointAddress,
+								iso_in_bytes,
 								&batch, iso_batch_size, USB_REQUEST_TIMEOUT);
 				if (rv == LIBUSB_ERROR_NO_DEVICE) {
 					printf("EP%x(%s_%s): device likely reset, stopping thread\n",
@@ -805,10 +959,18 @@ void *ep_loop_read(void *arg) {
 				}
 
 				if (rv != LIBUSB_SUCCESS || !batch.success) {
+					// A failed or all-empty batch still spans its intervals.
+					if (playout)
+						playout_enqueue_empty(thread_info,
+							rv == LIBUSB_SUCCESS ? batch.num_packets : iso_batch_size);
 					if (batch.buffer)
 						delete[] batch.buffer;
 					continue;
 				}
+				if (stats) {
+					stats->iso_batches++;
+					stats->iso_packets += batch.num_packets;
+				}
 
 				int packets_enqueued = 0;
 				for (int i = 0; i < batch.num_packets; i++) {
@@ -817,23 +979,54 @@ void *ep_loop_read(void *arg) {
 							printf("EP%x(%s_%s): packet %d status %d, skipping\n",
 								ep.bEndpointAddress, transfer_type.c_str(),
 								dir.c_str(), i, batch.packets[i].status);
-						continue;
+						if (stats)
+							stats->iso_packet_errors++;
 					}
-					if (batch.packets[i].actual_length <= 0)
+					if (batch.packets[i].status != LIBUSB_TRANSFER_COMPLETED ||
+					    batch.packets[i].actual_length <= 0) {
+						if (playout)
+							queued = playout_enqueue_empty(thread_info, 1);
 						continue;
+					}
 
-					memcpy(io.data, batch.packets[i].data, batch.packets[i].actual_length);
-					io.inner.ep = ep_num;
-					io.inner.flags = 0;
-					io.inner.length = batch.packets[i].actual_length;
-
-					if (injection_enabled)
-						injection(io, thread_info.device_bEndpointAddress, transfer_type);
-
-					data_mutex->lock();
-					data_queue->push_back(io);
-					data_mutex->unlock();
-					packets_enqueued++;
+					uint8_t *packet = batch.packets[i].data;
+					int packet_length = batch.packets[i].actual_length;
+					transfer.stamps.source_ns = batch.completed_ns;
+
+					if (trace_recording())
+						trace_record(thread_info.device_bEndpointAddress, ep.bmAttributes,
+							     packet, packet_length, transfer.stamps.source_ns);
+					if (thread_info.uac_stream)
+						uac_feedback_packet(thread_info.uac_stream, packet, packet_length);
+
+					int pieces = uvc_payload_pieces(packet, packet_length, piece_bytes);
+					if (uvc_frames &&
+					    !uvc_stream_payload(&uvc_stream, packet, packet_length,
+								queued >= UVC_FRAME_DROP_DEPTH,
+								queued + pieces > EP_QUEUE_LIMIT, stats))
+						continue;
+					for (int piece = 0; piece < pieces; piece++) {
+						io.inner.ep = ep_num;
+						io.inner.flags = 0;
+						io.inner.length = uvc_payload_piece(packet, packet_length,
+							piece_bytes, piece, (uint8_t *)io.data);
+
+						uint64_t inject_start_ns = stats_now_ns();
+						if (injection_enabled)
+							injection(io, thread_info.device_bEndpointAddress, transfer_type);
+						transfer.stamps.injected_ns = stats_now_ns();
+						if (stats)
+							stats->inject_ns += transfer.stamps.injected_ns - inject_start_ns;
+
+						data_mutex->lock();
+						transfer.stamps.enqueued_ns = stats_now_ns();
+						data_queue->push_back(transfer);
+						PROXY_PROBE(queue_push, ep.bEndpointAddress, io.inner.length, data_queue->size());
+						queued = data_queue->size();
+						ep_stats_enqueued(stats, io.inner.length, queued);
+						data_mutex->unlock();
+						packets_enqueued++;
+					}
 				}
 				if (verbose_level)
 					printf("EP%x(%s_%s): enqueued %d/%d packets (%d bytes total)\n",
@@ -848,9 +1041,10 @@ void *ep_loop_read(void *arg) {
 				unsigned char *data = NULL;
 				int nbytes = -1;
 
-				int rv = receive_data(thread_info.device_bEndpointAddress, ep.bmAttributes,
-							usb_endpoint_maxp(&ep),
+				int rv = device_backend->receive_data(thread_info.device_bEndpointAddress, ep.bmAttributes,
+							ep_transfer_bytes(thread_info),
 							&data, &nbytes, USB_REQUEST_TIMEOUT);
+				transfer.stamps.source_ns = stats_now_ns();
 				if (rv == LIBUSB_ERROR_NO_DEVICE) {
 					printf("EP%x(%s_%s): device likely reset, stopping thread\n",
 						ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
@@ -865,11 +1059,22 @@ void *ep_loop_read(void *arg) {
 					io.inner.flags = 0;
 					io.inner.length = nbytes;
 
+					if (trace_recording())
+						trace_record(thread_info.device_bEndpointAddress, ep.bmAttributes,
+							     io.data, io.inner.length, transfer.stamps.source_ns);
+
+					uint64_t inject_start_ns = stats_now_ns();
 					if (injection_enabled)
 						injection(io, thread_info.device_bEndpointAddress, transfer_type);
+					transfer.stamps.injected_ns = stats_now_ns();
+					if (stats)
+						stats->inject_ns += transfer.stamps.injected_ns - inject_start_ns;
 
 					data_mutex->lock();
-					data_queue->push_back(io);
+					transfer.stamps.enqueued_ns = stats_now_ns();
+					data_queue->push_back(transfer);
+					PROXY_PROBE(queue_push, ep.bEndpointAddress, io.inner.length, data_queue->size());
+					ep_stats_enqueued(stats, io.inner.length, data_queue->size());
 					data_mutex->unlock();
 					if (verbose_level)
 						printf("EP%x(%s_%s): enqueued %d bytes to queue\n", ep.bEndpointAddress,
@@ -883,16 +1088,17 @@ void *ep_loop_read(void *arg) {
 		else {
 			io.inner.ep = ep_num;
 			io.inner.flags = 0;
-			// For ISO OUT, limit the buffer to one packet (wMaxPacketSize).
+			// For ISO OUT, limit the buffer to one service interval's payload.
 			// Passing a larger buffer (e.g. 4096) causes musb-hdrc to report
 			// req->actual = req->length instead of the real frame size, which
 			// then triggers EMSGSIZE (-90) when forwarding to the physical device.
 			if ((ep.bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_ISOC)
-				io.inner.length = usb_endpoint_maxp(&ep);
+				io.inner.length = ep_transfer_bytes(thread_info);
 			else
-				io.inner.length = sizeof(io.data);
+				io.inner.length = OUT_TRANSFER_SIZE;
 
-			int rv = usb_raw_ep_read(fd, (struct usb_raw_ep_io *)&io);
+			int rv = host_backend->ep_read(fd, (struct usb_raw_ep_io *)&io);
+			transfer.stamps.source_ns = stats_now_ns();
 			if (rv < 0 && errno == ESHUTDOWN) {
 				printf("EP%x(%s_%s): device likely reset, stopping thread\n",
 					ep.bEndpointAddress, transfer_type.c_str(), dir.c_str());
@@ -917,11 +1123,22 @@ void *ep_loop_read(void *arg) {
 					transfer_type.c_str(), dir.c_str(), rv);
 			io.inner.length = rv;
 
+			if (trace_recording())
+				trace_record(thread_info.device_bEndpointAddress, ep.bmAttributes,
+					     io.data, io.inner.length, transfer.stamps.source_ns);
+
+			uint64_t inject_start_ns = stats_now_ns();
 			if (injection_enabled)
 				injection(io, thread_info.device_bEndpointAddress, transfer_type);
+			transfer.stamps.injected_ns = stats_now_ns();
+			if (stats)
+				stats->inject_ns += transfer.stamps.injected_ns - inject_start_ns;
 
 			data_mutex->lock();
-			data_queue->push_back(io);
+			transfer.stamps.enqueued_ns = stats_now_ns();
+			data_queue->push_back(transfer);
+			PROXY_PROBE(queue_push, ep.bEndpointAddress, io.inner.length, data_queue->size());
+			ep_stats_enqueued(stats, io.inner.length, data_queue->size());
 			data_mutex->unlock();
 			if (verbose_level)
 				printf("EP%x(%s_%s): enqueued %d bytes to queue\n", ep.bEndpointAddress,
@@ -929,6 +1146,7 @@ void *ep_loop_read(void *arg) {
 		}
 	}
 
+	ep_stats_set_thread(stats, true, false);
 	printf("End reading thread for EP%02x, thread id(%d)\n",
 		ep.bEndpointAddress, gettid());
 	return NULL;
@@ -939,6 +1157,25 @@ void process_eps(int fd, int config, int interface, int altsetting) {
 					.interfaces[interface].altsettings[altsetting];
 
 	printf("Activating %d endpoints on interface %d\n", (int)alt->interface.bNumEndpoints, interface);
+	bandwidth_reserve(interface, alt);
+
+	struct uac_stream *uac = NULL;
+	if (uac_jitter_ms > 0)
+		uac = uac_stream_create(device_config_desc[config],
+			&device_config_desc[config]->interface[interface].altsetting[altsetting]);
+	// The data endpoint may not have been mapped to the UDC.
+	bool uac_mapped = false;
+	for (int i = 0; uac && i < alt->interface.bNumEndpoints; i++)
+		if (alt->endpoints[i].device_bEndpointAddress == uac->device_bEndpointAddress)
+			uac_mapped = true;
+	if (uac && !uac_mapped) {
+		delete uac;
+		uac = NULL;
+	}
+	if (uac)
+		printf("UAC: EP%02x plays through a %d ms jitter buffer%s\n",
+			uac->device_bEndpointAddress, uac_jitter_ms,
+			uac->feedback_bEndpointAddress ? ", feedback adjusted" : "");
 
 	for (int i = 0; i < alt->interface.bNumEndpoints; i++) {
 		struct raw_gadget_endpoint *ep = &alt->endpoints[i];
@@ -948,8 +1185,21 @@ void process_eps(int fd, int config, int interface, int altsetting) {
 
 		ep->thread_info.fd = fd;
 		ep->thread_info.endpoint = ep->endpoint;
+		ep->thread_info.ss_comp = ep->ss_comp;
+		ep->thread_info.device_wMaxPacketSize = ep->device_wMaxPacketSize;
+		ep->thread_info.uvc_stream =
+			alt->interface.bInterfaceClass == USB_CLASS_VIDEO &&
+			alt->interface.bInterfaceSubClass == UVC_SC_VIDEOSTREAMING;
+		ep->thread_info.uac_stream = uac &&
+			(ep->device_bEndpointAddress == uac->device_bEndpointAddress ||
+			 ep->device_bEndpointAddress == uac->feedback_bEndpointAddress) ? uac : NULL;
 		ep->thread_info.device_bEndpointAddress = ep->device_bEndpointAddress;
-		ep->thread_info.data_queue = new std::deque<usb_raw_transfer_io>;
+		// Alternate settings may share a gadget endpoint address; the
+		// active one owns it.
+		if (auto_remap_endpoints && (size_t)config < remap_tables.size())
+			remap_tables[config].device_address[ep->endpoint.bEndpointAddress] =
+				ep->device_bEndpointAddress;
+		ep->thread_info.data_queue = new std::deque<queued_transfer>;
 		ep->thread_info.data_mutex = new std::mutex;
 		ep->thread_info.please_stop = new std::atomic<bool>(false);
 
@@ -973,10 +1223,14 @@ void process_eps(int fd, int config, int interface, int altsetting) {
 		else
 			ep->thread_info.dir = "out";
 
-		ep->thread_info.ep_num = usb_raw_ep_enable(fd, &ep->thread_info.endpoint);
+		ep->thread_info.stats = ep_stats_get(ep->device_bEndpointAddress,
+						     ep->thread_info.transfer_type);
+		ep->thread_info.stats->bInterval = ep->endpoint.bInterval;
+
+		ep->thread_info.ep_num = host_backend->ep_enable(fd, &ep->thread_info.endpoint);
 		printf("%s_%s: addr = %u, ep = #%d\n",
-			ep->thread_info.transfer_type.c_str(),
-			ep->thread_info.dir.c_str(),
+			ep->thread_info.transfer_type,
+			ep->thread_info.dir,
 			addr, ep->thread_info.ep_num);
 
 		if (verbose_level)
@@ -1025,22 +1279,258 @@ void terminate_eps(int fd, int config, int interface, int altsetting) {
 	// Phase 3: Clean up resources after all threads have exited.
 	for (int i = 0; i < alt->interface.bNumEndpoints; i++) {
 		struct raw_gadget_endpoint *ep = &alt->endpoints[i];
-		usb_raw_ep_disable(fd, ep->thread_info.ep_num);
+		// Not enabled if the host never configured the device.
+		if (ep->thread_info.ep_num >= 0)
+			host_backend->ep_disable(fd, ep->thread_info.ep_num);
 		ep->thread_info.ep_num = -1;
 
 		delete ep->thread_info.data_queue;
 		delete ep->thread_info.data_mutex;
 		delete ep->thread_info.please_stop;
+		// The data endpoint owns the UAC stream, the feedback one shares it.
+		if (!usb_endpoint_dir_in(&ep->endpoint))
+			delete ep->thread_info.uac_stream;
+		ep->thread_info.uac_stream = nullptr;
 		ep->thread_info.data_queue = nullptr;
 		ep->thread_info.data_mutex = nullptr;
 		ep->thread_info.please_stop = nullptr;
 	}
+	bandwidth_release(interface);
+}
+
+static const char *raw_event_name(uint32_t type)
+{
+	switch (type) {
+	case USB_RAW_EVENT_CONNECT:
+		return "connect";
+	case USB_RAW_EVENT_SUSPEND:
+		return "suspend";
+	case USB_RAW_EVENT_RESUME:
+		return "resume";
+	case USB_RAW_EVENT_RESET:
+		return "reset";
+	case USB_RAW_EVENT_DISCONNECT:
+		return "disconnect";
+	default:
+		return "unknown";
+	}
+}
+
+// Short human-readable name of a control request for the enumeration timeline.
+static std::string control_request_name(const struct usb_ctrlrequest *ctrl)
+{
+	char name[64];
+
+	if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD) {
+		snprintf(name, sizeof(name), "%s request 0x%02x",
+			 (ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_CLASS ? "CLASS" : "VENDOR",
+			 ctrl->bRequest);
+		return name;
+	}
+
+	switch (ctrl->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR: {
+		const char *type = NULL;
+		switch (ctrl->wValue >> 8) {
+		case USB_DT_DEVICE:
+			type = "DEVICE";
+			break;
+		case USB_DT_CONFIG:
+			type = "CONFIG";
+			break;
+		case USB_DT_STRING:
+			type = "STRING";
+			break;
+		case USB_DT_DEVICE_QUALIFIER:
+			type = "DEVICE_QUALIFIER";
+			break;
+		case USB_DT_OTHER_SPEED_CONFIG:
+			type = "OTHER_SPEED_CONFIG";
+			break;
+		case USB_DT_BOS:
+			type = "BOS";
+			break;
+		case HID_DT_REPORT:
+			type = "HID_REPORT";
+			break;
+		}
+		if (type)
+			snprintf(name, sizeof(name), "GET_DESCRIPTOR %s", type);
+		else
+			snprintf(name, sizeof(name), "GET_DESCRIPTOR 0x%02x", ctrl->wValue >> 8);
+		return name;
+	}
+	case USB_REQ_SET_CONFIGURATION:
+		return "SET_CONFIGURATION";
+	case USB_REQ_GET_CONFIGURATION:
+		return "GET_CONFIGURATION";
+	case USB_REQ_SET_INTERFACE:
+		return "SET_INTERFACE";
+	case USB_REQ_GET_INTERFACE:
+		return "GET_INTERFACE";
+	case USB_REQ_GET_STATUS:
+		return "GET_STATUS";
+	case USB_REQ_CLEAR_FEATURE:
+		return "CLEAR_FEATURE";
+	case USB_REQ_SET_FEATURE:
+		return "SET_FEATURE";
+	default:
+		snprintf(name, sizeof(name), "STANDARD request 0x%02x", ctrl->bRequest);
+		return name;
+	}
+}
+
+// control_request() wrapped in a timeline span measuring the device round trip.
+static int timed_control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
+				 unsigned char **dataptr, int timeout)
+{
+	if (descriptor_cache_device_pending()) {
+		int length = descriptor_cache_control(setup_packet, *dataptr);
+		if (length >= 0) {
+			*nbytes = length;
+			return 0;
+		}
+		if (!descriptor_cache_wait_device())
+			return -1;
+	}
+
+	timeline_span span("device round trip", "device");
+	int result = device_backend->control_request(setup_packet, nbytes, dataptr, timeout);
+	if (result == 0 && snapshot_enabled())
+		snapshot_record_control(setup_packet, *dataptr, *nbytes);
+	if (timeline_enabled()) {
+		span.args["result"] = result;
+		span.args["nbytes"] = result == 0 ? *nbytes : 0;
+	}
+	return result;
+}
+
+// Fetches a descriptor for build_remap_tables(). Behind a descriptor cache
+// hit only cached responses are used, so as not to wait for the device.
+static std::vector<uint8_t> fetch_descriptor(uint8_t type, uint8_t index, uint16_t length)
+{
+	struct usb_ctrlrequest ctrl;
+	ctrl.bRequestType = USB_DIR_IN;
+	ctrl.bRequest = USB_REQ_GET_DESCRIPTOR;
+	ctrl.wValue = (type << 8) | index;
+	ctrl.wIndex = 0;
+	ctrl.wLength = length;
+
+	std::vector<uint8_t> data(length);
+	unsigned char *dataptr = data.data();
+	int nbytes = 0;
+	if (descriptor_cache_device_pending()) {
+		nbytes = descriptor_cache_control(&ctrl, dataptr);
+		if (nbytes < 0)
+			return std::vector<uint8_t>();
+	}
+	else if (timed_control_request(&ctrl, &nbytes, &dataptr, USB_REQUEST_TIMEOUT) != 0) {
+		return std::vector<uint8_t>();
+	}
+	data.resize(nbytes);
+	return data;
+}
+
+// Configuration descriptors as the host sees them: fetched from the device
+// once and rewritten for the remapped endpoints. Not every device has an
+// other-speed configuration; without one, requests go to the device.
+static std::vector<uint8_t> render_config(uint8_t type, uint8_t index)
+{
+	std::vector<uint8_t> header = fetch_descriptor(type, index, USB_DT_CONFIG_SIZE);
+	if (header.size() < USB_DT_CONFIG_SIZE)
+		return std::vector<uint8_t>();
+
+	uint16_t total = header[2] | (header[3] << 8);
+	std::vector<uint8_t> blob = fetch_descriptor(type, index, total);
+	if (blob.size() != total)
+		return std::vector<uint8_t>();
+	rewrite_descriptor_addresses(type, index, blob.data(), blob.size());
+	return blob;
+}
+
+void build_remap_tables()
+{
+	int bNumConfigurations = host_device_desc.device.bNumConfigurations;
+	remap_tables.assign(bNumConfigurations, remap_table());
+
+	for (int c = 0; c < bNumConfigurations; c++) {
+		struct raw_gadget_config *config = &host_device_desc.configs[c];
+		struct remap_table *table = &remap_tables[c];
+		bool mapped[256] = {};
+
+		for (int i = 0; i < 256; i++)
+			table->device_address[i] = i;
+		memset(table->iso_maxpacket, 0, sizeof(table->iso_maxpacket));
+
+		for (int i = 0; i < config->config.bNumInterfaces; i++) {
+			struct raw_gadget_interface *iface = &config->interfaces[i];
+			for (int j = 0; j < iface->num_altsettings; j++) {
+				struct raw_gadget_altsetting *alt = &iface->altsettings[j];
+				uint8_t interface_number = alt->interface.bInterfaceNumber;
+				for (int k = 0; k < alt->interface.bNumEndpoints; k++) {
+					struct raw_gadget_endpoint *ep = &alt->endpoints[k];
+					uint8_t address = ep->endpoint.bEndpointAddress;
+					if (!mapped[address]) {
+						table->device_address[address] = ep->device_bEndpointAddress;
+						mapped[address] = true;
+					}
+					if (usb_endpoint_type(&ep->endpoint) != USB_ENDPOINT_XFER_ISOC)
+						continue;
+					uint16_t capacity = ep->udc_maxpacket_limit;
+					if (iso_high_bandwidth)
+						capacity *= usb_endpoint_maxp_mult(&ep->endpoint);
+					if (capacity > table->iso_maxpacket[interface_number])
+						table->iso_maxpacket[interface_number] = capacity;
+				}
+			}
+		}
+
+		table->config = render_config(USB_DT_CONFIG, c);
+		table->other_speed_config = render_config(USB_DT_OTHER_SPEED_CONFIG, c);
+		printf("Configuration %d: remapped descriptors %zu bytes, other-speed %zu bytes\n",
+			c, table->config.size(), table->other_speed_config.size());
+	}
+}
+
+static pthread_t ep0_thread;
+// Set while ep0_loop() runs, and while it waits for an event.
+static std::atomic<bool> ep0_running(false);
+static std::atomic<bool> ep0_fetching(false);
+
+// A SIGUSR1 that lands just before ep0_loop() enters the event fetch is
+// lost, so it is repeated for as long as the fetch is pending. Runs on its
+// own thread, as the unplug is reported on the libusb event thread.
+static void *ep0_unplug_signal(void *arg __attribute__((unused)))
+{
+	while (ep0_running) {
+		if (ep0_fetching)
+			pthread_kill(ep0_thread, SIGUSR1);
+		usleep(1000);
+	}
+	return NULL;
+}
+
+void stop_ep0_loop_unplugged()
+{
+	device_unplugged = true;
+	please_stop_eps = true;
+	please_stop_ep0 = true;
+
+	pthread_t thread;
+	if (ep0_running && !pthread_create(&thread, 0, ep0_unplug_signal, nullptr))
+		pthread_detach(thread);
 }
 
 void ep0_loop(int fd) {
 	bool set_configuration_done_once = false;
 
 	printf("Start for EP0, thread id(%d)\n", gettid());
+	// SIGUSR1 interrupts the event fetch when the device is unplugged.
+	signal(SIGUSR1, noop_signal_handler);
+	ep0_thread = pthread_self();
+	ep0_running = true;
+	// A different device may have been attached since the last run.
+	descriptor_responses.clear();
 
 	if (verbose_level)
 		print_eps_info(fd);
@@ -1050,14 +1540,24 @@ void ep0_loop(int fd) {
 		event.inner.type = 0;
 		event.inner.length = sizeof(event.ctrl);
 
-		usb_raw_event_fetch(fd, (struct usb_raw_event *)&event);
+		ep0_fetching = true;
+		host_backend->event_fetch(fd, (struct usb_raw_event *)&event);
+		ep0_fetching = false;
 		log_event((struct usb_raw_event *)&event);
 
 		if (event.inner.length == 4294967295) {
+			// After an unplug the endpoint threads are stopped below,
+			// since the proxy carries on once the device is back.
+			if (device_unplugged)
+				break;
+			ep0_running = false;
 			printf("End for EP0, thread id(%d)\n", gettid());
 			return;
 		}
 
+		if (event.inner.type != USB_RAW_EVENT_CONTROL)
+			timeline_instant(raw_event_name(event.inner.type), "event");
+
 		// Normally, we would only need to check for USB_RAW_EVENT_RESET to handle a reset event.
 		// However, dwc2 is buggy and it reports a disconnect event instead of a reset.
 		if (event.inner.type == USB_RAW_EVENT_RESET || event.inner.type == USB_RAW_EVENT_DISCONNECT) {
@@ -1067,10 +1567,20 @@ void ep0_loop(int fd) {
 			// requests submitted via sync I/O. Thus, we reset the proxied device to
 			// force libusb to interrupt the requests and allow the endpoint threads
 			// to exit on please_stop_eps checks.
-			if (set_configuration_done_once)
+			if (set_configuration_done_once) {
 				please_stop_eps = true;
-			reset_device();
+				// Re-enumeration of a configured device; enumeration
+				// repeats within one reset cycle keep hitting.
+				descriptor_response_invalidate("reset");
+			}
+			// Behind a descriptor cache hit the device may still be
+			// opening; it is reset as part of that.
+			if (!descriptor_cache_device_pending()) {
+				timeline_span span("reset_device", "device");
+				device_backend->reset();
+			}
 			if (set_configuration_done_once) {
+				timeline_span span("stop endpoint threads", "proxy");
 				struct raw_gadget_config *config = &host_device_desc.configs[host_device_desc.current_config];
 				printf("Stopping endpoint threads\n");
 				for (int i = 0; i < config->config.bNumInterfaces; i++) {
@@ -1079,7 +1589,7 @@ void ep0_loop(int fd) {
 						.interface.bInterfaceNumber;
 					terminate_eps(fd, host_device_desc.current_config, i,
 							iface->current_altsetting);
-					release_interface(interface_num);
+					device_backend->release_interface(interface_num);
 					iface->current_altsetting = 0;
 				}
 				printf("Endpoint threads stopped\n");
@@ -1093,6 +1603,15 @@ void ep0_loop(int fd) {
 		if (event.inner.type != USB_RAW_EVENT_CONTROL)
 			continue;
 
+		timeline_span request_span(timeline_enabled() ?
+			control_request_name(&event.ctrl) : std::string(), "control");
+		if (timeline_enabled()) {
+			request_span.args["bRequestType"] = event.ctrl.bRequestType;
+			request_span.args["wValue"] = event.ctrl.wValue;
+			request_span.args["wIndex"] = event.ctrl.wIndex;
+			request_span.args["wLength"] = event.ctrl.wLength;
+		}
+
 		struct usb_raw_transfer_io io;
 		io.inner.ep = 0;
 		io.inner.flags = 0;
@@ -1116,11 +1635,32 @@ void ep0_loop(int fd) {
 
 		int rv = -1;
 		if (event.ctrl.bRequestType & USB_DIR_IN) {
-			result = control_request(&event.ctrl, &nbytes, &control_data, USB_REQUEST_TIMEOUT);
-			if (result == 0) {
-				memcpy(&io.data[0], control_data, nbytes);
-				io.inner.length = nbytes;
+			if (descriptor_response_lookup(&event.ctrl, io)) {
+				if (timeline_enabled())
+					request_span.args["cached"] = true;
+				rv = host_backend->ep0_write(fd, (struct usb_raw_ep_io *)&io);
+				if (rv < 0)
+					printf("ep0: ack failed: %d\n", rv);
+				else
+					printf("ep0: transferred %d bytes (in, cached)\n", rv);
+				delete[] control_data;
+				continue;
+			}
 
+			if (remap_descriptor_lookup(&event.ctrl, io)) {
+				if (timeline_enabled())
+					request_span.args["cached"] = true;
+				result = 0;
+			}
+			else {
+				result = timed_control_request(&event.ctrl, &nbytes, &control_data,
+							       USB_REQUEST_TIMEOUT);
+				if (result == 0) {
+					memcpy(&io.data[0], control_data, nbytes);
+					io.inner.length = nbytes;
+				}
+			}
+			if (result == 0) {
 				if (injection_enabled) {
 					injection(event, io, injection_flags);
 					switch(injection_flags) {
@@ -1131,7 +1671,7 @@ void ep0_loop(int fd) {
 						continue;
 					case USB_INJECTION_FLAG_STALL:
 						delete[] control_data;
-						usb_raw_ep0_stall(fd);
+						host_backend->ep0_stall(fd);
 						continue;
 					default:
 						printf("[Warning] Unknown injection flags: %d\n", injection_flags);
@@ -1139,14 +1679,18 @@ void ep0_loop(int fd) {
 					}
 				}
 
-				maybe_override_descriptor(&event.ctrl, io);
 				clamp_uvc_probe_commit(&event.ctrl, io);
+				if (uac_jitter_ms > 0)
+					uac_control(device_config_desc[host_device_desc.current_config],
+						    &event.ctrl, (uint8_t *)io.data, io.inner.length);
 
 				// Some UDCs require bMaxPacketSize0 to be at least 64.
 				// Ideally, the information about UDC limitations needs to be
 				// exposed by Raw Gadget, but this is not implemented at the moment;
 				// see https://github.com/xairy/raw-gadget/issues/41.
+				// At SuperSpeed it is an exponent (9 for 512 bytes).
 				if (bmaxpacketsize0_must_greater_than_64 &&
+				    gadget_speed != USB_SPEED_SUPER &&
 				    (event.ctrl.bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD &&
 				    event.ctrl.bRequest == USB_REQ_GET_DESCRIPTOR &&
 				    (event.ctrl.wValue >> 8) == USB_DT_DEVICE) {
@@ -1155,21 +1699,28 @@ void ep0_loop(int fd) {
 						dev->bMaxPacketSize0 = 64;
 				}
 
+				descriptor_response_store(&event.ctrl, io);
+
 				if (verbose_level >= 2)
 					printData(io, 0x00, "control", "in");
 
-				rv = usb_raw_ep0_write(fd, (struct usb_raw_ep_io *)&io);
+				rv = host_backend->ep0_write(fd, (struct usb_raw_ep_io *)&io);
 				if (rv < 0)
 					printf("ep0: ack failed: %d\n", rv);
 				else
 					printf("ep0: transferred %d bytes (in)\n", rv);
 			}
 			else {
-				usb_raw_ep0_stall(fd);
+				host_backend->ep0_stall(fd);
 				continue;
 			}
 		}
 		else {
+			if (!descriptor_cache_wait_device()) {
+				delete[] control_data;
+				continue;
+			}
+
 			if ((event.ctrl.bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD &&
 					event.ctrl.bRequest == USB_REQ_SET_CONFIGURATION) {
 				int desired_config = -1;
@@ -1185,36 +1736,59 @@ void ep0_loop(int fd) {
 				}
 
 				struct raw_gadget_config *config = &host_device_desc.configs[desired_config];
+				descriptor_response_invalidate("configuration change");
 
 				if (set_configuration_done_once) { // Need to stop all threads for eps and cleanup
 					printf("Changing configuration\n");
+					timeline_span span("stop endpoint threads", "proxy");
 					for (int i = 0; i < config->config.bNumInterfaces; i++) {
 						struct raw_gadget_interface *iface = &config->interfaces[i];
 						int interface_num = iface->altsettings[iface->current_altsetting]
 							.interface.bInterfaceNumber;
 						terminate_eps(fd, host_device_desc.current_config, i,
 								iface->current_altsetting);
-						release_interface(interface_num);
+						device_backend->release_interface(interface_num);
 					}
 				}
 
-				usb_raw_configure(fd);
-				set_configuration(config->config.bConfigurationValue);
+				{
+					timeline_span span("usb_raw_configure", "gadget");
+					host_backend->configure(fd);
+				}
+				{
+					timeline_span span("set_configuration", "device");
+					device_backend->set_configuration(config->config.bConfigurationValue);
+				}
 				host_device_desc.current_config = desired_config;
 
 				for (int i = 0; i < config->config.bNumInterfaces; i++) {
 					struct raw_gadget_interface *iface = &config->interfaces[i];
 					iface->current_altsetting = 0;
 					int interface_num = iface->altsettings[0].interface.bInterfaceNumber;
-					claim_interface(interface_num);
-					process_eps(fd, desired_config, i, 0);
-					usleep(10000); // Give threads time to spawn.
+					Json::Value args;
+					if (timeline_enabled())
+						args["interface"] = interface_num;
+					{
+						timeline_span span("claim_interface", "device");
+						span.args = args;
+						device_backend->claim_interface(interface_num);
+					}
+					{
+						timeline_span span("process_eps", "proxy");
+						span.args = args;
+						process_eps(fd, desired_config, i, 0);
+					}
+					{
+						timeline_span span("usleep", "proxy");
+						span.args = args;
+						usleep(10000); // Give threads time to spawn.
+					}
 				}
 
 				set_configuration_done_once = true;
 
 				// Ack request after spawning endpoint threads.
-				rv = usb_raw_ep0_read(fd, (struct usb_raw_ep_io *)&io);
+				rv = host_backend->ep0_read(fd, (struct usb_raw_ep_io *)&io);
 				if (rv < 0)
 					printf("ep0: ack failed: %d\n", rv);
 				else
@@ -1258,12 +1832,13 @@ void ep0_loop(int fd) {
 				if (effective_altsetting < 0) {
 					printf("[Warning] No compatible altsetting for interface %d, stalling\n",
 						iface->altsettings[desired_altsetting].interface.bInterfaceNumber);
-					usb_raw_ep0_stall(fd);
+					host_backend->ep0_stall(fd);
 					continue;
 				}
 
 				if (effective_altsetting != desired_altsetting) {
-					printf("[Warning] Altsetting %d exceeds UDC limit; using %d instead\n",
+					printf("[Warning] Altsetting %d exceeds UDC limits or periodic "
+						"bandwidth; using %d instead\n",
 						iface->altsettings[desired_altsetting].interface.bAlternateSetting,
 						iface->altsettings[effective_altsetting].interface.bAlternateSetting);
 				}
@@ -1273,23 +1848,34 @@ void ep0_loop(int fd) {
 				if (effective_altsetting == iface->current_altsetting) {
 					printf("Interface/altsetting already set\n");
 					// But lets propagate the request to the device.
-					set_interface_alt_setting(alt->interface.bInterfaceNumber,
+					timeline_span span("set_interface_alt_setting", "device");
+					device_backend->set_interface_alt_setting(alt->interface.bInterfaceNumber,
 						alt->interface.bAlternateSetting);
 				}
 				else {
 					printf("Changing interface/altsetting\n");
-					terminate_eps(fd, host_device_desc.current_config,
-						desired_interface, iface->current_altsetting);
-					set_interface_alt_setting(alt->interface.bInterfaceNumber,
-						alt->interface.bAlternateSetting);
-					process_eps(fd, host_device_desc.current_config,
-						desired_interface, effective_altsetting);
+					{
+						timeline_span span("terminate_eps", "proxy");
+						terminate_eps(fd, host_device_desc.current_config,
+							desired_interface, iface->current_altsetting);
+					}
+					{
+						timeline_span span("set_interface_alt_setting", "device");
+						device_backend->set_interface_alt_setting(alt->interface.bInterfaceNumber,
+							alt->interface.bAlternateSetting);
+					}
+					{
+						timeline_span span("process_eps", "proxy");
+						process_eps(fd, host_device_desc.current_config,
+							desired_interface, effective_altsetting);
+					}
 					iface->current_altsetting = effective_altsetting;
+					timeline_span span("usleep", "proxy");
 					usleep(10000); // Give threads time to spawn.
 				}
 
 				// Ack request after spawning endpoint threads.
-				rv = usb_raw_ep0_read(fd, (struct usb_raw_ep_io *)&io);
+				rv = host_backend->ep0_read(fd, (struct usb_raw_ep_io *)&io);
 				if (rv < 0)
 					printf("ep0: ack failed: %d\n", rv);
 				else
@@ -1306,7 +1892,7 @@ void ep0_loop(int fd) {
 						continue;
 					case USB_INJECTION_FLAG_STALL:
 						delete[] control_data;
-						usb_raw_ep0_stall(fd);
+						host_backend->ep0_stall(fd);
 						continue;
 					default:
 						printf("[Warning] Unknown injection flags: %d\n", injection_flags);
@@ -1321,10 +1907,10 @@ void ep0_loop(int fd) {
 					if (verbose_level >= 2)
 						printData(io, 0x00, "control", "out");
 
-					result = control_request(&event.ctrl, &nbytes, &control_data, USB_REQUEST_TIMEOUT);
+					result = timed_control_request(&event.ctrl, &nbytes, &control_data, USB_REQUEST_TIMEOUT);
 					if (result == 0) {
 						// Ack the request.
-						rv = usb_raw_ep0_read(fd, (struct usb_raw_ep_io *)&io);
+						rv = host_backend->ep0_read(fd, (struct usb_raw_ep_io *)&io);
 						if (rv < 0)
 							printf("ep0: ack failed: %d\n", rv);
 						else
@@ -1332,7 +1918,7 @@ void ep0_loop(int fd) {
 					}
 					else {
 						// Stall the request.
-						usb_raw_ep0_stall(fd);
+						host_backend->ep0_stall(fd);
 						continue;
 					}
 				}
@@ -1344,7 +1930,7 @@ void ep0_loop(int fd) {
 
 					// Retrieve data for sending request to proxied device
 					// (and ack the request).
-					rv = usb_raw_ep0_read(fd, (struct usb_raw_ep_io *)&io);
+					rv = host_backend->ep0_read(fd, (struct usb_raw_ep_io *)&io);
 					if (rv < 0) {
 						printf("ep0: ack failed: %d\n", rv);
 						continue;
@@ -1356,9 +1942,12 @@ void ep0_loop(int fd) {
 					clamp_uvc_probe_commit(&event.ctrl, io);
 					memcpy(control_data, io.data, event.ctrl.wLength);
 
-					result = control_request(&event.ctrl, &nbytes, &control_data, USB_REQUEST_TIMEOUT);
+					result = timed_control_request(&event.ctrl, &nbytes, &control_data, USB_REQUEST_TIMEOUT);
 					if (result == 0) {
 						printf("ep0: transferred %d bytes (out)\n", rv);
+						if (uac_jitter_ms > 0)
+							uac_control(device_config_desc[host_device_desc.current_config],
+								    &event.ctrl, (uint8_t *)io.data, rv);
 					}
 				}
 			}
@@ -1366,16 +1955,19 @@ void ep0_loop(int fd) {
 
 		delete[] control_data;
 	}
+	ep0_running = false;
 
+	// Interfaces are only claimed once the host has set a configuration.
 	struct raw_gadget_config *config = &host_device_desc.configs[host_device_desc.current_config];
 
-	for (int i = 0; i < config->config.bNumInterfaces; i++) {
+	for (int i = 0; set_configuration_done_once && i < config->config.bNumInterfaces; i++) {
 		struct raw_gadget_interface *iface = &config->interfaces[i];
 		int interface_num = iface->altsettings[iface->current_altsetting]
 			.interface.bInterfaceNumber;
 		terminate_eps(fd, host_device_desc.current_config, i,
 				iface->current_altsetting);
-		release_interface(interface_num);
+		device_backend->release_interface(interface_num);
+		iface->current_altsetting = 0;
 	}
 
 	printf("End for EP0, thread id(%d)\n", gettid());
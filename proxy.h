@@ -1 +1,10 @@
+// Builds the ep0 lookup tables and rewritten configuration descriptors; call
+// once the endpoints have been remapped.
+void build_remap_tables();
 void ep0_loop(int fd);
+// The physical device's address for a gadget endpoint address of the
+// current configuration; the same address without --auto_remap_endpoints.
+uint16_t remap_endpoint_for_device(uint16_t gadget_ep_addr);
+// Called when the proxied device goes away: makes ep0_loop() stop the
+// endpoint threads and return.
+void stop_ep0_loop_unplugged();
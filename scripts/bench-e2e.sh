@@ -0,0 +1,191 @@
+#!/bin/bash
+# bench-e2e.sh
+# End-to-end benchmark of usb-proxy on the kernel's virtual USB controllers,
+# with no hardware attached.
+#
+# dummy_hcd num=2 gives two UDC/HCD pairs. A configfs Gadget Zero
+# (SourceSink function, the same one g_zero uses) is bound to the first UDC
+# and plays the "physical" device. usb-proxy connects to it through libusb
+# and exposes it on the second UDC, where usbtest binds to the proxied copy
+# and testusb drives bulk, control and isochronous patterns
+# through the proxy.
+#
+# Results are written as JSON (BENCH_OUT, default bench-e2e.json):
+# MB/s, mean wall time per transfer (inverse throughput; queued tests overlap
+# transfers, so it is not a latency), and usb-proxy CPU seconds per GB moved.
+#
+# Requirements: root, dummy_hcd, libcomposite, usb_f_ss_lb and usbtest
+# modules, and testusb (tools/usb/testusb.c in the kernel tree). Set TESTUSB
+# if it is not in $PATH.
+#
+# Tests are "name:testusb test:size:count", overridable with BENCH_TESTS:
+#   BENCH_TESTS="bulk_out:1:16384:2000 bulk_in:2:16384:2000" make bench-e2e
+# SourceSink has no interrupt endpoints, so usbtest's interrupt tests (25, 26)
+# would pass without moving data and are not in the default set.
+
+set -u
+
+[ "$(id -u)" -eq 0 ] || exec sudo -E "$0" "$@"
+
+cd "$(dirname "$0")/.."
+
+PROXY=${PROXY:-./usb-proxy}
+TESTUSB=${TESTUSB:-$(command -v testusb)}
+BENCH_OUT=${BENCH_OUT:-bench-e2e.json}
+BENCH_TESTS=${BENCH_TESTS:-"\
+bulk_out:1:4096:2000 \
+bulk_in:2:4096:2000 \
+bulk_sg_out:5:4096:500 \
+bulk_sg_in:6:4096:500 \
+control:9:0:200 \
+control_queued:10:0:200 \
+iso_out:15:8192:100 \
+iso_in:16:8192:100"}
+
+SGLEN=32
+VID=0525
+PID=a4a0
+GADGET=/sys/kernel/config/usb_gadget/usb_proxy_bench
+PROXY_LOG=$(mktemp /tmp/bench-e2e-proxy.XXXXXX)
+proxy_pid=
+
+die() {
+	echo "bench-e2e: $*" >&2
+	exit 1
+}
+
+cleanup() {
+	[ -n "$proxy_pid" ] && kill -INT "$proxy_pid" 2>/dev/null && wait "$proxy_pid" 2>/dev/null
+	if [ -d "$GADGET" ]; then
+		echo "" > "$GADGET/UDC" 2>/dev/null
+		rm -f "$GADGET/configs/c.1/sourcesink.0"
+		rmdir "$GADGET/configs/c.1/strings/0x409" "$GADGET/configs/c.1" \
+			"$GADGET/functions/SourceSink.0" "$GADGET/strings/0x409" \
+			"$GADGET" 2>/dev/null
+	fi
+	rm -f "$PROXY_LOG"
+}
+trap cleanup EXIT
+
+# Prints /dev/bus/usb/BBB/DDD of the Gadget Zero device behind the given
+# dummy_hcd instance, or nothing.
+find_device() {
+	local dev
+	for dev in /sys/bus/usb/devices/*; do
+		[ -f "$dev/idVendor" ] || continue
+		[ "$(cat "$dev/idVendor")" = "$VID" ] || continue
+		[ "$(cat "$dev/idProduct")" = "$PID" ] || continue
+		case "$(readlink -f "$dev")" in
+		*/"$1"/*)
+			printf "/dev/bus/usb/%03d/%03d\n" "$(cat "$dev/busnum")" "$(cat "$dev/devnum")"
+			return
+			;;
+		esac
+	done
+}
+
+wait_device() {
+	local i dev
+	for i in $(seq 100); do
+		dev=$(find_device "$1")
+		[ -n "$dev" ] && echo "$dev" && return
+		sleep 0.1
+	done
+}
+
+# utime + stime of a process, in clock ticks.
+cpu_ticks() {
+	awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+[ -x "$PROXY" ] || die "$PROXY not built"
+[ -n "$TESTUSB" ] && [ -x "$TESTUSB" ] || die "testusb not found; build tools/usb/testusb.c and set TESTUSB"
+
+modprobe dummy_hcd num=2 || die "cannot load dummy_hcd"
+modprobe libcomposite || die "cannot load libcomposite"
+modprobe usbtest || die "cannot load usbtest"
+[ -d /sys/class/udc/dummy_udc.1 ] || die "dummy_hcd is loaded without num=2; rmmod it first"
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+# The "physical" device: Gadget Zero's source/sink configuration on UDC 0.
+mkdir -p "$GADGET" || die "cannot create $GADGET"
+echo "0x$VID" > "$GADGET/idVendor"
+echo "0x$PID" > "$GADGET/idProduct"
+mkdir -p "$GADGET/strings/0x409"
+echo "usb-proxy" > "$GADGET/strings/0x409/manufacturer"
+echo "bench-e2e source/sink" > "$GADGET/strings/0x409/product"
+mkdir -p "$GADGET/functions/SourceSink.0"
+echo 1 > "$GADGET/functions/SourceSink.0/isoc_interval"
+echo 1024 > "$GADGET/functions/SourceSink.0/isoc_maxpacket"
+mkdir -p "$GADGET/configs/c.1/strings/0x409"
+echo "source/sink" > "$GADGET/configs/c.1/strings/0x409/configuration"
+ln -s "$GADGET/functions/SourceSink.0" "$GADGET/configs/c.1/sourcesink.0"
+echo dummy_udc.0 > "$GADGET/UDC" || die "cannot bind gadget to dummy_udc.0"
+
+[ -n "$(wait_device dummy_hcd.0)" ] || die "source/sink device did not enumerate"
+
+"$PROXY" --device dummy_udc.1 --driver dummy_udc \
+	--vendor_id "$VID" --product_id "$PID" > "$PROXY_LOG" 2>&1 &
+proxy_pid=$!
+
+dev=$(wait_device dummy_hcd.1)
+if [ -z "$dev" ]; then
+	cat "$PROXY_LOG" >&2
+	die "proxied device did not enumerate"
+fi
+echo "Benchmarking usb-proxy (pid $proxy_pid) at $dev"
+
+hz=$(getconf CLK_TCK)
+results=
+for spec in $BENCH_TESTS; do
+	IFS=: read -r name test size count <<< "$spec"
+
+	before=$(cpu_ticks "$proxy_pid") || die "usb-proxy exited"
+	out=$("$TESTUSB" -D "$dev" -t "$test" -s "$size" -c "$count" -g "$SGLEN" -v 0 2>&1)
+	status=$?
+	after=$(cpu_ticks "$proxy_pid") || die "usb-proxy exited"
+
+	# "/dev/bus/usb/002/003 test 1,    0.123456 secs"
+	secs=$(echo "$out" | awk '/ secs$/ { print $(NF - 1) }' | tail -1)
+	if [ $status -ne 0 ] || [ -z "$secs" ]; then
+		echo "  $name: skipped ($(echo "$out" | tail -1))"
+		entry="{ \"name\": \"$name\", \"test\": $test, \"skipped\": true }"
+	else
+		# Scatter-gather and queued tests move sglen buffers per iteration.
+		bufs=1
+		case $test in 5|6|10|15|16) bufs=$SGLEN ;; esac
+		entry=$(awk -v name="$name" -v test="$test" -v size="$size" \
+			-v count="$count" -v bufs="$bufs" -v secs="$secs" \
+			-v cpu="$(( after - before ))" -v hz="$hz" 'BEGIN {
+			transfers = count * bufs
+			bytes = size * transfers
+			cpu_s = cpu / hz
+			printf "{ \"name\": \"%s\", \"test\": %d, \"size\": %d, \"count\": %d, ", name, test, size, count
+			printf "\"bytes\": %d, \"secs\": %.6f, ", bytes, secs
+			printf "\"mb_per_s\": %.3f, ", (secs > 0 ? bytes / secs / 1e6 : 0)
+			# Wall time over transfers: inverse throughput, not latency,
+			# since queued tests keep several transfers in flight.
+			printf "\"mean_us_per_transfer\": %.3f, ", secs * 1e6 / transfers
+			printf "\"proxy_cpu_s\": %.3f, ", cpu_s
+			if (bytes > 0)
+				printf "\"cpu_s_per_gb\": %.3f }", cpu_s / (bytes / 1e9)
+			else
+				printf "\"cpu_s_per_gb\": null }"
+		}')
+		echo "  $entry"
+	fi
+	results="${results:+$results,
+}    $entry"
+done
+
+cat > "$BENCH_OUT" <<EOF
+{
+  "kernel": "$(uname -r)",
+  "revision": "$(git describe --always --dirty 2>/dev/null || echo unknown)",
+  "date": "$(date -u +%Y-%m-%dT%H:%M:%SZ)",
+  "tests": [
+$results
+  ]
+}
+EOF
+echo "Results written to $BENCH_OUT"
@@ -0,0 +1,186 @@
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "device-libusb.h"
+#include "snapshot.h"
+
+typedef std::tuple<uint8_t, uint8_t, uint16_t, uint16_t> snapshot_key;
+
+static bool snapshot_active = false;	// recording control responses
+static std::string snapshot_path;
+static std::mutex snapshot_mutex;
+static std::map<snapshot_key, std::vector<uint8_t>> snapshot_responses;
+
+void snapshot_enable(const std::string &path)
+{
+	snapshot_path = path;
+	snapshot_active = true;
+}
+
+void snapshot_collect()
+{
+	snapshot_active = true;
+}
+
+bool snapshot_enabled()
+{
+	return snapshot_active;
+}
+
+void snapshot_record_control(const struct usb_ctrlrequest *ctrl,
+			     const uint8_t *data, int length)
+{
+	if (!snapshot_active || !(ctrl->bRequestType & USB_DIR_IN) || length <= 0)
+		return;
+
+	snapshot_key key(ctrl->bRequestType, ctrl->bRequest, ctrl->wValue, ctrl->wIndex);
+	std::lock_guard<std::mutex> guard(snapshot_mutex);
+	std::vector<uint8_t> &response = snapshot_responses[key];
+	if ((size_t)length >= response.size())
+		response.assign(data, data + length);
+}
+
+static std::string hex_bytes(const uint8_t *data, int length)
+{
+	std::string hex;
+	char byte[4];
+	for (int i = 0; i < length; i++) {
+		snprintf(byte, sizeof(byte), i ? " %02x" : "%02x", data[i]);
+		hex += byte;
+	}
+	return hex;
+}
+
+static std::string hex_value(unsigned int value, int digits)
+{
+	char buf[16];
+	snprintf(buf, sizeof(buf), "0x%0*x", digits, value);
+	return buf;
+}
+
+static const char *speed_name(int speed)
+{
+	switch (speed) {
+	case LIBUSB_SPEED_LOW:
+		return "low";
+	case LIBUSB_SPEED_FULL:
+		return "full";
+	case LIBUSB_SPEED_SUPER:
+	case LIBUSB_SPEED_SUPER_PLUS:
+		return "super";
+	default:
+		return "high";
+	}
+}
+
+static Json::Value snapshot_endpoint(const struct libusb_endpoint_descriptor *desc)
+{
+	Json::Value json;
+	json["bEndpointAddress"] = hex_value(desc->bEndpointAddress, 2);
+	json["bmAttributes"] = desc->bmAttributes;
+	json["wMaxPacketSize"] = desc->wMaxPacketSize;
+	json["bInterval"] = desc->bInterval;
+	if (desc->extra_length)
+		json["extra"] = hex_bytes(desc->extra, desc->extra_length);
+	return json;
+}
+
+static Json::Value snapshot_altsetting(const struct libusb_interface_descriptor *desc)
+{
+	Json::Value json;
+	json["bInterfaceNumber"] = desc->bInterfaceNumber;
+	json["bAlternateSetting"] = desc->bAlternateSetting;
+	json["bInterfaceClass"] = desc->bInterfaceClass;
+	json["bInterfaceSubClass"] = desc->bInterfaceSubClass;
+	json["bInterfaceProtocol"] = desc->bInterfaceProtocol;
+	json["iInterface"] = desc->iInterface;
+	if (desc->extra_length)
+		json["extra"] = hex_bytes(desc->extra, desc->extra_length);
+	json["endpoints"] = Json::Value(Json::arrayValue);
+	for (int i = 0; i < desc->bNumEndpoints; i++)
+		json["endpoints"].append(snapshot_endpoint(&desc->endpoint[i]));
+	return json;
+}
+
+static Json::Value snapshot_config(const struct libusb_config_descriptor *config)
+{
+	Json::Value json;
+	json["bConfigurationValue"] = config->bConfigurationValue;
+	json["iConfiguration"] = config->iConfiguration;
+	json["bmAttributes"] = hex_value(config->bmAttributes, 2);
+	json["MaxPower"] = config->MaxPower;
+	if (config->extra_length)
+		json["extra"] = hex_bytes(config->extra, config->extra_length);
+	json["interfaces"] = Json::Value(Json::arrayValue);
+	for (int i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+		Json::Value interface;
+		interface["altsettings"] = Json::Value(Json::arrayValue);
+		for (int j = 0; j < iface->num_altsetting; j++)
+			interface["altsettings"].append(snapshot_altsetting(&iface->altsetting[j]));
+		json["interfaces"].append(interface);
+	}
+	return json;
+}
+
+Json::Value snapshot_json(int speed)
+{
+	const struct libusb_device_descriptor *dev = &device_device_desc;
+	Json::Value snapshot;
+	snapshot["speed"] = speed_name(speed);
+
+	Json::Value &device = snapshot["device"];
+	device["bcdUSB"] = hex_value(dev->bcdUSB, 4);
+	device["bDeviceClass"] = dev->bDeviceClass;
+	device["bDeviceSubClass"] = dev->bDeviceSubClass;
+	device["bDeviceProtocol"] = dev->bDeviceProtocol;
+	device["bMaxPacketSize0"] = dev->bMaxPacketSize0;
+	device["idVendor"] = hex_value(dev->idVendor, 4);
+	device["idProduct"] = hex_value(dev->idProduct, 4);
+	device["bcdDevice"] = hex_value(dev->bcdDevice, 4);
+	device["iManufacturer"] = dev->iManufacturer;
+	device["iProduct"] = dev->iProduct;
+	device["iSerialNumber"] = dev->iSerialNumber;
+
+	snapshot["configurations"] = Json::Value(Json::arrayValue);
+	for (int i = 0; i < dev->bNumConfigurations; i++)
+		snapshot["configurations"].append(snapshot_config(device_config_desc[i]));
+
+	snapshot["control"] = Json::Value(Json::arrayValue);
+	std::lock_guard<std::mutex> guard(snapshot_mutex);
+	for (auto &it : snapshot_responses) {
+		Json::Value entry;
+		entry["bRequestType"] = hex_value(std::get<0>(it.first), 2);
+		entry["bRequest"] = hex_value(std::get<1>(it.first), 2);
+		entry["wValue"] = hex_value(std::get<2>(it.first), 4);
+		entry["wIndex"] = hex_value(std::get<3>(it.first), 4);
+		entry["data"] = hex_bytes(it.second.data(), it.second.size());
+		snapshot["control"].append(entry);
+	}
+	return snapshot;
+}
+
+bool snapshot_write_file(const std::string &path, int speed)
+{
+	Json::Value snapshot = snapshot_json(speed);
+	std::ofstream ofs(path.c_str());
+	Json::StreamWriterBuilder builder;
+	builder["indentation"] = "  ";
+	ofs << Json::writeString(builder, snapshot) << std::endl;
+	return (bool)ofs;
+}
+
+void snapshot_write()
+{
+	if (snapshot_path.empty() || !device_config_desc)
+		return;
+
+	if (!snapshot_write_file(snapshot_path, device_backend->get_speed())) {
+		fprintf(stderr, "Error writing snapshot: %s\n", snapshot_path.c_str());
+		return;
+	}
+	printf("Device snapshot (%zu control responses) written to %s\n",
+		snapshot_responses.size(), snapshot_path.c_str());
+}
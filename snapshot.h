@@ -0,0 +1,29 @@
+#ifndef USB_PROXY_SNAPSHOT_H
+#define USB_PROXY_SNAPSHOT_H
+
+#include <string>
+#include <stdint.h>
+#include <linux/usb/ch9.h>
+#include <jsoncpp/json/json.h>
+
+// Device snapshots (--snapshot FILE): the device's descriptor tree plus every
+// control IN response seen while proxying (strings, BOS, HID report
+// descriptors, class and vendor requests), written in the --emulate_device
+// format so that --clone FILE can serve the device without the hardware.
+
+void snapshot_enable(const std::string &path);
+// Records control responses without writing a snapshot at exit; the
+// descriptor cache saves them itself.
+void snapshot_collect();
+bool snapshot_enabled();
+// Records the device's response to a control IN request; for each request
+// the longest response seen is kept.
+void snapshot_record_control(const struct usb_ctrlrequest *ctrl,
+			const uint8_t *data, int length);
+// Renders the current descriptor tree and recorded responses; speed is a
+// libusb_speed value.
+Json::Value snapshot_json(int speed);
+bool snapshot_write_file(const std::string &path, int speed);
+void snapshot_write();
+
+#endif // USB_PROXY_SNAPSHOT_H
@@ -0,0 +1,225 @@
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <vector>
+
+#include "stats.h"
+#include "misc.h"
+
+/*----------------------------------------------------------------------*/
+
+static int latency_bucket_index(uint64_t ns)
+{
+	if (ns < LATENCY_SUB_BUCKETS)
+		return (int)ns;
+	if (ns >> LATENCY_MAX_BITS)
+		ns = (1ull << LATENCY_MAX_BITS) - 1;
+
+	int msb = 63 - __builtin_clzll(ns);
+	int shift = msb - LATENCY_SUB_BUCKET_BITS;
+	return (shift + 1) * LATENCY_SUB_BUCKETS +
+		(int)((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+static uint64_t latency_bucket_value(int index)
+{
+	if (index < LATENCY_SUB_BUCKETS)
+		return index;
+
+	int shift = index / LATENCY_SUB_BUCKETS - 1;
+	uint64_t sub = index % LATENCY_SUB_BUCKETS;
+	return (LATENCY_SUB_BUCKETS + sub) << shift;
+}
+
+void latency_histogram_record(struct latency_histogram *hist, uint64_t ns)
+{
+	hist->counts[latency_bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+	hist->total_count.fetch_add(1, std::memory_order_relaxed);
+	hist->total_ns.fetch_add(ns, std::memory_order_relaxed);
+
+	uint64_t max = hist->max_ns.load(std::memory_order_relaxed);
+	while (ns > max &&
+	       !hist->max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+		;
+}
+
+uint64_t latency_histogram_percentile(const struct latency_histogram *hist,
+			double percentile)
+{
+	uint64_t total = hist->total_count.load(std::memory_order_relaxed);
+	if (!total)
+		return 0;
+
+	uint64_t rank = (uint64_t)(total * percentile / 100.0);
+	if (rank >= total)
+		rank = total - 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += hist->counts[i].load(std::memory_order_relaxed);
+		if (seen > rank)
+			return latency_bucket_value(i);
+	}
+	return hist->max_ns.load(std::memory_order_relaxed);
+}
+
+/*----------------------------------------------------------------------*/
+
+static std::mutex			ep_stats_mutex;
+static std::map<uint8_t, struct ep_stats *>	ep_stats_registry;
+
+struct ep_stats *ep_stats_get(uint8_t device_bEndpointAddress,
+			const std::string &transfer_type)
+{
+	std::lock_guard<std::mutex> guard(ep_stats_mutex);
+	auto it = ep_stats_registry.find(device_bEndpointAddress);
+	if (it != ep_stats_registry.end())
+		return it->second;
+
+	struct ep_stats *stats = new struct ep_stats();
+	stats->device_bEndpointAddress = device_bEndpointAddress;
+	stats->transfer_type = transfer_type;
+	stats->reader_clock = -1;
+	stats->writer_clock = -1;
+	ep_stats_registry[device_bEndpointAddress] = stats;
+	return stats;
+}
+
+std::vector<struct ep_stats *> ep_stats_list()
+{
+	std::lock_guard<std::mutex> guard(ep_stats_mutex);
+	std::vector<struct ep_stats *> list;
+	for (auto &entry : ep_stats_registry)
+		list.push_back(entry.second);
+	return list;
+}
+
+void ep_stats_record(struct ep_stats *stats,
+			const struct transfer_stamps *stamps, uint64_t sink_ns,
+			uint32_t length)
+{
+	if (!stats || !stamps->source_ns)
+		return;
+
+	stats->sink_bytes += length;
+
+	latency_histogram_record(&stats->stages[LATENCY_STAGE_INJECT],
+		stamps->injected_ns - stamps->source_ns);
+	latency_histogram_record(&stats->stages[LATENCY_STAGE_ENQUEUE],
+		stamps->enqueued_ns - stamps->injected_ns);
+	latency_histogram_record(&stats->stages[LATENCY_STAGE_QUEUE],
+		stamps->dequeued_ns - stamps->enqueued_ns);
+	latency_histogram_record(&stats->stages[LATENCY_STAGE_SINK],
+		sink_ns - stamps->dequeued_ns);
+	latency_histogram_record(&stats->stages[LATENCY_STAGE_TOTAL],
+		sink_ns - stamps->source_ns);
+}
+
+void ep_stats_set_thread(struct ep_stats *stats, bool reader, bool running)
+{
+	if (!stats)
+		return;
+
+	clockid_t clock = -1;
+	if (running && pthread_getcpuclockid(pthread_self(), &clock) != 0)
+		clock = -1;
+	if (reader)
+		stats->reader_clock = clock;
+	else
+		stats->writer_clock = clock;
+}
+
+static const char *latency_stage_name(int stage)
+{
+	switch (stage) {
+	case LATENCY_STAGE_INJECT:
+		return "inject";
+	case LATENCY_STAGE_ENQUEUE:
+		return "enqueue";
+	case LATENCY_STAGE_QUEUE:
+		return "queue";
+	case LATENCY_STAGE_SINK:
+		return "sink";
+	case LATENCY_STAGE_TOTAL:
+		return "total";
+	default:
+		return "unknown";
+	}
+}
+
+static void print_uvc_stats(struct ep_stats *stats)
+{
+	uint64_t frames = stats->uvc_frames;
+	double secs = (stats->uvc_last_frame_ns - stats->uvc_first_frame_ns) / 1e9;
+	printf("    video    %lu frames", (unsigned long)frames);
+	if (frames > 1 && secs > 0)
+		printf(", %.1f fps", (frames - 1) / secs);
+	if (frames)
+		printf(", mean frame %lu bytes",
+			(unsigned long)(stats->uvc_frame_bytes / frames));
+	printf(", %lu dropped\n", (unsigned long)stats->uvc_frames_dropped);
+}
+
+void print_ep_stats()
+{
+	std::lock_guard<std::mutex> guard(ep_stats_mutex);
+	if (ep_stats_registry.empty())
+		return;
+
+	printf("Per-endpoint latency (us):\n");
+	for (auto &entry : ep_stats_registry) {
+		struct ep_stats *stats = entry.second;
+		uint64_t packets = stats->stages[LATENCY_STAGE_TOTAL].total_count;
+		printf("  EP%02x(%s_%s): %lu packets\n",
+			stats->device_bEndpointAddress, stats->transfer_type.c_str(),
+			(stats->device_bEndpointAddress & USB_DIR_IN) ? "in" : "out",
+			(unsigned long)packets);
+		if (stats->uvc_frames || stats->uvc_frames_dropped)
+			print_uvc_stats(stats);
+		if (stats->uac_rate)
+			printf("    audio    %u Hz, %lu underruns, %lu overruns\n",
+				stats->uac_rate.load(), (unsigned long)stats->uac_underruns,
+				(unsigned long)stats->uac_overruns);
+		if (stats->playout_target)
+			printf("    playout  target %d packets, %lu zero-length inserted, %lu dropped, %lu underruns\n",
+				stats->playout_target.load(), (unsigned long)stats->playout_zlps,
+				(unsigned long)stats->playout_drops,
+				(unsigned long)stats->playout_underruns);
+		if (!packets)
+			continue;
+
+		for (int i = 0; i < LATENCY_STAGE_NUM; i++) {
+			struct latency_histogram *hist = &stats->stages[i];
+			printf("    %-8s p50 %9.1f  p90 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f  mean %9.1f\n",
+				latency_stage_name(i),
+				latency_histogram_percentile(hist, 50) / 1000.0,
+				latency_histogram_percentile(hist, 90) / 1000.0,
+				latency_histogram_percentile(hist, 99) / 1000.0,
+				latency_histogram_percentile(hist, 99.9) / 1000.0,
+				hist->max_ns / 1000.0,
+				(double)hist->total_ns / hist->total_count / 1000.0);
+		}
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+static std::map<std::string, std::vector<struct injection_rule_stats *>>
+					injection_rule_stats_registry;
+
+void injection_rule_stats_init(const std::string &section, unsigned int count)
+{
+	std::vector<struct injection_rule_stats *> &rules =
+		injection_rule_stats_registry[section];
+	while (rules.size() < count)
+		rules.push_back(new struct injection_rule_stats());
+}
+
+struct injection_rule_stats *injection_rule_stats_get(const std::string &section,
+			unsigned int index)
+{
+	auto it = injection_rule_stats_registry.find(section);
+	if (it == injection_rule_stats_registry.end() || index >= it->second.size())
+		return NULL;
+	return it->second[index];
+}
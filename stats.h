@@ -0,0 +1,156 @@
+#ifndef USB_PROXY_STATS_H
+#define USB_PROXY_STATS_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+/*----------------------------------------------------------------------*/
+
+// Log-linear (HDR-style) histogram: values below 2^LATENCY_SUB_BUCKET_BITS
+// are counted exactly, larger values land in one of 2^LATENCY_SUB_BUCKET_BITS
+// sub-buckets per power of two, i.e. ~3% relative precision.
+#define LATENCY_SUB_BUCKET_BITS	5
+#define LATENCY_SUB_BUCKETS	(1 << LATENCY_SUB_BUCKET_BITS)
+// Values are nanoseconds; anything above 2^40 ns (~18 minutes) is clamped.
+#define LATENCY_MAX_BITS	40
+#define LATENCY_BUCKETS \
+	((LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+struct latency_histogram {
+	std::atomic<uint64_t>	counts[LATENCY_BUCKETS];
+	std::atomic<uint64_t>	total_count;
+	std::atomic<uint64_t>	total_ns;
+	std::atomic<uint64_t>	max_ns;
+};
+
+void latency_histogram_record(struct latency_histogram *hist, uint64_t ns);
+uint64_t latency_histogram_percentile(const struct latency_histogram *hist,
+			double percentile);
+
+/*----------------------------------------------------------------------*/
+
+// Per-packet timestamps carried alongside a transfer through the endpoint
+// queue. "source" is where the packet entered the proxy: libusb completion
+// for IN endpoints, usb_raw_ep_read() return for OUT endpoints.
+struct transfer_stamps {
+	uint64_t	source_ns;
+	uint64_t	injected_ns;
+	uint64_t	enqueued_ns;
+	uint64_t	dequeued_ns;
+};
+
+enum latency_stage {
+	LATENCY_STAGE_INJECT,	// source -> injection done
+	LATENCY_STAGE_ENQUEUE,	// injection done -> pushed to queue
+	LATENCY_STAGE_QUEUE,	// pushed to queue -> popped by writer
+	LATENCY_STAGE_SINK,	// popped -> gadget write / libusb completion
+	LATENCY_STAGE_TOTAL,	// source -> sink completion
+	LATENCY_STAGE_NUM,
+};
+
+// Transfers an IN endpoint queues for the host before the reader backs off
+// (see ep_loop_read()).
+#define EP_QUEUE_LIMIT		32
+
+struct ep_stats {
+	uint8_t			device_bEndpointAddress;
+	std::string		transfer_type;
+	uint8_t			bInterval;	// host-side (HS units), set by process_eps()
+	struct latency_histogram	stages[LATENCY_STAGE_NUM];
+
+	// Throughput and back-pressure counters, sampled by the diagnose monitor.
+	std::atomic<uint64_t>	source_packets;		// pushed to the queue
+	std::atomic<uint64_t>	source_bytes;
+	std::atomic<uint64_t>	sink_bytes;		// packets: stages[TOTAL].total_count
+	std::atomic<uint64_t>	drops;			// lost inside the proxy or by the sink
+	std::atomic<uint64_t>	queue_full_waits;	// reader backed off, queue full
+	std::atomic<uint64_t>	queue_depth_sum;	// depth after each push
+	std::atomic<uint64_t>	inject_ns;		// time spent in injection()
+	std::atomic<uint64_t>	iso_batches;
+	std::atomic<uint64_t>	iso_packets;		// service intervals polled
+	std::atomic<uint64_t>	iso_packet_errors;
+
+	// UVC video streams: frames forwarded complete and frames dropped.
+	std::atomic<uint64_t>	uvc_frames;
+	std::atomic<uint64_t>	uvc_frame_bytes;
+	std::atomic<uint64_t>	uvc_frames_dropped;
+	std::atomic<uint64_t>	uvc_first_frame_ns;
+	std::atomic<uint64_t>	uvc_last_frame_ns;
+
+	// UAC playback through the jitter buffer (--uac_jitter_ms).
+	std::atomic<uint32_t>	uac_rate;
+	std::atomic<uint64_t>	uac_underruns;		// packets padded with silence
+	std::atomic<uint64_t>	uac_overruns;		// times the oldest frames were dropped
+	// ISO IN playout buffer (--iso_in_latency).
+	std::atomic<int>	playout_target;		// current target depth, packets
+	std::atomic<uint64_t>	playout_zlps;		// zero-length packets inserted
+	std::atomic<uint64_t>	playout_drops;		// oldest packets dropped
+	std::atomic<uint64_t>	playout_underruns;
+	// ISO OUT transfers submitted to the device and not yet completed.
+	std::atomic<int>	iso_out_in_flight;
+
+	// CPU-time clocks of the endpoint threads, -1 while not running.
+	std::atomic<int>	reader_clock;
+	std::atomic<int>	writer_clock;
+};
+
+// Monotonic raw clock in nanoseconds; served from the vDSO on Linux so it is
+// cheap enough to call once per pipeline stage.
+static inline uint64_t stats_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Returns the statistics block for a physical device endpoint, creating it
+// on first use. Blocks live for the whole process so that they survive
+// altsetting changes and can be printed at exit.
+struct ep_stats *ep_stats_get(uint8_t device_bEndpointAddress,
+			const std::string &transfer_type);
+void ep_stats_record(struct ep_stats *stats,
+			const struct transfer_stamps *stamps, uint64_t sink_ns,
+			uint32_t length);
+void print_ep_stats();
+// All statistics blocks created so far, ordered by endpoint address.
+std::vector<struct ep_stats *> ep_stats_list();
+
+static inline void ep_stats_enqueued(struct ep_stats *stats, uint32_t length,
+			size_t depth)
+{
+	if (!stats)
+		return;
+	stats->source_packets++;
+	stats->source_bytes += length;
+	stats->queue_depth_sum += depth;
+}
+
+// Publishes (or with running == false, retracts) the calling thread's
+// CPU-time clock for the reader or writer role of an endpoint.
+void ep_stats_set_thread(struct ep_stats *stats, bool reader, bool running);
+
+/*----------------------------------------------------------------------*/
+
+// Per-rule injection counters. A rule is identified by its section in the
+// injection file ("int", "bulk", "isoc", "control/modify", ...) and its index
+// within that section. Blocks are allocated by injection_rule_stats_init()
+// before any endpoint thread runs, so lookups afterwards need no lock.
+struct injection_rule_stats {
+	std::atomic<uint64_t>	evaluated;	// packets the rule was checked against
+	std::atomic<uint64_t>	matched;	// packets the rule applied to
+	std::atomic<uint64_t>	modified;	// packets a pipeline step rewrote
+	std::atomic<uint64_t>	bytes_added;
+	std::atomic<uint64_t>	bytes_removed;
+	std::atomic<uint64_t>	pattern_ns;	// pattern+replace step
+	std::atomic<uint64_t>	operations_ns;	// declarative operations step
+	std::atomic<uint64_t>	lua_ns;		// Lua transform(), excluding lock wait
+};
+
+void injection_rule_stats_init(const std::string &section, unsigned int count);
+struct injection_rule_stats *injection_rule_stats_get(const std::string &section,
+			unsigned int index);
+
+#endif // USB_PROXY_STATS_H
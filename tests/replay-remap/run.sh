@@ -0,0 +1,25 @@
+#!/bin/bash
+# Trace replay with --auto_remap_endpoints: the device's EP05/EP86 become
+# gadget EP01/EP82, while the trace is recorded under the device's
+# addresses. Replay must still find the OUT stream, and --replay_verify
+# must check every IN packet.
+
+cd "$(dirname "$0")"
+
+trace=$(mktemp)
+trap 'rm -f "$trace"' EXIT
+
+# The recording run checks the loopback through the remapped endpoints.
+out=$("$PROXY" --emulate_device device.json --emulate_host host.json \
+	--auto_remap_endpoints --record_trace "$trace" 2>&1)
+if ! grep -Eaq "EP82\(in\): [1-9][0-9]* packets, .* 0 gaps, latency" <<< "$out"; then
+	echo "$out" | grep -a "^  EP..(\(in\|out\)):"
+	exit 1
+fi
+out=$("$PROXY" --emulate_device device.json --emulate_host <(echo '{}') \
+	--auto_remap_endpoints --replay_trace "$trace" --replay_verify 2>&1)
+if [ "$(grep -ac "mismatched 0, missing 0, extra 0" <<< "$out")" -ne 2 ] ||
+   grep -aq "verified 0," <<< "$out"; then
+	echo "$out" | grep -a -A1 "replayed"
+	exit 1
+fi
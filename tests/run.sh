@@ -0,0 +1,21 @@
+#!/bin/bash
+# run.sh
+# Regression tests on the emulated device and host (--emulate_device,
+# --emulate_host); no hardware or root needed. Each directory holds a run.sh
+# that exits non-zero on failure. PROXY is the binary under test.
+
+cd "$(dirname "$0")"
+
+export PROXY=${PROXY:-$(realpath ../usb-proxy)}
+
+failed=0
+for test in */run.sh; do
+	name=$(dirname "$test")
+	if timeout 60 "./$test"; then
+		echo "PASS $name"
+	else
+		echo "FAIL $name"
+		failed=1
+	fi
+done
+exit $failed
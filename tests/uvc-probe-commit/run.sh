@@ -0,0 +1,15 @@
+#!/bin/bash
+# uvcvideo's negotiation with --uvc_repacketize: GET_CUR(PROBE) returns the
+# device's 3072-byte dwMaxPayloadTransferSize (clamped to the emulated UDC's
+# 1024 for the host), SET_CUR(COMMIT) sends the clamped value back, then the
+# host selects the 1024-byte altsetting. The device must still be switched
+# to the altsetting that carries its 3072-byte payloads.
+
+cd "$(dirname "$0")"
+
+out=$("$PROXY" --emulate_device device.json --emulate_host host.json \
+	--auto_remap_endpoints --uvc_repacketize 2>&1)
+if ! grep -aq "UVC: interface 1 uses device altsetting 2 for 3072-byte payloads" <<< "$out"; then
+	echo "$out" | grep -a "UVC\|Warning"
+	exit 1
+fi
@@ -0,0 +1,96 @@
+#include <mutex>
+#include <vector>
+
+#include "timeline.h"
+#include "stats.h"
+#include "misc.h"
+
+static bool			timeline_active = false;
+static std::string		timeline_path;
+static uint64_t			timeline_origin_ns;
+static std::mutex		timeline_mutex;
+static Json::Value		timeline_events(Json::arrayValue);
+
+void timeline_enable(const std::string &path)
+{
+	timeline_path = path;
+	timeline_origin_ns = stats_now_ns();
+	timeline_active = true;
+}
+
+bool timeline_enabled()
+{
+	return timeline_active;
+}
+
+static void timeline_add(Json::Value &event, uint64_t start_ns)
+{
+	event["ts"] = (double)(start_ns - timeline_origin_ns) / 1000.0;
+	event["pid"] = getpid();
+	event["tid"] = gettid();
+
+	std::lock_guard<std::mutex> guard(timeline_mutex);
+	timeline_events.append(event);
+}
+
+void timeline_instant(const std::string &name, const char *category,
+			const Json::Value &args)
+{
+	if (!timeline_active)
+		return;
+
+	Json::Value event;
+	event["name"] = name;
+	event["cat"] = category;
+	event["ph"] = "i";
+	event["s"] = "g";
+	if (!args.isNull())
+		event["args"] = args;
+	timeline_add(event, stats_now_ns());
+}
+
+timeline_span::timeline_span(const std::string &name, const char *category)
+	: name(name), category(category), start_ns(0)
+{
+	if (timeline_active)
+		start_ns = stats_now_ns();
+}
+
+timeline_span::~timeline_span()
+{
+	if (!timeline_active || !start_ns)
+		return;
+
+	Json::Value event;
+	event["name"] = name;
+	event["cat"] = category;
+	event["ph"] = "X";
+	event["dur"] = (double)(stats_now_ns() - start_ns) / 1000.0;
+	if (!args.isNull())
+		event["args"] = args;
+	timeline_add(event, start_ns);
+}
+
+void timeline_write()
+{
+	if (!timeline_active)
+		return;
+
+	Json::Value root;
+	{
+		std::lock_guard<std::mutex> guard(timeline_mutex);
+		root["traceEvents"] = timeline_events;
+	}
+	root["displayTimeUnit"] = "ms";
+
+	std::ofstream ofs(timeline_path.c_str());
+	if (!ofs) {
+		printf("Failed to write enumeration timeline to %s\n", timeline_path.c_str());
+		return;
+	}
+	Json::StreamWriterBuilder builder;
+	builder["indentation"] = "";
+	ofs << Json::writeString(builder, root) << "\n";
+	printf("Enumeration timeline written to %s (%u events)\n",
+		timeline_path.c_str(), root["traceEvents"].size());
+}
@@ -0,0 +1,30 @@
+#ifndef USB_PROXY_TIMELINE_H
+#define USB_PROXY_TIMELINE_H
+
+#include <string>
+#include <jsoncpp/json/json.h>
+
+// Enumeration timeline: records what ep0_loop() spends its time on and writes
+// it as a Chrome trace-event JSON file (load it in chrome://tracing or
+// https://ui.perfetto.dev). Recording is a no-op unless timeline_enable() was
+// called.
+
+void timeline_enable(const std::string &path);
+bool timeline_enabled();
+void timeline_instant(const std::string &name, const char *category,
+			const Json::Value &args = Json::Value());
+void timeline_write();
+
+// Records a complete ("X") event covering the lifetime of the object.
+// Extra details can be attached through args before the span ends.
+struct timeline_span {
+	timeline_span(const std::string &name, const char *category);
+	~timeline_span();
+
+	std::string	name;
+	const char	*category;
+	uint64_t	start_ns;
+	Json::Value	args;
+};
+
+#endif // USB_PROXY_TIMELINE_H
@@ -0,0 +1,247 @@
+#include <map>
+#include <mutex>
+
+#include <errno.h>
+
+#include "trace.h"
+#include "stats.h"
+#include "misc.h"
+
+#define TRACE_WRITE_BUFFER	(1 << 20)
+// How far a sink may run ahead of the trace (dropped packets) before a
+// mismatch is counted instead of a resynchronisation.
+#define TRACE_VERIFY_WINDOW	64
+// Sinks are considered drained after this long without a packet.
+#define TRACE_QUIET_NS		500000000ull
+
+static FILE *trace_file;
+static std::mutex trace_file_mutex;
+static uint64_t trace_origin_ns;
+
+void trace_record_open(const std::string &path)
+{
+	trace_file = fopen(path.c_str(), "wb");
+	if (!trace_file) {
+		perror("fopen() trace");
+		exit(EXIT_FAILURE);
+	}
+	setvbuf(trace_file, NULL, _IOFBF, TRACE_WRITE_BUFFER);
+
+	struct trace_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	fwrite(&header, sizeof(header), 1, trace_file);
+}
+
+bool trace_recording()
+{
+	return trace_file != NULL;
+}
+
+void trace_record(uint8_t ep_address, uint8_t attributes, const void *data,
+		  uint32_t length, uint64_t source_ns)
+{
+	std::lock_guard<std::mutex> guard(trace_file_mutex);
+	if (!trace_file)
+		return;
+	if (!trace_origin_ns)
+		trace_origin_ns = source_ns;
+
+	struct trace_record_header record;
+	record.ts_ns = source_ns > trace_origin_ns ? source_ns - trace_origin_ns : 0;
+	record.length = length;
+	record.ep_address = ep_address;
+	record.attributes = attributes;
+	record.reserved = 0;
+	fwrite(&record, sizeof(record), 1, trace_file);
+	fwrite(data, 1, length, trace_file);
+}
+
+void trace_record_close()
+{
+	std::lock_guard<std::mutex> guard(trace_file_mutex);
+	if (!trace_file)
+		return;
+	if (fclose(trace_file) != 0)
+		perror("fclose() trace");
+	trace_file = NULL;
+}
+
+/*----------------------------------------------------------------------*/
+
+static std::vector<uint8_t> replay_data;
+static std::map<uint8_t, struct trace_stream *> replay_streams;
+static bool replay_active = false;
+static bool replay_fast = false;
+static bool replay_verify = false;
+static std::atomic<uint64_t> replay_start_ns;
+static std::atomic<uint64_t> replay_activity_ns;
+
+void trace_replay_load(const std::string &path, bool fast, bool verify)
+{
+	std::ifstream ifs(path.c_str(), std::ios::binary);
+	replay_data.assign(std::istreambuf_iterator<char>(ifs),
+			   std::istreambuf_iterator<char>());
+
+	struct trace_file_header header;
+	if (!ifs || replay_data.size() < sizeof(header) ||
+	    memcmp(replay_data.data(), TRACE_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "Error reading trace file: %s\n", path.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	size_t offset = sizeof(header), packets = 0;
+	while (offset + sizeof(struct trace_record_header) <= replay_data.size()) {
+		struct trace_record_header record;
+		memcpy(&record, &replay_data[offset], sizeof(record));
+		offset += sizeof(record);
+		if (offset + record.length > replay_data.size())
+			break;	// truncated by an unclean exit
+
+		struct trace_stream *&stream = replay_streams[record.ep_address];
+		if (!stream) {
+			stream = new struct trace_stream();
+			stream->ep_address = record.ep_address;
+			stream->attributes = record.attributes;
+		}
+		stream->packets.push_back({ record.ts_ns, offset, record.length });
+		offset += record.length;
+		packets++;
+	}
+
+	replay_active = true;
+	replay_fast = fast;
+	replay_verify = verify;
+	printf("Replaying %zu packets on %zu endpoints from %s (%s%s)\n",
+		packets, replay_streams.size(), path.c_str(),
+		fast ? "as fast as possible" : "in real time",
+		verify ? ", verifying sinks" : "");
+}
+
+bool trace_replaying()
+{
+	return replay_active;
+}
+
+bool trace_replay_verifying()
+{
+	return replay_verify;
+}
+
+struct trace_stream *trace_replay_stream(uint8_t ep_address)
+{
+	auto it = replay_streams.find(ep_address);
+	return it != replay_streams.end() ? it->second : NULL;
+}
+
+int trace_replay_next(struct trace_stream *stream, uint8_t *data, int max_length)
+{
+	size_t index = stream->next;
+	if (index >= stream->packets.size()) {
+		errno = ENODATA;
+		return -1;
+	}
+	const struct trace_packet &packet = stream->packets[index];
+
+	// All streams share one start time so their relative timing holds.
+	uint64_t zero = 0;
+	replay_start_ns.compare_exchange_strong(zero, stats_now_ns());
+
+	if (!replay_fast) {
+		uint64_t due_ns = replay_start_ns + packet.ts_ns;
+		uint64_t now = stats_now_ns();
+		if (due_ns > now) {
+			struct timespec ts;
+			ts.tv_sec = (due_ns - now) / 1000000000ull;
+			ts.tv_nsec = (due_ns - now) % 1000000000ull;
+			if (nanosleep(&ts, NULL) != 0) {
+				errno = EINTR;
+				return -1;
+			}
+		}
+	}
+
+	int length = std::min<int>(packet.length, max_length);
+	memcpy(data, &replay_data[packet.offset], length);
+	stream->next = index + 1;
+
+	uint64_t now = stats_now_ns();
+	zero = 0;
+	stream->first_ns.compare_exchange_strong(zero, now);
+	stream->last_ns = now;
+	stream->replayed_bytes += length;
+	replay_activity_ns = now;
+	return length;
+}
+
+void trace_replay_verify(struct trace_stream *stream, const uint8_t *data, int length)
+{
+	replay_activity_ns = stats_now_ns();
+
+	size_t index = stream->verify_next;
+	size_t end = std::min(stream->packets.size(), index + TRACE_VERIFY_WINDOW);
+	for (size_t i = index; i < end; i++) {
+		const struct trace_packet &packet = stream->packets[i];
+		if ((int)packet.length != length ||
+		    memcmp(&replay_data[packet.offset], data, length) != 0)
+			continue;
+		stream->missing += i - index;
+		stream->verified++;
+		stream->verify_next = i + 1;
+		return;
+	}
+
+	if (index >= stream->packets.size()) {
+		stream->extra++;
+		return;
+	}
+	stream->mismatched++;
+	stream->verify_next = index + 1;
+}
+
+void trace_replay_wait(int timeout_ms, const bool *stop)
+{
+	uint64_t deadline_ns = stats_now_ns() + (uint64_t)timeout_ms * 1000000;
+
+	while (!*stop) {
+		uint64_t now = stats_now_ns();
+		if (timeout_ms && now >= deadline_ns)
+			return;
+
+		bool replayed = true;
+		for (auto &it : replay_streams)
+			if (it.second->next < it.second->packets.size())
+				replayed = false;
+		if (replayed && now - replay_activity_ns > TRACE_QUIET_NS)
+			return;
+		usleep(10000);
+	}
+}
+
+void print_trace_replay_stats()
+{
+	if (!replay_active)
+		return;
+
+	printf("Trace replay:\n");
+	for (auto &it : replay_streams) {
+		struct trace_stream *stream = it.second;
+		double secs = (stream->last_ns - stream->first_ns) / 1e9;
+		printf("  EP%02x: %zu/%zu packets replayed, %lu bytes",
+			stream->ep_address, (size_t)stream->next, stream->packets.size(),
+			(unsigned long)stream->replayed_bytes);
+		if (secs > 0)
+			printf(", %.0f packets/s, %.2f MB/s", stream->next / secs,
+				stream->replayed_bytes / secs / 1e6);
+		printf("\n");
+		if (replay_verify) {
+			// Packets the sink had not reached by exit count as missing.
+			uint64_t missing = stream->missing +
+				(stream->packets.size() - stream->verify_next);
+			printf("        verified %lu, mismatched %lu, missing %lu, extra %lu\n",
+				(unsigned long)stream->verified,
+				(unsigned long)stream->mismatched,
+				(unsigned long)missing, (unsigned long)stream->extra);
+		}
+	}
+}
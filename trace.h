@@ -0,0 +1,85 @@
+#ifndef USB_PROXY_TRACE_H
+#define USB_PROXY_TRACE_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Traffic traces: --record_trace writes every data packet as it enters the
+// proxy (before injection), --replay_trace feeds a recorded trace back
+// through the emulated device (IN endpoints) and emulated host (OUT
+// endpoints), so the real queue, injection and writer pipeline runs on a
+// captured workload. Control transfers are not part of a trace; the emulated
+// device answers them from its descriptors.
+//
+// File layout: struct trace_file_header, then one struct trace_record_header
+// per packet followed by its data. Fields are in host byte order.
+
+#define TRACE_MAGIC	"USBPTRC1"
+
+struct trace_file_header {
+	char		magic[8];
+	uint64_t	reserved;
+};
+
+struct trace_record_header {
+	uint64_t	ts_ns;		// since the first recorded packet
+	uint32_t	length;
+	uint8_t		ep_address;	// device endpoint address
+	uint8_t		attributes;	// bmAttributes
+	uint16_t	reserved;
+};
+
+void trace_record_open(const std::string &path);
+bool trace_recording();
+void trace_record(uint8_t ep_address, uint8_t attributes, const void *data,
+			uint32_t length, uint64_t source_ns);
+void trace_record_close();
+
+/*----------------------------------------------------------------------*/
+
+struct trace_packet {
+	uint64_t	ts_ns;
+	size_t		offset;		// of the data in the loaded trace
+	uint32_t	length;
+};
+
+// Packets of one endpoint. The source cursor is advanced by the thread that
+// replays the endpoint, the verify cursor by the thread that sinks it.
+struct trace_stream {
+	uint8_t			ep_address;
+	uint8_t			attributes;
+	std::vector<struct trace_packet>	packets;
+	std::atomic<size_t>	next;
+	std::atomic<size_t>	verify_next;
+
+	std::atomic<uint64_t>	replayed_bytes;
+	std::atomic<uint64_t>	first_ns;
+	std::atomic<uint64_t>	last_ns;
+	std::atomic<uint64_t>	verified;	// sink packets equal to the trace
+	std::atomic<uint64_t>	mismatched;	// sink packets that differ
+	std::atomic<uint64_t>	missing;	// trace packets the sink never got
+	std::atomic<uint64_t>	extra;		// sink packets past the end
+};
+
+// Loads the whole trace into memory. fast replays without preserving the
+// recorded inter-packet timing; verify makes the emulated sinks compare what
+// they receive against the trace instead of discarding it.
+void trace_replay_load(const std::string &path, bool fast, bool verify);
+bool trace_replaying();
+bool trace_replay_verifying();
+struct trace_stream *trace_replay_stream(uint8_t ep_address);
+
+// Copies the stream's next packet into data, waiting for its recorded time
+// unless replaying fast. Returns its length, or -1 with errno ENODATA when
+// the stream is exhausted or EINTR when the wait was interrupted.
+int trace_replay_next(struct trace_stream *stream, uint8_t *data, int max_length);
+// Compares a packet arriving at a sink with the next one expected.
+void trace_replay_verify(struct trace_stream *stream, const uint8_t *data, int length);
+// Waits until every stream is replayed and the sinks have gone quiet, or
+// timeout_ms passes (0: no limit), or *stop becomes true.
+void trace_replay_wait(int timeout_ms, const bool *stop);
+void print_trace_replay_stats();
+
+#endif // USB_PROXY_TRACE_H
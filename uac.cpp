@@ -0,0 +1,256 @@
+#include <algorithm>
+
+#include "device-libusb.h"
+#include "uac.h"
+
+// Audio class codes and descriptor subtypes (UAC 1.0 / 2.0)
+#define UAC_SUBCLASS_AUDIOCONTROL	0x01
+#define UAC_SUBCLASS_AUDIOSTREAMING	0x02
+#define UAC_VERSION_2			0x20
+#define UAC_CS_INTERFACE		0x24
+#define UAC_AS_GENERAL			0x01
+#define UAC_FORMAT_TYPE			0x02
+#define UAC_FORMAT_TYPE_I		0x01
+#define UAC2_INPUT_TERMINAL		0x02
+#define UAC2_CLOCK_SOURCE		0x0a
+
+// Sampling frequency requests: UAC1 addresses the endpoint, UAC2 the clock
+// source entity on the AudioControl interface.
+#define UAC_SET_CUR			0x01
+#define UAC_GET_CUR			0x81
+#define UAC2_CUR			0x01
+#define UAC_SAMPLING_FREQ_CONTROL	0x01
+
+// Endpoint bmAttributes usage bits (USB 2.0 9.6.6)
+#define UAC_EP_USAGE_MASK		0x30
+#define UAC_EP_USAGE_FEEDBACK		0x10
+
+// Largest share by which the feedback the host sees is moved off the
+// device's, when the buffer is empty or twice its target.
+#define UAC_FEEDBACK_CORRECTION		0.005
+// Device feedback further than this from the nominal rate is not trusted.
+#define UAC_FEEDBACK_TOLERANCE		0.125
+
+static std::atomic<uint32_t> uac1_rates[256];		// by device endpoint address
+static std::atomic<uint32_t> uac2_clock_rates[256];	// by clock ID
+static std::atomic<uint32_t> uac2_last_rate;
+
+static uint32_t get_le(const uint8_t *p, int length)
+{
+	uint32_t value = 0;
+	for (int i = length - 1; i >= 0; i--)
+		value = (value << 8) | p[i];
+	return value;
+}
+
+// Next class-specific interface descriptor of the given subtype in extra,
+// or NULL; minimum is the shortest acceptable bLength.
+static const uint8_t *find_cs_descriptor(const uint8_t *extra, int length,
+					 uint8_t subtype, int minimum,
+					 const uint8_t *after = NULL)
+{
+	int offset = after ? (after - extra) + after[0] : 0;
+	while (offset + 2 < length) {
+		const uint8_t *desc = extra + offset;
+		if (desc[0] < 2 || offset + desc[0] > length)
+			return NULL;
+		if (desc[1] == UAC_CS_INTERFACE && desc[2] == subtype && desc[0] >= minimum)
+			return desc;
+		offset += desc[0];
+	}
+	return NULL;
+}
+
+// The UAC2 AudioControl altsetting with the given interface number, or any
+// if interface_number is -1.
+static const struct libusb_interface_descriptor *
+find_uac2_control(const struct libusb_config_descriptor *config, int interface_number)
+{
+	for (int i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface_descriptor *alt = &config->interface[i].altsetting[0];
+		if (alt->bInterfaceClass == USB_CLASS_AUDIO &&
+		    alt->bInterfaceSubClass == UAC_SUBCLASS_AUDIOCONTROL &&
+		    alt->bInterfaceProtocol == UAC_VERSION_2 &&
+		    (interface_number == -1 || alt->bInterfaceNumber == interface_number))
+			return alt;
+	}
+	return NULL;
+}
+
+static bool is_uac2_clock_source(const struct libusb_interface_descriptor *control,
+				 uint8_t id)
+{
+	const uint8_t *desc = NULL;
+	while ((desc = find_cs_descriptor(control->extra, control->extra_length,
+					  UAC2_CLOCK_SOURCE, 4, desc)))
+		if (desc[3] == id)
+			return true;
+	return false;
+}
+
+// Clock source of the input terminal a UAC2 playback stream feeds, or 0 if
+// it is behind a clock selector or multiplier.
+static uint8_t find_uac2_clock(const struct libusb_config_descriptor *config,
+			       uint8_t terminal)
+{
+	const struct libusb_interface_descriptor *control = find_uac2_control(config, -1);
+	if (!control)
+		return 0;
+
+	const uint8_t *desc = NULL;
+	while ((desc = find_cs_descriptor(control->extra, control->extra_length,
+					  UAC2_INPUT_TERMINAL, 8, desc))) {
+		if (desc[3] == terminal)
+			return is_uac2_clock_source(control, desc[7]) ? desc[7] : 0;
+	}
+	return 0;
+}
+
+struct uac_stream *uac_stream_create(const struct libusb_config_descriptor *config,
+				     const struct libusb_interface_descriptor *alt)
+{
+	if (alt->bInterfaceClass != USB_CLASS_AUDIO ||
+	    alt->bInterfaceSubClass != UAC_SUBCLASS_AUDIOSTREAMING)
+		return NULL;
+
+	const struct libusb_endpoint_descriptor *data = NULL;
+	const struct libusb_endpoint_descriptor *feedback = NULL;
+	for (int i = 0; i < alt->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep = &alt->endpoint[i];
+		if ((ep->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) != USB_ENDPOINT_XFER_ISOC)
+			continue;
+		if (!(ep->bEndpointAddress & USB_DIR_IN))
+			data = ep;
+		else if ((ep->bmAttributes & UAC_EP_USAGE_MASK) == UAC_EP_USAGE_FEEDBACK)
+			feedback = ep;
+	}
+	if (!data)
+		return NULL;
+	// UAC1 feedback endpoints are found through bSynchAddress instead.
+	for (int i = 0; !feedback && data->bSynchAddress && i < alt->bNumEndpoints; i++)
+		if (alt->endpoint[i].bEndpointAddress == data->bSynchAddress)
+			feedback = &alt->endpoint[i];
+
+	bool uac2 = alt->bInterfaceProtocol == UAC_VERSION_2;
+	const uint8_t *general = find_cs_descriptor(alt->extra, alt->extra_length,
+						    UAC_AS_GENERAL, uac2 ? 16 : 7);
+	const uint8_t *format = find_cs_descriptor(alt->extra, alt->extra_length,
+						   UAC_FORMAT_TYPE, uac2 ? 6 : 8);
+	if (!general || !format || format[3] != UAC_FORMAT_TYPE_I)
+		return NULL;
+
+	unsigned int channels, subframe_size, default_rate = 0;
+	uint8_t clock_id = 0;
+	if (uac2) {
+		channels = general[10];
+		subframe_size = format[4];
+		clock_id = find_uac2_clock(config, general[3]);
+	} else {
+		channels = format[4];
+		subframe_size = format[5];
+		// bSamFreqType 1: a single discrete rate
+		if (format[7] == 1 && format[0] >= 11)
+			default_rate = get_le(format + 8, 3);
+	}
+	if (!channels || !subframe_size)
+		return NULL;
+
+	struct uac_stream *stream = new struct uac_stream();
+	stream->device_bEndpointAddress = data->bEndpointAddress;
+	stream->feedback_bEndpointAddress = feedback ? feedback->bEndpointAddress : 0;
+	stream->clock_id = clock_id;
+	stream->uac2 = uac2;
+	stream->frame_bytes = channels * subframe_size;
+	stream->default_rate = default_rate;
+	stream->fill = -1;
+	return stream;
+}
+
+unsigned int uac_stream_rate(const struct uac_stream *stream)
+{
+	unsigned int rate;
+	if (stream->uac2) {
+		rate = stream->clock_id ? uac2_clock_rates[stream->clock_id].load() : 0;
+		if (!rate)
+			rate = uac2_last_rate;
+	} else {
+		rate = uac1_rates[stream->device_bEndpointAddress];
+	}
+	return rate ? rate : stream->default_rate;
+}
+
+uint32_t uac_stream_packet_frames(const struct uac_stream *stream,
+				  unsigned int interval_us, bool full_speed)
+{
+	uint64_t nominal = ((uint64_t)uac_stream_rate(stream) << 16) * interval_us / 1000000;
+	uint32_t value = stream->feedback;
+	if (!value || !nominal)
+		return nominal;
+
+	// 10.14 per frame at full speed, 16.16 per microframe at high speed;
+	// some full-speed devices send 16.16 per frame or 10.14 in 4 bytes.
+	uint64_t candidates[2];
+	int count = 0;
+	if (stream->feedback_length == 3) {
+		candidates[count++] = ((uint64_t)value << 2) * interval_us / 1000;
+	} else if (full_speed) {
+		candidates[count++] = (uint64_t)value * interval_us / 1000;
+		candidates[count++] = ((uint64_t)value << 2) * interval_us / 1000;
+	} else {
+		candidates[count++] = (uint64_t)value * interval_us / 125;
+	}
+	for (int i = 0; i < count; i++)
+		if (candidates[i] > nominal * (1 - UAC_FEEDBACK_TOLERANCE) &&
+		    candidates[i] < nominal * (1 + UAC_FEEDBACK_TOLERANCE))
+			return candidates[i];
+	return nominal;
+}
+
+void uac_feedback_packet(struct uac_stream *stream, uint8_t *data, int length)
+{
+	if (length < 3)
+		return;
+	int bytes = length >= 4 ? 4 : 3;
+	uint32_t value = get_le(data, bytes);
+	stream->feedback = value;
+	stream->feedback_length = bytes;
+
+	// Ask the host for more while the buffer is below its target.
+	int fill = stream->fill, target = stream->target;
+	if (fill < 0 || target <= 0)
+		return;
+	double error = std::max(-1.0, std::min(1.0, (double)(target - fill) / target));
+	value = (uint32_t)(value * (1 + error * UAC_FEEDBACK_CORRECTION));
+	for (int i = 0; i < bytes; i++)
+		data[i] = value >> (8 * i);
+}
+
+void uac_control(const struct libusb_config_descriptor *config,
+		 const struct usb_ctrlrequest *ctrl, const uint8_t *data, int length)
+{
+	if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_CLASS ||
+	    (ctrl->wValue >> 8) != UAC_SAMPLING_FREQ_CONTROL || !config)
+		return;
+
+	uint8_t recipient = ctrl->bRequestType & USB_RECIP_MASK;
+	if (recipient == USB_RECIP_ENDPOINT && length >= 3 &&
+	    (ctrl->bRequest == UAC_SET_CUR || ctrl->bRequest == UAC_GET_CUR)) {
+		uint32_t rate = get_le(data, 3);
+		uac1_rates[ctrl->wIndex & 0xff] = rate;
+		printf("UAC: EP%02x sample rate %u Hz\n", ctrl->wIndex & 0xff, rate);
+		return;
+	}
+
+	// UAC2 CUR on a clock source. The control selector alone is not
+	// enough: UAC1 feature units use the same value for mute.
+	uint8_t clock_id = ctrl->wIndex >> 8;
+	const struct libusb_interface_descriptor *control =
+		find_uac2_control(config, ctrl->wIndex & 0xff);
+	if (recipient != USB_RECIP_INTERFACE || ctrl->bRequest != UAC2_CUR ||
+	    length < 4 || !control || !is_uac2_clock_source(control, clock_id))
+		return;
+	uint32_t rate = get_le(data, 4);
+	uac2_clock_rates[clock_id] = rate;
+	uac2_last_rate = rate;
+	printf("UAC: clock %u sample rate %u Hz\n", clock_id, rate);
+}
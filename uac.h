@@ -0,0 +1,56 @@
+#ifndef USB_PROXY_UAC_H
+#define USB_PROXY_UAC_H
+
+#include <atomic>
+#include <stdint.h>
+#include <linux/usb/ch9.h>
+
+struct libusb_config_descriptor;
+struct libusb_interface_descriptor;
+
+// USB Audio playback (--uac_jitter_ms MS): the isochronous OUT data endpoint
+// of a UAC1/UAC2 PCM streaming interface is fed from a jitter buffer of
+// sample frames instead of forwarding the host's packets as they arrive. Each
+// packet to the device carries as many frames as the device consumes per
+// service interval (its explicit feedback, or the nominal sample rate), so
+// the device sees a continuous stream at its own clock. The feedback the host
+// sees is nudged towards keeping the buffer at its target; without feedback
+// the packet sizes are nudged instead. Missing frames are filled with silence
+// (underrun), excess frames are dropped from the oldest (overrun).
+//
+// The sample rate comes from the format descriptor when it allows only one,
+// otherwise from the SET_CUR/GET_CUR sampling frequency requests ep0 sees.
+
+struct uac_stream {
+	uint8_t			device_bEndpointAddress;	// OUT data endpoint
+	uint8_t			feedback_bEndpointAddress;	// 0 if none
+	uint8_t			clock_id;	// UAC2 clock source, 0 if unknown
+	bool			uac2;
+	unsigned int		frame_bytes;	// one sample for all channels
+	unsigned int		default_rate;	// the format's only rate, or 0
+	std::atomic<uint32_t>	feedback;	// last device feedback value
+	std::atomic<int>	feedback_length;
+	std::atomic<int>	fill;		// buffered frames, -1 when not buffering
+	std::atomic<int>	target;		// target fill in frames
+};
+
+// Builds the stream for an AudioStreaming altsetting with an isochronous OUT
+// PCM endpoint, or returns NULL.
+struct uac_stream *uac_stream_create(const struct libusb_config_descriptor *config,
+				     const struct libusb_interface_descriptor *alt);
+// Current sample rate, 0 while unknown.
+unsigned int uac_stream_rate(const struct uac_stream *stream);
+// Frames the device consumes per packet as 16.16 fixed point: the device
+// feedback if it is plausible, otherwise the nominal rate. interval_us is the
+// packet interval; full_speed selects the 10.14 feedback format.
+uint32_t uac_stream_packet_frames(const struct uac_stream *stream,
+				  unsigned int interval_us, bool full_speed);
+// Records a feedback packet from the device and rewrites it for the host.
+void uac_feedback_packet(struct uac_stream *stream, uint8_t *data, int length);
+
+// Tracks sampling frequency requests on ep0 (wIndex already translated to
+// the device's endpoint addresses); data is the request's data stage.
+void uac_control(const struct libusb_config_descriptor *config,
+		 const struct usb_ctrlrequest *ctrl, const uint8_t *data, int length);
+
+#endif // USB_PROXY_UAC_H
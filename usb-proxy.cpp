@@ -1,15 +1,24 @@
+#include <algorithm>
 #include <atomic>
+#include <climits>
 #include <unordered_map>
 #include <vector>
 
 #include "host-raw-gadget.h"
 #include "device-libusb.h"
+#include "descriptor-cache.h"
 #include "proxy.h"
 #include "misc.h"
+#include "stats.h"
+#include "timeline.h"
+#include "diagnose.h"
+#include "trace.h"
+#include "snapshot.h"
 
 int verbose_level = 0;
 bool please_stop_ep0 = false;
 std::atomic<bool> please_stop_eps(false);
+std::atomic<bool> device_unplugged(false);
 
 bool injection_enabled = false;
 std::string injection_file = "injection.json";
@@ -20,8 +29,19 @@ std::string customized_config_file = "config.json";
 bool reset_device_before_proxy = true;
 bool bmaxpacketsize0_must_greater_than_64 = true;
 bool auto_remap_endpoints = false;
+bool iso_high_bandwidth = false;
+bool uvc_repacketize = false;
+int uac_jitter_ms = 0;
+int iso_in_latency = 0;
 int iso_batch_size = ISO_BATCH_SIZE_DEFAULT;
 enum usb_device_speed device_speed = USB_SPEED_HIGH;
+enum usb_device_speed gadget_speed = USB_SPEED_HIGH;
+bool superspeed_gadget = false;
+struct device_backend *device_backend = &libusb_device_backend;
+struct host_backend *host_backend = &raw_gadget_host_backend;
+std::string emulated_device_file;
+std::string emulated_host_file;
+std::string serial_filter;
 
 // Print the transform summary for a single injection rule.
 // Returns true if the rule references a Lua script_file.
@@ -102,6 +122,93 @@ static void print_injection_summary()
 #endif
 }
 
+// Set once the counters exist, so an early SIGUSR2 does not race their
+// allocation.
+static std::atomic<bool> injection_stats_ready(false);
+
+// Allocate per-rule counters for every rule in the injection file.
+static void init_injection_stats()
+{
+	const std::vector<std::string> ep_types   = {"int", "bulk", "isoc"};
+	const std::vector<std::string> ctrl_types = {"modify", "ignore", "stall"};
+
+	for (const auto &type : ep_types)
+		injection_rule_stats_init(type, injection_config[type].size());
+	for (const auto &sub : ctrl_types)
+		injection_rule_stats_init("control/" + sub,
+					  injection_config["control"][sub].size());
+	injection_stats_ready = true;
+}
+
+static void print_rule_stats(const std::string &section, unsigned int index)
+{
+	struct injection_rule_stats *rule_stats =
+		injection_rule_stats_get(section, index);
+	if (!rule_stats)
+		return;
+
+	uint64_t evaluated = rule_stats->evaluated;
+	uint64_t matched   = rule_stats->matched;
+	printf("      evaluated %lu  matched %lu  modified %lu  bytes +%lu/-%lu\n",
+	       (unsigned long)evaluated, (unsigned long)matched,
+	       (unsigned long)rule_stats->modified,
+	       (unsigned long)rule_stats->bytes_added,
+	       (unsigned long)rule_stats->bytes_removed);
+
+	// Each step's time accrues on every evaluation, matched or not.
+	printf("      time (ms): pattern %.3f  operations %.3f  lua %.3f\n",
+	       rule_stats->pattern_ns / 1e6,
+	       rule_stats->operations_ns / 1e6,
+	       rule_stats->lua_ns / 1e6);
+	if (!evaluated)
+		return;
+	printf("      time/evaluation (us): pattern %.2f  operations %.2f  lua %.2f\n",
+	       rule_stats->pattern_ns / 1000.0 / evaluated,
+	       rule_stats->operations_ns / 1000.0 / evaluated,
+	       rule_stats->lua_ns / 1000.0 / evaluated);
+}
+
+// Same layout as print_injection_summary(), with the counters of each rule.
+static void print_injection_stats()
+{
+	const std::vector<std::string> ep_types   = {"int", "bulk", "isoc"};
+	const std::vector<std::string> ctrl_types = {"modify", "ignore", "stall"};
+
+	if (!injection_stats_ready)
+		return;
+
+	printf("Injection rule statistics:\n");
+
+	for (const auto &type : ep_types) {
+		for (unsigned int i = 0; i < injection_config[type].size(); i++) {
+			const Json::Value &rule = injection_config[type][i];
+			if (!rule["enable"].asBool()) continue;
+
+			int ep = hexToDecimal(rule["ep_address"].asInt());
+			printf("  [%-4s]  EP 0x%02x", type.c_str(), ep);
+			print_rule_transforms(rule);
+			printf("\n");
+			print_rule_stats(type, i);
+		}
+	}
+
+	for (const auto &sub : ctrl_types) {
+		for (unsigned int i = 0; i < injection_config["control"][sub].size(); i++) {
+			const Json::Value &rule = injection_config["control"][sub][i];
+			if (!rule["enable"].asBool()) continue;
+
+			printf("  [control/%-6s]  bRequestType=0x%02x bRequest=0x%02x",
+			       sub.c_str(),
+			       rule["bRequestType"].asInt(),
+			       rule["bRequest"].asInt());
+			if (sub == "modify")
+				print_rule_transforms(rule);
+			printf("\n");
+			print_rule_stats("control/" + sub, i);
+		}
+	}
+}
+
 void usage() {
 	printf("Usage:\n");
 	printf("\t-h/--help: print this help message\n");
@@ -110,25 +217,44 @@ void usage() {
 	printf("\t--driver: use specific driver\n");
 	printf("\t--vendor_id: use specific vendor_id of USB device\n");
 	printf("\t--product_id: use specific product_id of USB device\n");
+	printf("\t--serial SERIAL: only proxy the USB device with this serial number\n");
 	printf("\t--enable_injection: enable injection using the default injection.json\n");
 	printf("\t--injection_file: enable injection using the specified rules file\n");
 	printf("\t--enable_customized_config: enable the customized config feature\n");
 	printf("\t--auto_remap_endpoints: enable endpoint remapping when UDC can't use descriptors directly\n");
-	printf("\t--iso_batch_size N: number of isochronous packets per transfer (1-%d, default %d)\n\n",
+	printf("\t--iso_high_bandwidth: keep 2-3 isochronous transactions per microframe when remapping\n");
+	printf("\t--superspeed: run the gadget at SuperSpeed when the device is a SuperSpeed device\n");
+	printf("\t--uvc_repacketize: split UVC payloads larger than the UDC's packets instead of lowering the video format\n");
+	printf("\t--uac_jitter_ms MS: play USB audio through a jitter buffer of MS milliseconds paced to the device\n");
+	printf("\t--iso_in_latency N: play isochronous IN packets to the host through a buffer of N microframes\n");
+	printf("\t--iso_batch_size N: number of isochronous packets per transfer (1-%d, default %d)\n",
 		ISO_BATCH_SIZE_MAX, ISO_BATCH_SIZE_DEFAULT);
+	printf("\t--enum_trace FILE: write an enumeration timeline (Chrome trace-event JSON) to FILE\n");
+	printf("\t--diagnose N: log a per-endpoint bottleneck diagnosis every N seconds\n");
+	printf("\t--emulate_device FILE: proxy an in-process device described in FILE instead of a USB device\n");
+	printf("\t--emulate_host FILE: drive the proxy from an in-process host scripted by FILE instead of Raw Gadget\n");
+	printf("\t--record_trace FILE: record endpoint traffic entering the proxy to FILE\n");
+	printf("\t--replay_trace FILE: replay a recorded trace through the emulated device/host\n");
+	printf("\t--replay_fast: replay as fast as possible instead of in real time\n");
+	printf("\t--replay_verify: make emulated sinks check their packets against the trace\n");
+	printf("\t--snapshot FILE: save the device's descriptors and control responses to FILE at exit\n");
+	printf("\t--clone FILE: serve a device saved with --snapshot instead of a USB device\n");
+	printf("\t--descriptor_cache DIR: bring the gadget up from descriptors cached in DIR while the device opens\n\n");
 	printf("* If `device` not specified, `usb-proxy` will use `dummy_udc.0` as default device.\n");
 	printf("* If `driver` not specified, `usb-proxy` will use `dummy_udc` as default driver.\n");
 	printf("* If both `vendor_id` and `product_id` not specified, `usb-proxy` will connect\n");
 	printf("  the first USB device it can find.\n");
-	printf("* If `injection_file` not specified, `usb-proxy` will use `injection.json` by default.\n\n");
+	printf("* If `injection_file` not specified, `usb-proxy` will use `injection.json` by default.\n");
+	printf("* Send SIGUSR2 to print per-endpoint latency and injection rule statistics at runtime.\n\n");
 	exit(1);
 }
 
+static volatile sig_atomic_t signal_received = false;
+
 void handle_signal(int signum) {
 	switch (signum) {
 	case SIGTERM:
 	case SIGINT:
-		static bool signal_received = false;
 		if (signal_received) {
 			printf("Signal received again, force exiting\n");
 			exit(1);
@@ -145,13 +271,45 @@ void handle_signal(int signum) {
 	}
 }
 
+// Runtime statistics are dumped on SIGUSR2. The signal is blocked in every
+// thread and picked up synchronously here, so printing is not restricted to
+// async-signal-safe functions and no blocking ioctl gets interrupted.
+static void *stats_monitor(void *arg)
+{
+	sigset_t *set = (sigset_t *)arg;
+	int signum;
+
+	pthread_setname_np(pthread_self(), "stats-monitor");
+
+	while (true) {
+		if (sigwait(set, &signum) != 0)
+			continue;
+		print_ep_stats();
+		print_injection_stats();
+	}
+	return NULL;
+}
+
+static void start_stats_monitor()
+{
+	static sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR2);
+	// Threads inherit the mask, so do this before any other thread is created.
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_t thread;
+	pthread_create(&thread, 0, stats_monitor, (void *)&set);
+	pthread_detach(thread);
+}
+
 // Wrapper for UDC endpoint info, allowing future extension with additional state.
 struct EndpointCandidate {
 	struct usb_raw_ep_info info;
 };
 
-static bool candidate_supports_endpoint(const EndpointCandidate &candidate,
-					const struct usb_endpoint_descriptor &endpoint)
+static bool candidate_supports_type(const EndpointCandidate &candidate,
+				    const struct usb_endpoint_descriptor &endpoint)
 {
 	bool dir_in = usb_endpoint_dir_in(&endpoint);
 	int type = usb_endpoint_type(&endpoint);
@@ -178,11 +336,6 @@ static bool candidate_supports_endpoint(const EndpointCandidate &candidate,
 		return false;
 	}
 
-	uint16_t max_packet = usb_endpoint_maxp(&endpoint);
-	if (candidate.info.limits.maxpacket_limit &&
-	    max_packet > candidate.info.limits.maxpacket_limit)
-		return false;
-
 	return true;
 }
 
@@ -202,84 +355,313 @@ static uint8_t compute_host_endpoint_address(const EndpointCandidate &candidate,
 	return host_address;
 }
 
-static int find_candidate_index(const std::vector<EndpointCandidate> &candidates,
-				std::vector<bool> &candidate_used,
-				const struct usb_endpoint_descriptor &endpoint)
+// Device endpoints that share one UDC endpoint: every altsetting of one
+// device endpoint and, when the UDC is short of endpoints, other endpoints
+// of the same interface that are never active at the same time. Raw Gadget
+// binds the UDC endpoint at SET_INTERFACE and releases it when the
+// altsetting is left, so such endpoints can take turns on it.
+struct EndpointGroup {
+	std::vector<uint8_t> addresses;
+	std::vector<struct raw_gadget_altsetting *> alts;
+	std::vector<struct raw_gadget_endpoint *> eps;
+};
+
+// Bytes per interval the candidate carries for one altsetting, or -1 if it
+// cannot serve it. Isochronous endpoints above the UDC limit are clamped
+// (and so count at the limit); other types must fit.
+static int candidate_bandwidth(const EndpointCandidate &candidate,
+			       const struct usb_endpoint_descriptor &endpoint)
 {
-	for (size_t i = 0; i < candidates.size(); i++) {
-		if (candidate_used[i])
-			continue;
-		if (!candidate_supports_endpoint(candidates[i], endpoint))
-			continue;
-		return i;
-	}
+	if (!candidate_supports_type(candidate, endpoint))
+		return -1;
+
+	int max_packet = usb_endpoint_maxp(&endpoint);
+	int limit = candidate.info.limits.maxpacket_limit;
+	if (!limit || max_packet <= limit)
+		return max_packet * (iso_high_bandwidth ? usb_endpoint_maxp_mult(&endpoint) : 1);
+	if (usb_endpoint_type(&endpoint) == USB_ENDPOINT_XFER_ISOC)
+		return limit * (iso_high_bandwidth ? usb_endpoint_maxp_mult(&endpoint) : 1);
 	return -1;
 }
 
-static int remap_config_endpoints(struct raw_gadget_config *config,
-				  const std::vector<EndpointCandidate> &candidates)
+// Summed over the group's altsettings; -1 if any of them is unusable.
+static long long candidate_score(const EndpointCandidate &candidate,
+				 const EndpointGroup &group)
 {
-	std::vector<bool> candidate_used(candidates.size(), false);
-	std::unordered_map<uint8_t, size_t> device_to_candidate;
+	long long score = 0;
+	for (auto *rg_ep : group.eps) {
+		int bandwidth = candidate_bandwidth(candidate, rg_ep->endpoint);
+		if (bandwidth < 0)
+			return -1;
+		score += bandwidth;
+	}
+	return score;
+}
+
+// Minimum-cost assignment of rows to columns (Hungarian algorithm, rows <=
+// columns). Returns the column assigned to each row.
+static std::vector<int> solve_assignment(const std::vector<std::vector<long long>> &cost)
+{
+	int n = cost.size(), m = cost[0].size();
+	const long long inf = LLONG_MAX / 4;
+	std::vector<long long> u(n + 1), v(m + 1);
+	std::vector<int> p(m + 1), way(m + 1);
+
+	for (int i = 1; i <= n; i++) {
+		p[0] = i;
+		int j0 = 0;
+		std::vector<long long> minv(m + 1, inf);
+		std::vector<bool> used(m + 1, false);
+		do {
+			used[j0] = true;
+			int i0 = p[j0], j1 = 0;
+			long long delta = inf;
+			for (int j = 1; j <= m; j++) {
+				if (used[j])
+					continue;
+				long long cur = cost[i0 - 1][j - 1] - u[i0] - v[j];
+				if (cur < minv[j]) {
+					minv[j] = cur;
+					way[j] = j0;
+				}
+				if (minv[j] < delta) {
+					delta = minv[j];
+					j1 = j;
+				}
+			}
+			for (int j = 0; j <= m; j++) {
+				if (used[j]) {
+					u[p[j]] += delta;
+					v[j] -= delta;
+				} else {
+					minv[j] -= delta;
+				}
+			}
+			j0 = j1;
+		} while (p[j0] != 0);
+		do {
+			int j1 = way[j0];
+			p[j0] = p[j1];
+			j0 = j1;
+		} while (j0);
+	}
+
+	std::vector<int> assignment(n, -1);
+	for (int j = 1; j <= m; j++)
+		if (p[j])
+			assignment[p[j] - 1] = j - 1;
+	return assignment;
+}
+
+static const char *unmapped_reason(const EndpointGroup &group,
+				   const std::vector<EndpointCandidate> &candidates)
+{
+	bool type_match = false;
+	for (auto &candidate : candidates) {
+		if (candidate_score(candidate, group) >= 0)
+			return "all suitable UDC endpoints are taken";
+		if (candidate_supports_type(candidate, group.eps[0]->endpoint))
+			type_match = true;
+	}
+	return type_match ? "wMaxPacketSize exceeds every suitable UDC endpoint" :
+			    "no UDC endpoint supports its type and direction";
+}
+
+static std::vector<EndpointGroup> group_config_endpoints(struct raw_gadget_config *config)
+{
+	std::vector<EndpointGroup> groups;
+	std::unordered_map<uint8_t, size_t> group_index;
 
 	for (int i = 0; i < config->config.bNumInterfaces; i++) {
 		struct raw_gadget_interface *iface = &config->interfaces[i];
 		for (int j = 0; j < iface->num_altsettings; j++) {
 			struct raw_gadget_altsetting *alt = &iface->altsettings[j];
-			uint8_t iface_num = alt->interface.bInterfaceNumber;
-			uint8_t alt_setting = alt->interface.bAlternateSetting;
 			for (int k = 0; k < alt->interface.bNumEndpoints; k++) {
 				struct raw_gadget_endpoint *ep = &alt->endpoints[k];
 				uint8_t device_address = ep->device_bEndpointAddress;
-				auto existing = device_to_candidate.find(device_address);
-
-				size_t candidate_index;
-				if (existing != device_to_candidate.end()) {
-					candidate_index = existing->second;
-				}
-				else {
-					int idx = find_candidate_index(candidates,
-								       candidate_used,
-								       ep->endpoint);
-					if (idx < 0) {
-						printf("Failed to remap endpoint 0x%02x "
-						       "(interface %u, alt %u)\n",
-						       device_address, iface_num, alt_setting);
-						return -1;
-					}
-					candidate_index = (size_t)idx;
-					device_to_candidate[device_address] = candidate_index;
-					candidate_used[candidate_index] = true;
+				auto existing = group_index.find(device_address);
+				if (existing == group_index.end()) {
+					existing = group_index.emplace(device_address,
+								       groups.size()).first;
+					groups.push_back({ { device_address }, {}, {} });
 				}
+				groups[existing->second].alts.push_back(alt);
+				groups[existing->second].eps.push_back(ep);
+			}
+		}
+	}
+	return groups;
+}
 
-				bool dir_in = usb_endpoint_dir_in(&ep->endpoint);
-				uint8_t host_address = compute_host_endpoint_address(
-					candidates[candidate_index], device_address, dir_in);
+// Endpoints of one interface with the same type and direction can share a
+// UDC endpoint if no altsetting uses both.
+static bool groups_exclusive(const EndpointGroup &a, const EndpointGroup &b)
+{
+	uint8_t interface_number = a.alts[0]->interface.bInterfaceNumber;
+	for (auto *alt : a.alts)
+		if (alt->interface.bInterfaceNumber != interface_number)
+			return false;
+	for (auto *alt : b.alts) {
+		if (alt->interface.bInterfaceNumber != interface_number)
+			return false;
+		if (std::find(a.alts.begin(), a.alts.end(), alt) != a.alts.end())
+			return false;
+	}
+
+	const struct usb_endpoint_descriptor *ea = &a.eps[0]->endpoint;
+	const struct usb_endpoint_descriptor *eb = &b.eps[0]->endpoint;
+	return usb_endpoint_type(ea) == usb_endpoint_type(eb) &&
+	       usb_endpoint_dir_in(ea) == usb_endpoint_dir_in(eb);
+}
+
+// First-fit merge of mutually exclusive endpoints.
+static std::vector<EndpointGroup> merge_exclusive_groups(const std::vector<EndpointGroup> &groups)
+{
+	std::vector<EndpointGroup> merged;
+	for (auto &group : groups) {
+		auto it = merged.begin();
+		while (it != merged.end() && !groups_exclusive(*it, group))
+			it++;
+		if (it == merged.end()) {
+			merged.push_back(group);
+			continue;
+		}
+		it->addresses.insert(it->addresses.end(), group.addresses.begin(),
+				     group.addresses.end());
+		it->alts.insert(it->alts.end(), group.alts.begin(), group.alts.end());
+		it->eps.insert(it->eps.end(), group.eps.begin(), group.eps.end());
+	}
+	return merged;
+}
+
+// Matches groups to UDC endpoints. One column per UDC endpoint plus one
+// "unmapped" column per group. Every mapped group outweighs any bandwidth
+// difference, so the matching maps as many groups as possible first and
+// then maximises the bandwidth usable across all altsettings. Returns the
+// UDC endpoint for each group, -1 where none is left.
+static std::vector<int> assign_groups(const std::vector<EndpointGroup> &groups,
+				      const std::vector<EndpointCandidate> &candidates)
+{
+	const long long mapped_weight = 1LL << 40;
+	size_t n = groups.size(), m = candidates.size();
+	std::vector<std::vector<long long>> cost(n, std::vector<long long>(m + n, 0));
+	for (size_t i = 0; i < n; i++) {
+		for (size_t j = 0; j < m; j++) {
+			long long score = candidate_score(candidates[j], groups[i]);
+			if (score >= 0)
+				cost[i][j] = -(mapped_weight + score);
+		}
+	}
+
+	std::vector<int> assignment = solve_assignment(cost);
+	for (size_t i = 0; i < n; i++)
+		if (assignment[i] >= (int)m || cost[i][assignment[i]] == 0)
+			assignment[i] = -1;
+	return assignment;
+}
+
+static int remap_config_endpoints(struct raw_gadget_config *config,
+				  const std::vector<EndpointCandidate> &candidates)
+{
+	std::vector<EndpointGroup> groups = group_config_endpoints(config);
+	if (groups.empty())
+		return 0;
+
+	std::vector<int> assignment = assign_groups(groups, candidates);
+	if (std::find(assignment.begin(), assignment.end(), -1) != assignment.end()) {
+		std::vector<EndpointGroup> merged = merge_exclusive_groups(groups);
+		if (merged.size() < groups.size()) {
+			printf("UDC is short of endpoints, sharing them between "
+			       "alternate settings (%zu endpoints on %zu)\n",
+				groups.size(), merged.size());
+			groups = merged;
+			assignment = assign_groups(groups, candidates);
+		}
+	}
+
+	bool failed = false;
+	for (size_t i = 0; i < groups.size(); i++) {
+		EndpointGroup &group = groups[i];
+		if (assignment[i] < 0) {
+			for (uint8_t address : group.addresses)
+				printf("Failed to remap endpoint 0x%02x (interface %u): %s\n",
+					address, group.alts[0]->interface.bInterfaceNumber,
+					unmapped_reason(group, candidates));
+			failed = true;
+			continue;
+		}
+		const EndpointCandidate &candidate = candidates[assignment[i]];
+
+		for (size_t k = 0; k < group.eps.size(); k++) {
+			struct raw_gadget_endpoint *ep = group.eps[k];
+			uint8_t device_address = ep->device_bEndpointAddress;
+			uint8_t iface_num = group.alts[k]->interface.bInterfaceNumber;
+			uint8_t alt_setting = group.alts[k]->interface.bAlternateSetting;
+			bool dir_in = usb_endpoint_dir_in(&ep->endpoint);
+			// Shared endpoints must agree on one address.
+			uint8_t host_address = compute_host_endpoint_address(
+				candidate, group.addresses[0], dir_in);
+
+			if (host_address != ep->endpoint.bEndpointAddress) {
+				printf("Remapping endpoint 0x%02x -> 0x%02x "
+				       "(interface %u, alt %u)\n",
+					device_address, host_address, iface_num, alt_setting);
+			}
 
-				if (host_address != ep->endpoint.bEndpointAddress) {
-					printf("Remapping endpoint 0x%02x -> 0x%02x "
-					       "(interface %u, alt %u)\n",
-						device_address, host_address, iface_num, alt_setting);
+			ep->endpoint.bEndpointAddress = host_address;
+			ep->udc_maxpacket_limit = candidate.info.limits.maxpacket_limit;
+
+			// Clamp isochronous max packet size to UDC limit. Unless
+			// --iso_high_bandwidth says the UDC can do 2-3 transactions
+			// per microframe, high bandwidth is dropped as well.
+			if (usb_endpoint_type(&ep->endpoint) == USB_ENDPOINT_XFER_ISOC &&
+			    ep->udc_maxpacket_limit) {
+				uint16_t maxp = usb_endpoint_maxp(&ep->endpoint);
+				uint16_t base = maxp & 0x7ff;
+				uint16_t mult_bits = iso_high_bandwidth ?
+					ep->endpoint.wMaxPacketSize & 0x1800 : 0;
+				if (base > ep->udc_maxpacket_limit ||
+				    (ep->endpoint.wMaxPacketSize & 0x1800) != mult_bits) {
+					uint16_t clamped = mult_bits |
+						std::min(base, ep->udc_maxpacket_limit);
+					printf("Endpoint 0x%02x (interface %u, alt %u): "
+					       "wMaxPacketSize 0x%04x clamped to 0x%04x\n",
+						device_address, iface_num, alt_setting,
+						ep->endpoint.wMaxPacketSize, clamped);
+					ep->endpoint.wMaxPacketSize = clamped;
 				}
+			}
 
-				ep->endpoint.bEndpointAddress = host_address;
-				ep->udc_maxpacket_limit = candidates[candidate_index].info.limits.maxpacket_limit;
-
-				// Clamp isochronous max packet size to UDC limit; UDC can't do high bandwidth.
-				if (usb_endpoint_type(&ep->endpoint) == USB_ENDPOINT_XFER_ISOC &&
-				    ep->udc_maxpacket_limit) {
-					uint16_t maxp = usb_endpoint_maxp(&ep->endpoint);
-					uint16_t base = maxp & 0x7ff;
-					if (base > ep->udc_maxpacket_limit ||
-					    (ep->endpoint.wMaxPacketSize & 0x1800)) {
-						ep->endpoint.wMaxPacketSize = ep->udc_maxpacket_limit;
-					}
+			// A SuperSpeed isochronous interval (up to 48 KiB) must fit in
+			// one transfer buffer: Mult goes first, then the burst.
+			struct usb_ss_ep_comp_descriptor *comp = &ep->ss_comp;
+			if (usb_endpoint_type(&ep->endpoint) == USB_ENDPOINT_XFER_ISOC &&
+			    comp->bLength) {
+				int maxp = usb_endpoint_maxp(&ep->endpoint);
+				int burst = comp->bMaxBurst + 1;
+				int mult = USB_SS_MULT(comp->bmAttributes);
+				while (mult > 1 && maxp * burst * mult > MAX_TRANSFER_SIZE)
+					mult--;
+				while (burst > 1 && maxp * burst * mult > MAX_TRANSFER_SIZE)
+					burst--;
+				if (burst != comp->bMaxBurst + 1 ||
+				    mult != USB_SS_MULT(comp->bmAttributes)) {
+					printf("Endpoint 0x%02x (interface %u, alt %u): warning: "
+					       "bMaxBurst %u Mult %u exceed %d bytes per interval, "
+					       "clamped to bMaxBurst %d Mult %d\n",
+						device_address, iface_num, alt_setting,
+						comp->bMaxBurst, USB_SS_MULT(comp->bmAttributes),
+						MAX_TRANSFER_SIZE, burst - 1, mult);
+					comp->bMaxBurst = burst - 1;
+					comp->bmAttributes = (comp->bmAttributes & ~0x3) | (mult - 1);
+					comp->wBytesPerInterval = std::min<int>(comp->wBytesPerInterval,
+										maxp * burst * mult);
 				}
 			}
 		}
 	}
 
-	return 0;
+	return failed ? -1 : 0;
 }
 
 static int remap_host_endpoints_if_needed(int fd)
@@ -290,7 +672,7 @@ static int remap_host_endpoints_if_needed(int fd)
 	struct usb_raw_eps_info eps_info;
 	memset(&eps_info, 0, sizeof(eps_info));
 
-	int num = usb_raw_eps_info(fd, &eps_info);
+	int num = host_backend->eps_info(fd, &eps_info);
 	if (num <= 0) {
 		printf("Failed to fetch endpoint info for remapping\n");
 		return -1;
@@ -308,9 +690,38 @@ static int remap_host_endpoints_if_needed(int fd)
 			return -1;
 	}
 
+	build_remap_tables();
 	return 0;
 }
 
+// Copies the SuperSpeed endpoint companion descriptor that follows the
+// endpoint descriptor, if the device sent one.
+static void find_ss_ep_comp(const struct libusb_endpoint_descriptor *endpoint,
+			    struct usb_ss_ep_comp_descriptor *ss_comp)
+{
+	int offset = 0;
+	while (offset + 2 <= endpoint->extra_length) {
+		const unsigned char *desc = endpoint->extra + offset;
+		if (desc[0] < 2)
+			break;
+		if (desc[1] == USB_DT_SS_ENDPOINT_COMP && desc[0] >= USB_DT_SS_EP_COMP_SIZE &&
+		    offset + USB_DT_SS_EP_COMP_SIZE <= endpoint->extra_length) {
+			memcpy(ss_comp, desc, USB_DT_SS_EP_COMP_SIZE);
+			return;
+		}
+		offset += desc[0];
+	}
+}
+
+// Reserves bytes at the end of an arena being laid out; returns their offset.
+static size_t arena_reserve(size_t *size, size_t bytes)
+{
+	size_t offset = (*size + alignof(std::max_align_t) - 1) &
+			~(alignof(std::max_align_t) - 1);
+	*size = offset + bytes;
+	return offset;
+}
+
 int setup_host_usb_desc() {
 	host_device_desc.device = {
 		.bLength =		device_device_desc.bLength,
@@ -329,8 +740,45 @@ int setup_host_usb_desc() {
 		.bNumConfigurations =	device_device_desc.bNumConfigurations,
 	};
 
+	// The whole tree lives in one zeroed block: the configurations, then
+	// every interface, altsetting and endpoint, each level contiguous and
+	// in the order ep0 walks it.
 	int bNumConfigurations = device_device_desc.bNumConfigurations;
-	host_device_desc.configs = new struct raw_gadget_config[bNumConfigurations];
+	size_t num_interfaces = 0, num_altsettings = 0, num_endpoints = 0;
+	for (int i = 0; i < bNumConfigurations; i++) {
+		num_interfaces += device_config_desc[i]->bNumInterfaces;
+		for (int j = 0; j < device_config_desc[i]->bNumInterfaces; j++) {
+			const struct libusb_interface *iface = &device_config_desc[i]->interface[j];
+			num_altsettings += iface->num_altsetting;
+			for (int k = 0; k < iface->num_altsetting; k++)
+				num_endpoints += iface->altsetting[k].bNumEndpoints;
+		}
+	}
+
+	size_t arena_size = 0;
+	size_t configs_offset = arena_reserve(&arena_size,
+		bNumConfigurations * sizeof(struct raw_gadget_config));
+	size_t interfaces_offset = arena_reserve(&arena_size,
+		num_interfaces * sizeof(struct raw_gadget_interface));
+	size_t altsettings_offset = arena_reserve(&arena_size,
+		num_altsettings * sizeof(struct raw_gadget_altsetting));
+	size_t endpoints_offset = arena_reserve(&arena_size,
+		num_endpoints * sizeof(struct raw_gadget_endpoint));
+
+	char *arena = (char *)calloc(1, arena_size ? arena_size : 1);
+	if (!arena) {
+		perror("calloc() descriptor tree");
+		exit(EXIT_FAILURE);
+	}
+	host_device_desc.arena = arena;
+	host_device_desc.configs = (struct raw_gadget_config *)(arena + configs_offset);
+	struct raw_gadget_interface *next_interfaces =
+		(struct raw_gadget_interface *)(arena + interfaces_offset);
+	struct raw_gadget_altsetting *next_altsettings =
+		(struct raw_gadget_altsetting *)(arena + altsettings_offset);
+	struct raw_gadget_endpoint *next_endpoints =
+		(struct raw_gadget_endpoint *)(arena + endpoints_offset);
+
 	for (int i = 0; i < bNumConfigurations; i++) {
 		struct usb_config_descriptor temp_config = {
 			.bLength =		device_config_desc[i]->bLength,
@@ -345,12 +793,12 @@ int setup_host_usb_desc() {
 		host_device_desc.configs[i].config = temp_config;
 
 		int bNumInterfaces = device_config_desc[i]->bNumInterfaces;
-		struct raw_gadget_interface *temp_interfaces =
-			new struct raw_gadget_interface[bNumInterfaces];
+		struct raw_gadget_interface *temp_interfaces = next_interfaces;
+		next_interfaces += bNumInterfaces;
 		for (int j = 0; j < bNumInterfaces; j++) {
 			int num_altsetting = device_config_desc[i]->interface[j].num_altsetting;
-			struct raw_gadget_altsetting *temp_altsettings =
-				new struct raw_gadget_altsetting[num_altsetting];
+			struct raw_gadget_altsetting *temp_altsettings = next_altsettings;
+			next_altsettings += num_altsetting;
 			for (int k = 0; k < num_altsetting; k++) {
 				const struct libusb_interface_descriptor temp_device_altsetting =
 					device_config_desc[i]->interface[j].altsetting[k];
@@ -371,13 +819,12 @@ int setup_host_usb_desc() {
 					printf("InterfaceNumber %x AlternateSetting %x has no endpoint, skip\n",
 						temp_device_altsetting.bInterfaceNumber,
 						temp_device_altsetting.bAlternateSetting);
-					temp_altsettings[k].endpoints = NULL;
 					continue;
 				}
 
 				int bNumEndpoints = temp_device_altsetting.bNumEndpoints;
-				struct raw_gadget_endpoint *temp_endpoints =
-					new struct raw_gadget_endpoint[bNumEndpoints];
+				struct raw_gadget_endpoint *temp_endpoints = next_endpoints;
+				next_endpoints += bNumEndpoints;
 				for (int l = 0; l < bNumEndpoints; l++) {
 					struct usb_endpoint_descriptor temp_endpoint = {
 						.bLength =		temp_device_altsetting.endpoint[l].bLength,
@@ -418,19 +865,17 @@ int setup_host_usb_desc() {
 					}
 
 					temp_endpoints[l].endpoint = temp_endpoint;
+					if (gadget_speed == USB_SPEED_SUPER)
+						find_ss_ep_comp(&temp_device_altsetting.endpoint[l],
+								&temp_endpoints[l].ss_comp);
 					temp_endpoints[l].device_bEndpointAddress = temp_endpoint.bEndpointAddress;
-					temp_endpoints[l].udc_maxpacket_limit = 0;
-					temp_endpoints[l].thread_read = 0;
-					temp_endpoints[l].thread_write = 0;
-					memset((void *)&temp_endpoints[l].thread_info, 0,
-						sizeof(temp_endpoints[l].thread_info));
+					temp_endpoints[l].device_wMaxPacketSize = temp_endpoint.wMaxPacketSize;
 					temp_endpoints[l].thread_info.ep_num = -1;
 				}
 				temp_altsettings[k].endpoints = temp_endpoints;
 			}
 			temp_interfaces[j].altsettings = temp_altsettings;
 			temp_interfaces[j].num_altsettings = device_config_desc[i]->interface[j].num_altsetting;
-			temp_interfaces[j].current_altsetting = 0;
 
 		}
 		host_device_desc.configs[i].interfaces = temp_interfaces;
@@ -441,18 +886,121 @@ int setup_host_usb_desc() {
 	return 0;
 }
 
+static void free_host_usb_desc()
+{
+	free(host_device_desc.arena);
+	host_device_desc.arena = NULL;
+	host_device_desc.configs = NULL;
+}
+
+// Attaches to the device, brings up the gadget and proxies until ep0_loop()
+// returns. Returns 0, or -1 on a fatal error.
+static int proxy_session(int vendor_id, int product_id, const char *driver,
+			 const char *device)
+{
+	// On a descriptor cache hit the device is opened in the background
+	// while the gadget enumerates.
+	int libusb_speed = -1;
+	if (descriptor_cache_enabled() && device_backend == &libusb_device_backend)
+		libusb_speed = descriptor_cache_load(vendor_id, product_id);
+	if (libusb_speed >= 0) {
+		descriptor_cache_connect_async(vendor_id, product_id);
+	}
+	else {
+		while (device_backend->connect(vendor_id, product_id)) {
+			if (please_stop_ep0)
+				return 0;
+			sleep(1);
+		}
+		printf("Device opened successfully\n");
+
+		// Detect physical device speed.
+		libusb_speed = device_backend->get_speed();
+	}
+	switch (libusb_speed) {
+	case LIBUSB_SPEED_LOW:
+		device_speed = USB_SPEED_LOW;
+		printf("Device speed: Low Speed (1.5Mbps)\n");
+		break;
+	case LIBUSB_SPEED_FULL:
+		device_speed = USB_SPEED_FULL;
+		printf("Device speed: Full Speed (12Mbps)\n");
+		break;
+	case LIBUSB_SPEED_HIGH:
+		device_speed = USB_SPEED_HIGH;
+		printf("Device speed: High Speed (480Mbps)\n");
+		break;
+	case LIBUSB_SPEED_SUPER:
+	case LIBUSB_SPEED_SUPER_PLUS:
+		device_speed = USB_SPEED_SUPER;
+		printf("Device speed: SuperSpeed (5Gbps+)\n");
+		break;
+	default:
+		device_speed = USB_SPEED_HIGH;
+		printf("Device speed: Unknown, defaulting to High Speed\n");
+		break;
+	}
+
+	// The gadget runs at high speed unless --superspeed is given for a
+	// SuperSpeed device; some UDCs (e.g., musb-hdrc) reject lower speeds,
+	// and FS bInterval values are converted in setup_host_usb_desc().
+	gadget_speed = USB_SPEED_HIGH;
+	if (superspeed_gadget) {
+		if (device_speed == USB_SPEED_SUPER)
+			gadget_speed = USB_SPEED_SUPER;
+		else
+			printf("[Warning] --superspeed needs a SuperSpeed device, "
+			       "using High Speed\n");
+	}
+	printf("Gadget speed: %s\n",
+		gadget_speed == USB_SPEED_SUPER ? "SuperSpeed" : "High Speed");
+
+	setup_host_usb_desc();
+	printf("Setup USB config successfully\n");
+
+	int fd = host_backend->open();
+	host_backend->init(fd, gadget_speed, driver, device);
+	host_backend->run(fd);
+
+	if (remap_host_endpoints_if_needed(fd) < 0) {
+		host_backend->close(fd);
+		return -1;
+	}
+
+	ep0_loop(fd);
+
+	host_backend->close(fd);
+	descriptor_cache_connect_join();
+
+	print_ep_stats();
+	print_injection_stats();
+	print_trace_replay_stats();
+	timeline_write();
+	snapshot_write();
+	descriptor_cache_store();
+
+	// The device tree itself is replaced by the next connect().
+	free_host_usb_desc();
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	const char *device = "dummy_udc.0";
 	const char *driver = "dummy_udc";
 	int vendor_id = -1;
 	int product_id = -1;
+	int diagnose_interval = 0;
+	std::string replay_trace_file;
+	bool replay_fast = false;
+	bool replay_verify = false;
 
 	struct sigaction action;
 	memset(&action, 0, sizeof(struct sigaction));
 	action.sa_handler = handle_signal;
 	sigaction(SIGTERM, &action, NULL);
 	sigaction(SIGINT, &action, NULL);
+	start_stats_monitor();
 
 	int opt, lopt, loidx;
 	const char *optstring = "hv";
@@ -468,6 +1016,23 @@ int main(int argc, char **argv)
 		{"enable_customized_config", no_argument, &lopt, 9},
 		{"auto_remap_endpoints", no_argument, &lopt, 10},
 		{"iso_batch_size", required_argument, &lopt, 11},
+		{"enum_trace", required_argument, &lopt, 12},
+		{"diagnose", required_argument, &lopt, 13},
+		{"emulate_device", required_argument, &lopt, 14},
+		{"emulate_host", required_argument, &lopt, 15},
+		{"record_trace", required_argument, &lopt, 16},
+		{"replay_trace", required_argument, &lopt, 17},
+		{"replay_fast", no_argument, &lopt, 18},
+		{"replay_verify", no_argument, &lopt, 19},
+		{"snapshot", required_argument, &lopt, 20},
+		{"clone", required_argument, &lopt, 21},
+		{"descriptor_cache", required_argument, &lopt, 22},
+		{"serial", required_argument, &lopt, 23},
+		{"iso_high_bandwidth", no_argument, &lopt, 24},
+		{"superspeed", no_argument, &lopt, 25},
+		{"uvc_repacketize", no_argument, &lopt, 26},
+		{"uac_jitter_ms", required_argument, &lopt, 27},
+		{"iso_in_latency", required_argument, &lopt, 28},
 		{0, 0, 0, 0}
 	};
 	while ((opt = getopt_long(argc, argv, optstring, long_options, &loidx)) != -1) {
@@ -520,6 +1085,69 @@ int main(int argc, char **argv)
 				iso_batch_size = ISO_BATCH_SIZE_MAX;
 			printf("Isochronous batch size set to %d\n", iso_batch_size);
 			break;
+		case 12:
+			timeline_enable(optarg);
+			printf("Enumeration timeline will be written to %s\n", optarg);
+			break;
+		case 13:
+			diagnose_interval = std::stoi(optarg);
+			if (diagnose_interval < 1)
+				diagnose_interval = 1;
+			printf("Bottleneck diagnosis every %d s\n", diagnose_interval);
+			break;
+		case 14:
+			emulated_device_file = optarg;
+			device_backend = &emulated_device_backend;
+			printf("Emulating the device described in %s\n", optarg);
+			break;
+		case 15:
+			emulated_host_file = optarg;
+			host_backend = &emulated_host_backend;
+			printf("Emulating the host scripted in %s\n", optarg);
+			break;
+		case 16:
+			trace_record_open(optarg);
+			printf("Recording endpoint traffic to %s\n", optarg);
+			break;
+		case 17:
+			replay_trace_file = optarg;
+			break;
+		case 18:
+			replay_fast = true;
+			break;
+		case 19:
+			replay_verify = true;
+			break;
+		case 20:
+			snapshot_enable(optarg);
+			printf("Device snapshot will be written to %s\n", optarg);
+			break;
+		case 21:
+			emulated_device_file = optarg;
+			device_backend = &emulated_device_backend;
+			printf("Cloning the device from snapshot %s\n", optarg);
+			break;
+		case 22:
+			descriptor_cache_enable(optarg);
+			break;
+		case 23:
+			serial_filter = optarg;
+			break;
+		case 24:
+			iso_high_bandwidth = true;
+			break;
+		case 25:
+			superspeed_gadget = true;
+			break;
+		case 26:
+			uvc_repacketize = true;
+			break;
+		case 27:
+			uac_jitter_ms = std::max(0, std::stoi(optarg));
+			break;
+		case 28:
+			iso_in_latency = std::max(0, std::stoi(optarg));
+			break;
 
 		default:
 			usage();
@@ -530,6 +1158,8 @@ int main(int argc, char **argv)
 	printf("Driver is: %s\n", driver);
 	printf("vendor_id is: %d\n", vendor_id);
 	printf("product_id is: %d\n", product_id);
+	if (!serial_filter.empty())
+		printf("serial is: %s\n", serial_filter.c_str());
 
 	if (injection_enabled) {
 		printf("Injection enabled\n");
@@ -553,6 +1183,7 @@ int main(int argc, char **argv)
 		}
 		ifs.close();
 		print_injection_summary();
+		init_injection_stats();
 	}
 
 	if (customized_config_enabled) {
@@ -583,79 +1214,33 @@ int main(int argc, char **argv)
 		}
 	}
 
-	while (connect_device(vendor_id, product_id)) {
-		sleep(1);
-	}
-	printf("Device opened successfully\n");
-
-	// Detect physical device speed.
-	int libusb_speed = libusb_get_device_speed(libusb_get_device(dev_handle));
-	switch (libusb_speed) {
-	case LIBUSB_SPEED_LOW:
-		device_speed = USB_SPEED_LOW;
-		printf("Device speed: Low Speed (1.5Mbps)\n");
-		break;
-	case LIBUSB_SPEED_FULL:
-		device_speed = USB_SPEED_FULL;
-		printf("Device speed: Full Speed (12Mbps)\n");
-		break;
-	case LIBUSB_SPEED_HIGH:
-		device_speed = USB_SPEED_HIGH;
-		printf("Device speed: High Speed (480Mbps)\n");
-		break;
-	case LIBUSB_SPEED_SUPER:
-	case LIBUSB_SPEED_SUPER_PLUS:
-		device_speed = USB_SPEED_SUPER;
-		printf("Device speed: SuperSpeed (5Gbps+)\n");
-		break;
-	default:
-		device_speed = USB_SPEED_HIGH;
-		printf("Device speed: Unknown, defaulting to High Speed\n");
-		break;
-	}
-
-	setup_host_usb_desc();
-	printf("Setup USB config successfully\n");
-
-	int fd = usb_raw_open();
-	// Always use USB_SPEED_HIGH for the gadget; some UDCs (e.g., musb-hdrc)
-	// reject lower speeds. We compensate by adjusting bInterval below.
-	usb_raw_init(fd, USB_SPEED_HIGH, driver, device);
-	usb_raw_run(fd);
-
-	if (remap_host_endpoints_if_needed(fd) < 0) {
-		close(fd);
-		return 1;
+	if (!replay_trace_file.empty()) {
+		if (device_backend != &emulated_device_backend &&
+		    host_backend != &emulated_host_backend) {
+			printf("--replay_trace needs --emulate_device and/or --emulate_host\n");
+			return 1;
+		}
+		trace_replay_load(replay_trace_file, replay_fast, replay_verify);
 	}
 
-	ep0_loop(fd);
-
-	close(fd);
+	if (diagnose_interval)
+		start_diagnose_monitor(diagnose_interval);
 
-	int bNumConfigurations = device_device_desc.bNumConfigurations;
-	for (int i = 0; i < bNumConfigurations; i++) {
-		int bNumInterfaces = device_config_desc[i]->bNumInterfaces;
-		for (int j = 0; j < bNumInterfaces; j++) {
-			int num_altsetting = device_config_desc[i]->interface[j].num_altsetting;
-			for (int k = 0; k < num_altsetting; k++) {
-				if (host_device_desc.configs[i].interfaces[j].altsettings[k].endpoints) {
-					delete[] host_device_desc.configs[i].interfaces[j].altsettings[k].endpoints;
-				}
-			}
-			delete[] host_device_desc.configs[i].interfaces[j].altsettings;
-		}
-		delete[] host_device_desc.configs[i].interfaces;
+	// One iteration per attach: when the device is unplugged the gadget
+	// is torn down and the proxy waits for the device to come back.
+	while (true) {
+		if (proxy_session(vendor_id, product_id, driver, device) < 0)
+			return 1;
+		if (!device_unplugged || signal_received)
+			break;
+		printf("Device unplugged, waiting for it to come back\n");
+		device_unplugged = false;
+		please_stop_ep0 = false;
+		please_stop_eps = false;
 	}
-	delete[] host_device_desc.configs;
-	delete[] device_config_desc;
 
-	if (context && callback_handle != -1) {
-		libusb_hotplug_deregister_callback(context, callback_handle);
-	}
-	if (hotplug_monitor_thread &&
-		pthread_join(hotplug_monitor_thread, NULL)) {
-		fprintf(stderr, "Error join hotplug_monitor_thread\n");
-	}
+	trace_record_close();
+	device_backend->disconnect();
 
 	return 0;
 }
@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <string.h>
+
+#include "uvc.h"
+#include "stats.h"
+
+// bmHeaderInfo bits (UVC 1.5, 2.4.3.3)
+#define UVC_STREAM_FID		0x01
+#define UVC_STREAM_EOF		0x02
+#define UVC_STREAM_ERR		0x40
+
+#define UVC_MICROFRAMES_PER_SEC	8000
+
+static int payload_header_length(const uint8_t *data, int length)
+{
+	if (length < 2)
+		return -1;
+	int header_length = data[0];
+	if (header_length < 2 || header_length > UVC_PAYLOAD_HEADER_MAX ||
+	    header_length > length)
+		return -1;
+	return header_length;
+}
+
+int uvc_payload_pieces(const uint8_t *data, int length, int max_length)
+{
+	if (length <= max_length)
+		return 1;
+	int header_length = payload_header_length(data, length);
+	if (header_length < 0 || max_length <= header_length)
+		return 1;
+
+	int chunk = max_length - header_length;
+	int video = length - header_length;
+	return std::max(1, (video + chunk - 1) / chunk);
+}
+
+int uvc_payload_piece(const uint8_t *data, int length, int max_length,
+		      int index, uint8_t *out)
+{
+	int pieces = uvc_payload_pieces(data, length, max_length);
+	if (pieces == 1) {
+		memcpy(out, data, length);
+		return length;
+	}
+
+	int header_length = data[0];
+	int chunk = max_length - header_length;
+	int offset = header_length + index * chunk;
+	int piece_length = std::min(chunk, length - offset);
+
+	memcpy(out, data, header_length);
+	if (index != pieces - 1)
+		out[1] &= ~UVC_STREAM_EOF;
+	memcpy(out + header_length, data + offset, piece_length);
+	return header_length + piece_length;
+}
+
+bool uvc_stream_fits(uint32_t frame_size, uint32_t frame_interval,
+		     unsigned int bytes_per_interval)
+{
+	if (!frame_interval || bytes_per_interval <= UVC_PAYLOAD_HEADER_MAX)
+		return false;
+
+	// Every piece carries its own header.
+	double needed = (double)frame_size * 10000000.0 / frame_interval;
+	double capacity = (double)(bytes_per_interval - UVC_PAYLOAD_HEADER_MAX) *
+			  UVC_MICROFRAMES_PER_SEC;
+	return needed <= capacity;
+}
+
+void uvc_stream_init(struct uvc_stream *stream)
+{
+	stream->fid = -1;
+	stream->in_frame = false;
+	stream->dropping = false;
+	stream->fid_flip = false;
+	stream->frame_bytes = 0;
+}
+
+static void uvc_frame_end(struct uvc_stream *stream, struct ep_stats *stats)
+{
+	stream->in_frame = false;
+	if (stream->dropping || !stats)
+		return;
+
+	uint64_t now = stats_now_ns();
+	uint64_t zero = 0;
+	stats->uvc_first_frame_ns.compare_exchange_strong(zero, now);
+	stats->uvc_last_frame_ns = now;
+	stats->uvc_frames++;
+	stats->uvc_frame_bytes += stream->frame_bytes;
+}
+
+bool uvc_stream_payload(struct uvc_stream *stream, uint8_t *data, int length,
+			bool congested, bool full, struct ep_stats *stats)
+{
+	int header_length = payload_header_length(data, length);
+	if (header_length < 0 || (data[1] & UVC_STREAM_ERR))
+		return !stream->dropping;
+
+	int fid = data[1] & UVC_STREAM_FID;
+	if (stream->in_frame && fid != stream->fid)
+		uvc_frame_end(stream, stats);	// previous frame lost its EOF
+
+	if (!stream->in_frame) {
+		// Header-only payloads between frames, and any still carrying
+		// the FID of the frame that just ended, do not open a frame.
+		// They are flipped like that frame and pass while there is room.
+		if (length == header_length || fid == stream->fid) {
+			if (congested)
+				return false;
+			if (stream->fid_flip)
+				data[1] ^= UVC_STREAM_FID;
+			return true;
+		}
+		stream->fid = fid;
+		stream->in_frame = true;
+		stream->frame_bytes = 0;
+		stream->dropping = congested;
+		if (stream->dropping) {
+			// The next forwarded frame must toggle against the
+			// last one the host saw.
+			stream->fid_flip = !stream->fid_flip;
+			if (stats)
+				stats->uvc_frames_dropped++;
+		}
+	} else if (full && !stream->dropping) {
+		// The rest of the frame cannot be queued; the host discards
+		// the incomplete frame at the next FID toggle.
+		stream->dropping = true;
+		if (stats)
+			stats->uvc_frames_dropped++;
+	}
+
+	bool forward = !stream->dropping;
+	if (forward) {
+		if (stream->fid_flip)
+			data[1] ^= UVC_STREAM_FID;
+		stream->frame_bytes += length - header_length;
+	}
+	if (data[1] & UVC_STREAM_EOF)
+		uvc_frame_end(stream, stats);
+	return forward;
+}
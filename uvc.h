@@ -0,0 +1,49 @@
+#ifndef USB_PROXY_UVC_H
+#define USB_PROXY_UVC_H
+
+#include <stdint.h>
+
+struct ep_stats;
+
+// UVC payload repacketization (--uvc_repacketize): isochronous video
+// payloads from the device that are larger than the UDC's packets are split
+// into several UDC-sized payloads. Each piece gets a copy of the payload
+// header (FID, PTS and SCR included); only the last piece keeps EOF.
+
+#define UVC_PAYLOAD_HEADER_MAX	12
+
+// Number of pieces the payload is split into; 1 if it fits into max_length
+// or its header is not a valid UVC payload header.
+int uvc_payload_pieces(const uint8_t *data, int length, int max_length);
+// Writes piece index (0-based) of the payload to out; returns its length.
+int uvc_payload_piece(const uint8_t *data, int length, int max_length,
+		      int index, uint8_t *out);
+
+// Whether a stream of frame_size byte frames every frame_interval (100 ns
+// units) fits through an endpoint carrying bytes_per_interval per
+// microframe once it is repacketized.
+bool uvc_stream_fits(uint32_t frame_size, uint32_t frame_interval,
+		     unsigned int bytes_per_interval);
+
+// Frame tracking on a video streaming endpoint. Frames are delimited by the
+// FID bit toggling or by EOF. When the endpoint queue backs up, whole frames
+// are skipped from their first payload on; the FID of the frames forwarded
+// afterwards is flipped as needed so that the host still sees it toggle
+// once per frame.
+struct uvc_stream {
+	int		fid;		// FID of the current or last frame, -1 before the first
+	bool		in_frame;	// a frame has started and not yet ended
+	bool		dropping;	// the current frame is being discarded
+	bool		fid_flip;	// invert FID on forwarded payloads
+	uint32_t	frame_bytes;	// video bytes forwarded for the current frame
+};
+
+void uvc_stream_init(struct uvc_stream *stream);
+// Inspects a payload from the device (and adjusts its FID in place). A frame
+// starting while congested is dropped whole; a frame is abandoned if this
+// payload would overflow the queue (full). Returns whether to forward the
+// payload. Frame counters go to stats, which may be NULL.
+bool uvc_stream_payload(struct uvc_stream *stream, uint8_t *data, int length,
+			bool congested, bool full, struct ep_stats *stats);
+
+#endif // USB_PROXY_UVC_H